@@ -0,0 +1,321 @@
+#include "../src/global.h"
+
+
+/* Load generator and upstream stand-ins for bench/run.sh. Every
+   client test prints one JSON object per line. */
+
+
+char *executable = NULL;
+char *cmd_name = NULL;
+int opt_verbose = 0;
+
+
+#define MAX_EVENTS   64
+#define BULK_SIZE    65536
+#define UDP_SIZE     64
+#define UDP_BATCH    32
+#define MAX_SAMPLES  (1 << 20)
+
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static struct sockaddr_in parse_addr(char const *host, int port) {
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+  };
+
+  ERROR(inet_pton(AF_INET, host, &(addr.sin_addr)) != 1, "bad address '%s'\n", host);
+  return addr;
+}
+
+
+static int tcp_connect(struct sockaddr_in const *addr) {
+  int fd = -1;
+  PERROR(==-1, fd = socket, AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  int opt = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  PERROR(==-1, connect, fd, addr, sizeof(*addr));
+  return fd;
+}
+
+
+static int tcp_listen(struct sockaddr_in const *addr) {
+  int fd = -1;
+  PERROR(==-1, fd = socket, AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  PERROR(==-1, bind, fd, addr, sizeof(*addr));
+  PERROR(==-1, listen, fd, SOMAXCONN);
+  return fd;
+}
+
+
+/* one byte there and back again */
+static int round_trip(int fd, int is_tcp) {
+  char byte = 'x';
+
+  if (send(fd, &byte, 1, MSG_NOSIGNAL) != 1) {
+    return -1;
+  }
+
+  ssize_t received;
+  RETRY_ON_INTR(received = recv, fd, &byte, 1, is_tcp?MSG_WAITALL:0);
+  return (received == 1)?0:-1;
+}
+
+
+/* Echo on tcp and udp port, discard on tcp port+1, all from one
+   epoll loop. */
+static int serve(char const *host, int port) {
+  struct sockaddr_in echo_addr = parse_addr(host, port);
+  struct sockaddr_in sink_addr = parse_addr(host, port+1);
+
+  int echo_fd = tcp_listen(&echo_addr);
+  int sink_fd = tcp_listen(&sink_addr);
+
+  int udp_fd = -1;
+  PERROR(==-1, udp_fd = socket, AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  PERROR(==-1, bind, udp_fd, &echo_addr, sizeof(echo_addr));
+
+  int poll_fd = -1;
+  PERROR(==-1, poll_fd = epoll_create1, EPOLL_CLOEXEC);
+
+  /* the low bit of the data marks a sink connection */
+  void watch(int fd, uint64_t tag) {
+    struct epoll_event event = {.events = EPOLLIN, .data = {.u64 = ((uint64_t)fd << 1) | tag}};
+    PERROR(==-1, epoll_ctl, poll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  watch(echo_fd, 0);
+  watch(sink_fd, 1);
+  watch(udp_fd, 0);
+
+  static char buf[BULK_SIZE];
+  struct epoll_event events[MAX_EVENTS];
+
+  for(;;) {
+    int nfds;
+    RETRY_ON_INTR(nfds = epoll_wait, poll_fd, events, MAX_EVENTS, -1);
+    ERROR(nfds == -1, "epoll_wait: %s\n", strerror(errno));
+
+    for(int i=0; i<nfds; i++) {
+      int fd = events[i].data.u64 >> 1;
+      int sink = events[i].data.u64 & 1;
+
+      if ((fd == echo_fd) || (fd == sink_fd)) {
+        int conn_fd;
+        while ((conn_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+          int opt = 1;
+          setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+          watch(conn_fd, sink);
+        }
+        continue;
+      }
+
+      if (fd == udp_fd) {
+        struct sockaddr_in peer;
+        socklen_t size = sizeof(peer);
+        ssize_t received;
+
+        while ((received = recvfrom(udp_fd, buf, sizeof(buf), 0, &peer, &size)) >= 0) {
+          sendto(udp_fd, buf, received, 0, &peer, size);
+          size = sizeof(peer);
+        }
+        continue;
+      }
+
+      ssize_t received = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+      if (received == 0 || ((received == -1) && (errno != EAGAIN) && (errno != EINTR))) {
+        close(fd);
+      } else if ((received > 0) && !sink) {
+        send(fd, buf, received, MSG_NOSIGNAL);
+      }
+    }
+  }
+
+  return EXIT_FAILURE;
+}
+
+
+static long long samples[MAX_SAMPLES];
+static int sample_count = 0;
+
+
+static void sample(long long ns) {
+  if (sample_count < MAX_SAMPLES) {
+    samples[sample_count++] = ns;
+  }
+}
+
+
+static int compare(void const *a, void const *b) {
+  long long x = *(long long const *)a, y = *(long long const *)b;
+  return (x > y) - (x < y);
+}
+
+
+static double percentile_us(int permille) {
+  if (!sample_count) {
+    return 0;
+  }
+
+  int i = (long long)sample_count * permille / 1000;
+  return samples[(i < sample_count)?i:(sample_count-1)] / 1000.0;
+}
+
+
+static void report(char const *test, char const *path, char const *mode, char const *unit, double value, int errors) {
+  printf("{\"test\":\"%s\",\"path\":\"%s\",\"mode\":\"%s\",\"value\":%.1f,\"unit\":\"%s\"",
+         test, path, mode, value, unit);
+
+  if (sample_count) {
+    qsort(samples, sample_count, sizeof(long long), compare);
+    printf(",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f",
+           percentile_us(500), percentile_us(990), percentile_us(999));
+  }
+
+  printf(",\"errors\":%d}\n", errors);
+  fflush(stdout);
+}
+
+
+static int client(char const *test, char const *host, int port, double seconds, char const *path, char const *mode) {
+  struct sockaddr_in addr = parse_addr(host, port);
+  long long start = now_ns();
+  long long end = start + (long long)(seconds * 1e9);
+  int errors = 0;
+
+  if (!strcmp(test, "tcp_bulk")) {
+    struct sockaddr_in sink = parse_addr(host, port+1);
+    int fd = tcp_connect(&sink);
+    static char buf[BULK_SIZE];
+    long long bytes = 0;
+
+    while (now_ns() < end) {
+      ssize_t sent = send(fd, buf, sizeof(buf), MSG_NOSIGNAL);
+      ERROR(sent == -1, "send: %s\n", strerror(errno));
+      bytes += sent;
+    }
+
+    close(fd);
+    report(test, path, mode, "Mbit/s", bytes * 8 / ((now_ns() - start) / 1e3), errors);
+  } else if (!strcmp(test, "tcp_crr")) {
+    long long count = 0;
+
+    while (now_ns() < end) {
+      long long t = now_ns();
+      int fd = tcp_connect(&addr);
+
+      if (round_trip(fd, 1) == -1) {
+        errors += 1;
+      } else {
+        sample(now_ns() - t);
+        count += 1;
+      }
+
+      close(fd);
+    }
+
+    report(test, path, mode, "conn/s", count / ((now_ns() - start) / 1e9), errors);
+  } else if (!strcmp(test, "tcp_rr")) {
+    int fd = tcp_connect(&addr);
+    long long count = 0;
+
+    while (now_ns() < end) {
+      long long t = now_ns();
+      ERROR(round_trip(fd, 1) == -1, "tcp round trip failed\n");
+      sample(now_ns() - t);
+      count += 1;
+    }
+
+    close(fd);
+    report(test, path, mode, "trans/s", count / ((now_ns() - start) / 1e9), errors);
+  } else if (!strcmp(test, "udp_pps") || !strcmp(test, "udp_rr")) {
+    int fd = -1;
+    PERROR(==-1, fd = socket, AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+    PERROR(==-1, connect, fd, &addr, sizeof(addr));
+
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = 100000};
+    PERROR(==-1, setsockopt, fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    long long count = 0;
+
+    if (!strcmp(test, "udp_rr")) {
+      while (now_ns() < end) {
+        long long t = now_ns();
+
+        if (round_trip(fd, 0) == -1) {
+          errors += 1;
+        } else {
+          sample(now_ns() - t);
+          count += 1;
+        }
+      }
+
+      report(test, path, mode, "trans/s", count / ((now_ns() - start) / 1e9), errors);
+    } else {
+      /* a window of datagrams in flight, echoes are counted */
+      static char bufs[UDP_BATCH][UDP_SIZE];
+      struct iovec iovs[UDP_BATCH];
+      struct mmsghdr msgs[UDP_BATCH];
+
+      for(int i=0; i<UDP_BATCH; i++) {
+        iovs[i] = (struct iovec){.iov_base = bufs[i], .iov_len = UDP_SIZE};
+        msgs[i] = (struct mmsghdr){.msg_hdr = {.msg_iov = &(iovs[i]), .msg_iovlen = 1}};
+      }
+
+      while (now_ns() < end) {
+        int sent;
+        RETRY_ON_INTR(sent = sendmmsg, fd, msgs, UDP_BATCH, 0);
+        ERROR(sent == -1, "sendmmsg: %s\n", strerror(errno));
+
+        for(int waiting = sent; waiting > 0;) {
+          int received = recvmmsg(fd, msgs, waiting, MSG_WAITFORONE, NULL);
+          if (received <= 0) {
+            errors += waiting;
+            break;
+          }
+
+          count += received;
+          waiting -= received;
+        }
+      }
+
+      report(test, path, mode, "pkt/s", count / ((now_ns() - start) / 1e9), errors);
+    }
+
+    close(fd);
+  } else {
+    ERROR(1, "unknown test '%s'\n", test);
+  }
+
+  return 0;
+}
+
+
+int main(int argc, char *const argv[]) {
+  executable = argv[0];
+
+  if ((argc == 4) && !strcmp(argv[1], "serve")) {
+    return serve(argv[2], atoi(argv[3]));
+  }
+
+  if ((argc == 8) && !strcmp(argv[1], "client")) {
+    return client(argv[2], argv[3], atoi(argv[4]), atof(argv[5]), argv[6], argv[7]);
+  }
+
+  fprintf(stderr,
+          "Usage: %s serve ADDR PORT\n"
+          "       %s client TEST ADDR PORT SECONDS PATH MODE\n"
+          "\n"
+          "  TEST is one of tcp_bulk, tcp_crr, tcp_rr, udp_pps, udp_rr\n",
+          executable, executable);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+#
+# Measures the proxy against a direct connection, on loopback and over
+# a veth pair. Results are printed as one JSON object per line.
+#
+#   bench-host   the outer namespace, socketd runs here, and the
+#                loopback upstream at 10.1.0.1
+#   bench-up     a netns behind veth, the veth upstream at 10.2.0.2
+#   bench-proxy  a namespace set up by share/setup-proxy-rules.sh,
+#                where the clients go through the proxy
+#
+# BENCH_SECONDS sets the length of each test (default 5).
+
+set -e
+
+HERE="$(dirname $(readlink -f ${BASH_SOURCE[0]}))"
+ROOT="$(dirname ${HERE})"
+USERNS="${ROOT}/bin/userns"
+BENCH="${ROOT}/bin/userns-bench"
+
+SECONDS_PER_TEST="${BENCH_SECONDS:-5}"
+PORT=5201
+TESTS="tcp_bulk tcp_crr tcp_rr udp_pps udp_rr"
+TARGETS="loopback:10.1.0.1 veth:10.2.0.2"
+
+run_tests() {
+  local mode="$1" target
+  for target in ${TARGETS}; do
+    for test in ${TESTS}; do
+      "${BENCH}" client "${test}" "${target#*:}" "${PORT}" "${SECONDS_PER_TEST}" "${target%%:*}" "${mode}"
+    done
+  done
+}
+
+case "$1" in
+  "")
+    export XDG_RUNTIME_DIR="${XDG_RUNTIME_DIR:-$(mktemp -d)}"
+    exec "${USERNS}" spawn -n bench-host --net --user --init \
+         "${HERE}/run.sh" host
+  ;;
+
+  host)
+    ip link set lo up
+    ip address add 10.1.0.1/32 dev lo
+
+    ip netns add bench-up
+    ip link add veth-host type veth peer name veth-up
+    ip link set veth-up netns bench-up
+    ip address add 10.2.0.1/24 dev veth-host
+    ip link set veth-host up
+    ip netns exec bench-up ip link set lo up
+    ip netns exec bench-up ip address add 10.2.0.2/24 dev veth-up
+    ip netns exec bench-up ip link set veth-up up
+
+    "${BENCH}" serve 10.1.0.1 "${PORT}" &
+    ip netns exec bench-up "${BENCH}" serve 10.2.0.2 "${PORT}" &
+    mkdir -p "${XDG_RUNTIME_DIR}/userns/bench-proxy"
+    "${USERNS}" socketd -n bench-proxy &
+    sleep 0.5
+
+    run_tests direct
+    "${USERNS}" spawn -n bench-proxy --net --init \
+      "${HERE}/run.sh" proxy
+
+    kill $(jobs -p)
+    ip netns delete bench-up
+  ;;
+
+  proxy)
+    "${ROOT}/share/setup-proxy-rules.sh" > /dev/null
+    "${USERNS}" proxy tcp 3128 &
+    "${USERNS}" proxy udp 3128 &
+    sleep 0.5
+
+    run_tests proxy
+    kill $(jobs -p)
+  ;;
+esac
@@ -3,6 +3,7 @@
 
 static char *opt_name = NULL;
 static int flags = 0;
+static int opt_exec_batch = 0;
 
 
 static struct option options[] = {
@@ -15,6 +16,7 @@ static struct option options[] = {
   {"net",          no_argument,       NULL, CLONE_NEWNET},
   {"mount",        no_argument,       NULL, CLONE_NEWNS},
 
+  {"exec-batch",   no_argument,       NULL, 'b'},
   {"verbose",      no_argument,       NULL, 'v'},
   {"help",         no_argument,       NULL, 'h'},
   {NULL,           no_argument,       NULL, 0}
@@ -23,6 +25,7 @@ static struct option options[] = {
 
 static void show_usage() {
   printf("Usage: %s %s [options] [--] [command]\n", executable, cmd_name);
+  printf("       %s %s [options] --exec-batch [--] command...\n", executable, cmd_name);
   printf("\n"
          "  -n, --name=NAME            name of the namespace\n"
          "\n"
@@ -33,13 +36,26 @@ static void show_usage() {
          "      --net                  attach NET namespace\n"
          "      --mount                attach MOUNT namespace\n"
          "\n"
+         "      --exec-batch           run each argument with sh, one after\n"
+         "                             another, in the same namespaces\n"
+         "\n"
          "  -h, --help                 print help message and exit\n"
          );
   exit(0);
 }
 
 
-static int attach(char const *pid_str, char *const argv[]) {
+/* One setns on the pidfd enters all of them at once. Kernels before
+   5.8 only take ns files, then each is opened under /proc. */
+static void enter_namespaces(int pidfd, char const *pid_str) {
+  if (setns(pidfd, flags) == 0) {
+    return;
+  }
+
+  ERROR(errno == ESRCH, "namespace '%s' has gone\n", opt_name);
+  ERROR(errno != EINVAL, "setns: %s\n", strerror(errno));
+  VERBOSE("setns on pidfd failed, opening ns files\n");
+
   static const int mask[] = {
     CLONE_NEWUSER,
     CLONE_NEWUTS,
@@ -72,38 +88,64 @@ static int attach(char const *pid_str, char *const argv[]) {
     close(fd);
   }
 
-  if (!(flags & mask[3])) {
+  ERROR(pidfd_exited(pidfd), "namespace '%s' has gone\n", opt_name);
+}
+
+
+static int run(char *const argv[]) {
+  pid_t pid = -1;
+  PERROR(==-1, pid = fork);
+
+  if (pid == 0) {
     PERROR(==-1, execvp, argv[0], argv);
-    return EXIT_FAILURE;
-  } else {
-    pid_t pid = -1;
-    PERROR(==-1, pid = fork);
+    exit(EXIT_FAILURE);
+  }
 
-    if (pid == 0) {
-      PERROR(==-1, execvp, argv[0], argv);
-      return EXIT_FAILURE;
+  for(;;) {
+    int status;
+    PERROR(==-1, waitpid, pid, &status, 0);
+
+    if (WIFSTOPPED(status)) {
+      continue;
     }
 
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
+    if (WIFSIGNALED(status)) {
+      return WTERMSIG(status) + 128;
+    } else {
+      return WEXITSTATUS(status);
+    }
+  }
+
+  return EXIT_FAILURE;
+}
 
-    for(;;) {
-      int status;
-      PERROR(==-1, waitpid, pid, &status, 0);
 
-      if (WIFSTOPPED(status)) {
-        continue;
-      }
+static int attach(int pidfd, char const *pid_str, char *const argv[]) {
+  enter_namespaces(pidfd, pid_str);
+  close(pidfd);
 
-      if (WIFSIGNALED(status)) {
-        return WTERMSIG(status) + 128;
-      } else {
-        return WEXITSTATUS(status);
-      }
+  if (opt_exec_batch) {
+    /* every argument is a command for sh, all run in this context */
+    int result = 0;
+
+    for(; *argv; argv++) {
+      char *const args[] = {"/bin/sh", "-c", *argv, NULL};
+      VERBOSE("running '%s'\n", *argv);
+      int status = run(args);
+      result = status?status:result;
     }
 
+    return result;
+  }
+
+  if (!(flags & CLONE_NEWPID)) {
+    PERROR(==-1, execvp, argv[0], argv);
     return EXIT_FAILURE;
   }
+
+  close(STDIN_FILENO);
+  close(STDOUT_FILENO);
+  return run(argv);
 }
 
 
@@ -123,6 +165,14 @@ int cmd_attach(int argc, char *const argv[]) {
       show_usage();
       break;
 
+    case 'b':
+      opt_exec_batch = 1;
+      break;
+
+    case 'v':
+      opt_verbose = 1;
+      break;
+
     default:
       flags |= opt;
       break;
@@ -130,6 +180,7 @@ int cmd_attach(int argc, char *const argv[]) {
   }
 
   BADOPT(!opt_name, "missing name\n");
+  BADOPT(opt_exec_batch && (optind >= argc), "missing commands\n");
   setenv("USERNS_NAME", opt_name, 1);
 
   char *rundir = getenv("XDG_RUNTIME_DIR");
@@ -138,26 +189,27 @@ int cmd_attach(int argc, char *const argv[]) {
   char pid_filename[PATH_MAX] = {0};
   snprintf(pid_filename, PATH_MAX, "%s/userns/%s/pid", rundir, opt_name);
 
-  int pid_fd = -1;
-  PERROR(==-1, pid_fd = open, pid_filename, O_RDONLY);
+  FILE *pid_file = fopen(pid_filename, "re");
+  ERROR(!pid_file, "cannot open '%s': %s\n", pid_filename, strerror(errno));
 
-  ERROR(flock(pid_fd, LOCK_EX|LOCK_NB) != -1, "namespace '%s' has gone\n", opt_name);
-  ERROR(errno != EWOULDBLOCK, "flock: %s\n", strerror(errno));
+  long pid = 0;
+  unsigned long long start_time = 0;
+  int fields = fscanf(pid_file, "%ld %llu", &pid, &start_time);
+  fclose(pid_file);
+  ERROR((fields < 1) || (pid <= 0), "bad pid file '%s'\n", pid_filename);
 
-  FILE *pid_file = fdopen(pid_fd, "r");
-  fseek(pid_file, 0, SEEK_END);
-  size_t size = ftell(pid_file);
-  rewind(pid_file);
-  char *pid_str = alloca(size+1);
-  PERROR(==size, fread, pid_str, size, 1, pid_file);
-  pid_str[size] = 0;
+  /* the start time tells whether pid still is the namespace spawned,
+     from then on the pidfd keeps pointing at it */
+  int pidfd = open_pidfd(pid);
+  ERROR((pidfd == -1) && (errno == ESRCH), "namespace '%s' has gone\n", opt_name);
+  ERROR(pidfd == -1, "pidfd_open: %s\n", strerror(errno));
+  ERROR((fields == 2) && (proc_start_time(pid) != start_time),
+        "namespace '%s' has gone\n", opt_name);
 
-  errno = 0;
-  char *endptr = NULL;
-  strtol(pid_str, &endptr, 10);
-  ERROR(errno || (endptr == pid_str), "bad pid '%s'\n", pid_str);
+  char pid_str[32];
+  snprintf(pid_str, sizeof(pid_str), "%ld", pid);
 
-  return attach(pid_str, make_argv(optind, argc, argv));
+  return attach(pidfd, pid_str, opt_exec_batch?(argv+optind):make_argv(optind, argc, argv));
 err:
   fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
   exit(EXIT_FAILURE);
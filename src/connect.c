@@ -1,7 +1,15 @@
 #include "global.h"
 
 
+static int opt_master = 0;
+static int opt_tty = 0;
+static int opt_forward = 0;
+
+
 static struct option options[] = {
+  {"master",       no_argument,       NULL, 'm'},
+  {"tty",          no_argument,       NULL, 't'},
+  {"forward",      required_argument, NULL, 'f'},
   {"help",         no_argument,       NULL, 'h'},
 
   {NULL,           no_argument,       NULL, 0}
@@ -9,17 +17,584 @@ static struct option options[] = {
 
 
 static void show_usage() {
-  printf("Usage: %s %s [options] name\n", executable, cmd_name);
+  printf("Usage: %s %s [options] name [command]\n", executable, cmd_name);
   printf("\n"
+         "  -m, --master               keep one connection open, later connects\n"
+         "                             to name open channels on it\n"
+         "  -t, --tty                  run command on a pty\n"
+         "  -f, --forward=PORT         relay stdin and stdout to tcp PORT on\n"
+         "                             the loopback of the namespace\n"
 	 "  -h, --help                 print help message and exit\n"
 	 );
   exit(0);
 }
 
+
+/* A channel as seen from connect: the stdio fds of whoever opened it,
+   and, under --master, the socket to that local client. */
+struct channel {
+  uint32_t id;
+  int control_fd;
+  int source_fd;
+  int sink_fds[2];
+  int eof_sent;
+  int closed;
+  int32_t status;
+  uint32_t window;
+  size_t unacked;
+  struct relay_buffer pending[2];
+  size_t control_size;
+  char control[sizeof(struct mux_header) + sizeof(struct winsize)];
+};
+
+
+/* A local client of the master whose stdio fds and MUX_OPEN frame
+   are still on their way. */
+struct opener {
+  int control_fd;
+  int stdio[3];
+  size_t size;
+  char frame[MUX_FRAME_SIZE];
+};
+
+
+#define MAX_OPENERS 16
+
+
+static struct channel *channels[MUX_MAX_CHANNELS];
+static int channel_count = 0;
+static struct opener *openers[MAX_OPENERS];
+static int opener_count = 0;
+static uint32_t next_id = 1;
+static struct relay_buffer input, output;
+static struct termios saved_termios;
+
+
+static void restore_terminal() {
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &saved_termios);
+}
+
+
+static void close_fd(int *fd) {
+  if (*fd != -1) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+
+static struct channel *find_channel(uint32_t id) {
+  for(int i=0; i<channel_count; i++) {
+    if (channels[i]->id == id) {
+      return channels[i];
+    }
+  }
+
+  return NULL;
+}
+
+
+/* The MUX_OPEN frame for what the options and arguments ask for. */
+static size_t make_open(char *frame, size_t size, int argc, char *const argv[]) {
+  struct mux_open request = {
+    .kind = opt_forward?MUX_FORWARD:((opt_tty || !argc)?MUX_PTY:MUX_EXEC),
+    .port = opt_forward,
+    .argc = opt_forward?0:argc,
+  };
+
+  if (ioctl(STDIN_FILENO, TIOCGWINSZ, &(request.size)) == -1) {
+    request.size = (struct winsize){.ws_row = 24, .ws_col = 80};
+  }
+
+  size_t len = sizeof(struct mux_header) + sizeof(request);
+
+  for(uint32_t i=0; i<request.argc; i++) {
+    size_t arg_len = strlen(argv[i]) + 1;
+    ERROR(len + arg_len > size, "command is too long\n");
+    memcpy(frame + len, argv[i], arg_len);
+    len += arg_len;
+  }
+
+  struct mux_header header = {.type = MUX_OPEN, .size = len - sizeof(struct mux_header)};
+  memcpy(frame, &header, sizeof(header));
+  memcpy(frame + sizeof(header), &request, sizeof(request));
+  return len;
+}
+
+
+/* Takes fds 0, 1 and 2 of the opener as the channel's, opened again
+   so they can be non-blocking, and sends frame to open it. */
+static struct channel *add_channel(int control_fd, int const stdio[3], char *frame, size_t size) {
+  ERROR(channel_count == MUX_MAX_CHANNELS, "too many channels\n");
+
+  struct channel *channel = calloc(1, sizeof(struct channel));
+  ERROR(!channel, "cannot allocate channel\n");
+
+  channel->id = next_id++;
+  channel->control_fd = control_fd;
+  channel->window = MUX_WINDOW_SIZE;
+  channel->source_fd = relay_reopen(stdio[0], O_RDONLY);
+  channel->sink_fds[0] = relay_reopen(stdio[1], O_WRONLY);
+  channel->sink_fds[1] = relay_reopen(stdio[2], O_WRONLY);
+
+  memcpy(frame, &(channel->id), sizeof(channel->id));
+
+  if ((channel->sink_fds[0] == -1) || (channel->sink_fds[1] == -1) ||
+      (relay_append(&output, frame, size) == -1)) {
+    channel->closed = 1;
+    channel->status = EXIT_FAILURE;
+  }
+
+  channels[channel_count++] = channel;
+  return channel;
+}
+
+
+static void free_channel(int i) {
+  struct channel *channel = channels[i];
+
+  if (channel->control_fd != -1) {
+    send(channel->control_fd, &(channel->status), sizeof(channel->status), MSG_NOSIGNAL);
+    close(channel->control_fd);
+  }
+
+  close_fd(&(channel->source_fd));
+  close_fd(&(channel->sink_fds[0]));
+  close_fd(&(channel->sink_fds[1]));
+  free(channel);
+
+  channels[i] = channels[--channel_count];
+}
+
+
+/* Returns -1 if the other side has broken the protocol. */
+static int handle_frame(struct mux_header *header, char *payload) {
+  struct channel *channel = find_channel(header->channel);
+  if (!channel || channel->closed) {
+    return 0;
+  }
+
+  switch(header->type) {
+  case MUX_DATA:
+  case MUX_STDERR: {
+    int i = (header->type == MUX_STDERR);
+    if (channel->sink_fds[i] == -1) {
+      channel->unacked += header->size;
+    } else if (relay_append(&(channel->pending[i]), payload, header->size) == -1) {
+      LOG("channel %u: data beyond the window\n", channel->id);
+      return -1;
+    }
+    break;
+  }
+
+  case MUX_WINDOW:
+    if (header->size == sizeof(uint32_t)) {
+      uint32_t size;
+      memcpy(&size, payload, sizeof(size));
+      channel->window += size;
+    }
+    break;
+
+  case MUX_CLOSE:
+    channel->closed = 1;
+    if (header->size == sizeof(int32_t)) {
+      memcpy(&(channel->status), payload, sizeof(int32_t));
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+
+static void add_opener(int control_fd) {
+  struct opener *opener = malloc(sizeof(struct opener));
+  ERROR(!opener, "cannot allocate opener\n");
+
+  opener->control_fd = control_fd;
+  opener->size = 0;
+  for(int i=0; i<3; i++) {
+    opener->stdio[i] = -1;
+  }
+
+  openers[opener_count++] = opener;
+}
+
+
+static void free_opener(int i, int keep_control) {
+  struct opener *opener = openers[i];
+
+  if (!keep_control) {
+    close(opener->control_fd);
+  }
+
+  for(int j=0; j<3; j++) {
+    close_fd(&(opener->stdio[j]));
+  }
+
+  free(opener);
+  openers[i] = openers[--opener_count];
+}
+
+
+/* Reads what has arrived of the stdio fds and the MUX_OPEN frame,
+   without waiting for the rest. Returns 1 once all of it is there,
+   0 if some is missing, -1 if the opener has gone or sent garbage. */
+static int read_opener(struct opener *opener) {
+  if (opener->stdio[0] == -1) {
+    int count = recv_fds(opener->control_fd, opener->stdio, 3, MSG_DONTWAIT);
+
+    if (count == -1) {
+      return (errno == EAGAIN)?0:-1;
+    }
+
+    if (count != 3) {
+      return -1;
+    }
+  }
+
+  for(;;) {
+    size_t want = sizeof(struct mux_header);
+
+    if (opener->size >= want) {
+      struct mux_header header;
+      memcpy(&header, opener->frame, sizeof(header));
+
+      if ((header.type != MUX_OPEN) || (header.size < sizeof(struct mux_open)) ||
+          (header.size > sizeof(opener->frame) - want)) {
+        return -1;
+      }
+
+      want += header.size;
+
+      if (opener->size == want) {
+        return 1;
+      }
+    }
+
+    ssize_t received;
+    RETRY_ON_INTR(received = recv, opener->control_fd, opener->frame + opener->size, want - opener->size, MSG_DONTWAIT);
+
+    if (received == 0) {
+      return -1;
+    }
+
+    if (received == -1) {
+      return (errno == EAGAIN)?0:-1;
+    }
+
+    opener->size += received;
+  }
+}
+
+
+/* Frames from the local client of the master, resizes only, read
+   as far as they have arrived. Returns -1 once the client has gone
+   or sent anything else. */
+static int handle_control(struct channel *channel) {
+  for(;;) {
+    ssize_t received;
+    RETRY_ON_INTR(received = recv, channel->control_fd, channel->control + channel->control_size,
+                  sizeof(channel->control) - channel->control_size, MSG_DONTWAIT);
+
+    if (received == -1) {
+      return (errno == EAGAIN)?0:-1;
+    }
+
+    if (received == 0) {
+      return -1;
+    }
+
+    channel->control_size += received;
+
+    if (channel->control_size >= sizeof(struct mux_header)) {
+      struct mux_header header;
+      memcpy(&header, channel->control, sizeof(header));
+
+      if ((header.type != MUX_RESIZE) || (header.size != sizeof(struct winsize))) {
+        return -1;
+      }
+    }
+
+    if (channel->control_size == sizeof(channel->control)) {
+      mux_put(&output, channel->id, MUX_RESIZE, channel->control + sizeof(struct mux_header), sizeof(struct winsize));
+      channel->control_size = 0;
+    }
+  }
+}
+
+
+/* Moves data of a channel both ways. Returns 1 once the channel is
+   over and all its output is written. */
+static int serve_channel(struct channel *channel, struct pollfd *pfds) {
+  if ((pfds[3].revents & (POLLIN|POLLHUP|POLLERR)) && (handle_control(channel) == -1)) {
+    /* the opener has gone, so has the channel */
+    mux_put(&output, channel->id, MUX_CLOSE, NULL, 0);
+    close_fd(&(channel->control_fd));
+    return 1;
+  }
+
+  if ((channel->source_fd != -1) && channel->window && (pfds[0].revents & (POLLIN|POLLHUP|POLLERR))) {
+    size_t max = (channel->window < MUX_FRAME_SIZE)?channel->window:MUX_FRAME_SIZE;
+    ssize_t received = mux_read(channel->source_fd, &output, channel->id, MUX_DATA, max);
+
+    if (received > 0) {
+      channel->window -= received;
+    } else if ((received == 0) || (errno != EAGAIN)) {
+      close_fd(&(channel->source_fd));
+    }
+  }
+
+  if ((channel->source_fd == -1) && !channel->eof_sent && !channel->closed) {
+    channel->eof_sent = (mux_put(&output, channel->id, MUX_EOF, NULL, 0) == 0);
+  }
+
+  int pending = 0;
+
+  for(int i=0; i<2; i++) {
+    if (channel->sink_fds[i] == -1) {
+      continue;
+    }
+
+    struct relay_buffer *buffer = &(channel->pending[i]);
+
+    if (relay_flush(channel->sink_fds[i], buffer, &(channel->unacked)) == -1) {
+      channel->unacked += buffer->end - buffer->start;
+      buffer->start = buffer->end;
+      close_fd(&(channel->sink_fds[i]));
+    }
+
+    pending |= (buffer->end > buffer->start);
+  }
+
+  if (channel->closed) {
+    return !pending;
+  }
+
+  if (channel->unacked && ((channel->unacked >= MUX_WINDOW_SIZE/4) || !pending)) {
+    uint32_t size = channel->unacked;
+    if (mux_put(&output, channel->id, MUX_WINDOW, &size, sizeof(size)) == 0) {
+      channel->unacked = 0;
+    }
+  }
+
+  return 0;
+}
+
+
+/* Relays all channels over sock_fd. Under --master, listen_fd takes
+   local clients, each opening a channel. Otherwise signal_fd reports
+   SIGWINCH for the only channel, and its status is returned once it
+   is over. */
+static int relay(int sock_fd, int listen_fd, int signal_fd) {
+  static struct pollfd pfds[2 + MUX_MAX_CHANNELS * 4 + MAX_OPENERS];
+
+  fcntl(sock_fd, F_SETFL, O_NONBLOCK);
+  signal(SIGPIPE, SIG_IGN);
+
+  for(;;) {
+    int output_room = (RELAY_BUFFER_SIZE - (output.end - output.start)) > (sizeof(struct mux_header) + MUX_FRAME_SIZE);
+
+    pfds[0] = (struct pollfd){
+      .fd = sock_fd,
+      .events = POLLIN | ((output.end > output.start)?POLLOUT:0),
+    };
+    pfds[1] = (struct pollfd){.fd = (listen_fd != -1)?listen_fd:signal_fd, .events = POLLIN};
+
+    if ((listen_fd != -1) && (opener_count == MAX_OPENERS)) {
+      pfds[1].fd = -1;
+    }
+
+    for(int i=0; i<channel_count; i++) {
+      struct channel *channel = channels[i];
+      struct pollfd *p = pfds + 2 + i*4;
+      int reading = output_room && channel->window && !channel->closed;
+
+      p[0] = (struct pollfd){.fd = reading?channel->source_fd:-1, .events = POLLIN};
+
+      for(int j=0; j<2; j++) {
+        int writing = channel->pending[j].end > channel->pending[j].start;
+        p[1+j] = (struct pollfd){.fd = writing?channel->sink_fds[j]:-1, .events = POLLOUT};
+      }
+
+      p[3] = (struct pollfd){.fd = channel->control_fd, .events = POLLIN};
+    }
+
+    struct pollfd *opener_pfds = pfds + 2 + channel_count*4;
+    int openers_polled = opener_count;
+
+    for(int i=0; i<opener_count; i++) {
+      opener_pfds[i] = (struct pollfd){.fd = openers[i]->control_fd, .events = POLLIN};
+    }
+
+    int ready;
+    RETRY_ON_INTR(ready = poll, pfds, 2 + channel_count*4 + opener_count, -1);
+    ERROR(ready == -1, "poll: %s\n", strerror(errno));
+
+    /* channels opened below were not polled yet */
+    int polled = channel_count;
+
+    /* done first, the slots of new channels are cleared below */
+    for(int i=openers_polled-1; i>=0; i--) {
+      if (!(opener_pfds[i].revents & (POLLIN|POLLHUP|POLLERR))) {
+        continue;
+      }
+
+      struct opener *opener = openers[i];
+      int done = read_opener(opener);
+
+      if (done == 1) {
+        add_channel(opener->control_fd, opener->stdio, opener->frame, opener->size);
+      }
+
+      if (done != 0) {
+        free_opener(i, done == 1);
+      }
+    }
+
+    if (pfds[0].revents & (POLLIN|POLLHUP|POLLERR)) {
+      ssize_t received = relay_fill(sock_fd, &input);
+
+      if ((received == 0) || ((received == -1) && (errno != EAGAIN))) {
+        break;
+      }
+
+      struct mux_header header;
+      char *payload;
+
+      int broken = 0;
+
+      while (!broken && mux_next(&input, &header, &payload)) {
+        broken = (handle_frame(&header, payload) == -1);
+      }
+
+      if (broken) {
+        break;
+      }
+    }
+
+    if ((listen_fd != -1) && (pfds[1].revents & POLLIN)) {
+      int control_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+      if (control_fd != -1) {
+        add_opener(control_fd);
+      }
+    } else if ((signal_fd != -1) && (pfds[1].revents & POLLIN)) {
+      struct signalfd_siginfo info;
+      struct winsize size;
+
+      while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+
+      if (channel_count && (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0)) {
+        mux_put(&output, channels[0]->id, MUX_RESIZE, &size, sizeof(size));
+      }
+    }
+
+    for(int i=channel_count-1; i>=0; i--) {
+      if (i >= polled) {
+        memset(pfds + 2 + i*4, 0, sizeof(struct pollfd) * 4);
+      }
+
+      if (serve_channel(channels[i], pfds + 2 + i*4)) {
+        if ((listen_fd == -1) && (channels[i]->control_fd == -1)) {
+          return channels[i]->status;
+        }
+        free_channel(i);
+      }
+    }
+
+    if (relay_flush(sock_fd, &output, NULL) == -1) {
+      break;
+    }
+  }
+
+  for(int i=channel_count-1; i>=0; i--) {
+    channels[i]->status = 255;
+    free_channel(i);
+  }
+
+  ERROR(listen_fd == -1, "connection to the namespace is lost\n");
+  return EXIT_SUCCESS;
+}
+
+
+static int connect_unix(char const *path) {
+  int fd = -1;
+  PERROR(==-1, fd = socket, AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+static int watch_resize() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  PERROR(==-1, sigprocmask, SIG_BLOCK, &mask, NULL);
+
+  int signal_fd = -1;
+  PERROR(==-1, signal_fd = signalfd, -1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+  return signal_fd;
+}
+
+
+/* Hands our stdio to the master with the request, the master does all
+   the relaying. Only resizes go through us. */
+static int open_on_master(int control_fd, char *frame, size_t size, int signal_fd) {
+  int stdio[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  PERROR(==-1, send_fds, control_fd, stdio, 3, 0);
+  PERROR(!=(ssize_t)size, send, control_fd, frame, size, MSG_NOSIGNAL);
+
+  for(;;) {
+    struct pollfd pfds[2] = {
+      {.fd = control_fd, .events = POLLIN},
+      {.fd = signal_fd, .events = POLLIN},
+    };
+
+    int ready;
+    RETRY_ON_INTR(ready = poll, pfds, 2, -1);
+    ERROR(ready == -1, "poll: %s\n", strerror(errno));
+
+    if (pfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      struct {
+        struct mux_header header;
+        struct winsize size;
+      } __attribute__((packed)) resize = {.header = {.type = MUX_RESIZE, .size = sizeof(struct winsize)}};
+
+      while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+
+      if (ioctl(STDIN_FILENO, TIOCGWINSZ, &(resize.size)) == 0) {
+        send(control_fd, &resize, sizeof(resize), MSG_NOSIGNAL);
+      }
+    }
+
+    if (pfds[0].revents & (POLLIN|POLLHUP|POLLERR)) {
+      int32_t status = 255;
+      ssize_t received;
+      RETRY_ON_INTR(received = recv, control_fd, &status, sizeof(status), MSG_WAITALL);
+      ERROR(received != sizeof(status), "master has gone\n");
+      return status;
+    }
+  }
+}
+
+
 int cmd_connect(int argc, char *const argv[]) {
   int opt, index;
 
-  while((opt = getopt_long(argc, argv, "+n:h", options, &index)) != -1) {
+  while((opt = getopt_long(argc, argv, "+mtf:h", options, &index)) != -1) {
     switch(opt) {
     case '?':
       goto err;
@@ -28,20 +603,82 @@ int cmd_connect(int argc, char *const argv[]) {
       show_usage();
       break;
 
+    case 'm':
+      opt_master = 1;
+      break;
+
+    case 't':
+      opt_tty = 1;
+      break;
+
+    case 'f':
+      opt_forward = atoi(optarg);
+      BADOPT((opt_forward <= 0) || (opt_forward > 65535), "bad port '%s'\n", optarg);
+      break;
+
     default:
       break;
     }
   }
 
-  ERROR(optind >= argc, "missing name\n");
+  BADOPT(optind >= argc, "missing name\n");
+  BADOPT(opt_master && (opt_tty || opt_forward || (argc-optind > 1)),
+         "--master takes no command\n");
+
   char *rundir = getenv("XDG_RUNTIME_DIR");
   ERROR(!rundir, "environment XDG_RUNTIME_DIR is not set\n");
 
-  char arg_unix_connect[PATH_MAX+13] = {0};
-  PERROR(<0, snprintf, arg_unix_connect, sizeof(arg_unix_connect), "UNIX-CONNECT:%s/userns/%s/telnetd", rundir, argv[optind]);
+  char const *name = argv[optind];
+  char socket_path[PATH_MAX] = {0};
+  char master_path[PATH_MAX] = {0};
+  snprintf(socket_path, PATH_MAX, "%s/userns/%s/telnetd", rundir, name);
+  snprintf(master_path, PATH_MAX, "%s/userns/%s/mux", rundir, name);
 
-  PERROR(==-1, execlp, "socat", "socat", "-,raw,echo=0", arg_unix_connect, NULL);
-  exit(EXIT_FAILURE);
+  if (opt_master) {
+    int sock_fd = connect_unix(socket_path);
+    ERROR(sock_fd == -1, "cannot connect to '%s': %s\n", socket_path, strerror(errno));
+
+    unlink(master_path);
+    int listen_fd = -1;
+    PERROR(==-1, listen_fd = socket, AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, master_path, sizeof(addr.sun_path)-1);
+    PERROR(==-1, bind, listen_fd, &addr, sizeof(addr));
+    PERROR(==-1, listen, listen_fd, SOMAXCONN);
+    VERBOSE("start listening on '%s'\n", master_path);
+
+    int status = relay(sock_fd, listen_fd, -1);
+    unlink(master_path);
+    return status;
+  }
+
+  static char frame[MUX_FRAME_SIZE];
+  size_t size = make_open(frame, sizeof(frame), argc-optind-1, argv+optind+1);
+
+  struct mux_open request;
+  memcpy(&request, frame + sizeof(struct mux_header), sizeof(request));
+
+  if ((request.kind == MUX_PTY) && (tcgetattr(STDIN_FILENO, &saved_termios) == 0)) {
+    struct termios raw = saved_termios;
+    cfmakeraw(&raw);
+    PERROR(==-1, tcsetattr, STDIN_FILENO, TCSADRAIN, &raw);
+    atexit(restore_terminal);
+  }
+
+  int signal_fd = watch_resize();
+
+  int control_fd = connect_unix(master_path);
+  if (control_fd != -1) {
+    VERBOSE("opening channel on '%s'\n", master_path);
+    return open_on_master(control_fd, frame, size, signal_fd);
+  }
+
+  int sock_fd = connect_unix(socket_path);
+  ERROR(sock_fd == -1, "cannot connect to '%s': %s\n", socket_path, strerror(errno));
+
+  add_channel(-1, (int[3]){STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}, frame, size);
+  return relay(sock_fd, -1, signal_fd);
 err:
   fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
   exit(EXIT_FAILURE);
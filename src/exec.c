@@ -0,0 +1,68 @@
+#include "global.h"
+
+
+static struct option options[] = {
+  {"help",         no_argument,       NULL, 'h'},
+
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options] name [--] command\n", executable, cmd_name);
+  printf("\n"
+	 "  -h, --help                 print help message and exit\n"
+	 );
+  exit(0);
+}
+
+
+int cmd_exec(int argc, char *const argv[]) {
+  int opt, index;
+
+  while((opt = getopt_long(argc, argv, "+h", options, &index)) != -1) {
+    switch(opt) {
+    case '?':
+      goto err;
+
+    case 'h':
+      show_usage();
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  BADOPT(optind >= argc, "missing name\n");
+  BADOPT(optind+1 >= argc, "missing command\n");
+
+  char *rundir = getenv("XDG_RUNTIME_DIR");
+  ERROR(!rundir, "environment XDG_RUNTIME_DIR is not set\n");
+
+  char socket_path[PATH_MAX] = {0};
+  snprintf(socket_path, PATH_MAX, "%s/userns/%s/execd", rundir, argv[optind]);
+
+  int fd = -1;
+  PERROR(==-1, fd = socket, AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+  PERROR(==-1, connect, fd, &addr, sizeof(addr));
+
+  int signal_fd = watch_forwarded_signals();
+
+  send_exec_request(fd, argv[optind], argv+optind+1);
+
+  /* the command holds its own copies, readers see the end of its
+     output without waiting for us */
+  close(STDIN_FILENO);
+  close(STDOUT_FILENO);
+
+  int32_t status = EXIT_FAILURE;
+  ERROR(wait_exec_status(fd, signal_fd, &status) == -1, "execd of '%s' has gone\n", argv[optind]);
+  return status;
+err:
+  fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,249 @@
+#include "global.h"
+
+
+#define MAX_RUNNING 1024
+#define MAX_WAITING 64
+#define WAIT_TIMEOUT_MS 10000
+#define READ_TIMEOUT_MS 1000
+
+
+static struct option options[] = {
+  {"help",         no_argument,       NULL, 'h'},
+
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options]\n", executable, cmd_name);
+  printf("\n"
+	 "  -h, --help                 print help message and exit\n"
+	 );
+  exit(0);
+}
+
+
+/* A command started for a client, which waits on conn_fd for its
+   exit status, sending signals for it meanwhile. */
+struct running {
+  int conn_fd;
+  int pidfd;
+};
+
+
+/* A connection whose request has not arrived yet. Once some of it
+   is there the rest follows at once, reading it may block for no
+   longer than READ_TIMEOUT_MS. */
+struct waiting {
+  int conn_fd;
+  long long deadline;
+};
+
+
+static struct running running[MAX_RUNNING];
+static int running_count = 0;
+static struct waiting waiting[MAX_WAITING];
+static int waiting_count = 0;
+
+
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* The command gets the environment of the client, apart from what
+   only makes sense inside the namespace. */
+static void launch(int conn_fd, struct exec_command *command) {
+  static char const *inside[] = {"USERNS_NAME", "USERNS_DOMAIN", "XDG_RUNTIME_DIR"};
+
+  int pidfd = -1;
+  pid_t pid = clone_pidfd(0, &pidfd);
+
+  if (pid == 0) {
+    char *values[sizeof(inside)/sizeof(char const *)];
+
+    for(size_t i=0; i<sizeof(inside)/sizeof(char const *); i++) {
+      values[i] = getenv(inside[i]);
+    }
+
+    environ = command->envp;
+
+    for(size_t i=0; i<sizeof(inside)/sizeof(char const *); i++) {
+      if (values[i]) {
+        setenv(inside[i], values[i], 1);
+      }
+    }
+
+    for(int i=0; i<3; i++) {
+      if (dup2(command->stdio[i], i) == -1) {
+        _exit(EXIT_FAILURE);
+      }
+    }
+
+    if (chdir(command->cwd) == -1) {
+      VERBOSE("cannot change directory to '%s': %s\n", command->cwd, strerror(errno));
+    }
+
+    signal(SIGPIPE, SIG_DFL);
+    execvp(command->argv[0], command->argv);
+    fprintf(stderr, "%s: cannot run '%s': %s\n", executable, command->argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  if (pid == -1) {
+    LOG("cannot start '%s': %s\n", command->argv[0], strerror(errno));
+    int32_t status = EXIT_FAILURE;
+    send(conn_fd, &status, sizeof(status), MSG_NOSIGNAL);
+    close(conn_fd);
+    return;
+  }
+
+  VERBOSE("started '%s' as %ld\n", command->argv[0], (long)pid);
+  running[running_count++] = (struct running){.conn_fd = conn_fd, .pidfd = pidfd};
+}
+
+
+int cmd_execd(int argc, char *const argv[]) {
+  int opt, index;
+
+  while((opt = getopt_long(argc, argv, "+h", options, &index)) != -1) {
+    switch(opt) {
+    case '?':
+      goto err;
+
+    case 'h':
+      show_usage();
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  BADOPT(optind < argc, "Too many arguments\n");
+
+  char *rundir = getenv("XDG_RUNTIME_DIR");
+  ERROR(!rundir, "environment XDG_RUNTIME_DIR is not set\n");
+
+  char *name = getenv("USERNS_NAME");
+  ERROR(!name, "running outside a user namespace\n");
+
+  char socket_path[PATH_MAX] = {0};
+  snprintf(socket_path, PATH_MAX, "%s/userns/%s/execd", rundir, name);
+  unlink(socket_path);
+
+  int listen_fd = -1;
+  PERROR(==-1, listen_fd = socket, AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+  PERROR(==-1, bind, listen_fd, &addr, sizeof(addr));
+  PERROR(==-1, listen, listen_fd, SOMAXCONN);
+
+  signal(SIGPIPE, SIG_IGN);
+  VERBOSE("start listening on '%s'\n", socket_path);
+
+  static struct pollfd pfds[1 + MAX_RUNNING*2 + MAX_WAITING];
+
+  for(;;) {
+    int accepting = (running_count + waiting_count < MAX_RUNNING) && (waiting_count < MAX_WAITING);
+    pfds[0] = (struct pollfd){.fd = accepting?listen_fd:-1, .events = POLLIN};
+
+    for(int i=0; i<running_count; i++) {
+      pfds[1+i*2] = (struct pollfd){.fd = running[i].conn_fd, .events = POLLIN};
+      pfds[2+i*2] = (struct pollfd){.fd = running[i].pidfd, .events = POLLIN};
+    }
+
+    struct pollfd *wait_pfds = pfds + 1 + running_count*2;
+    int timeout = -1;
+
+    for(int i=0; i<waiting_count; i++) {
+      wait_pfds[i] = (struct pollfd){.fd = waiting[i].conn_fd, .events = POLLIN};
+
+      long long left = waiting[i].deadline - now_ms();
+      left = (left < 0)?0:left;
+      if ((timeout == -1) || (left < timeout)) {
+        timeout = left;
+      }
+    }
+
+    int ready;
+    RETRY_ON_INTR(ready = poll, pfds, 1 + running_count*2 + waiting_count, timeout);
+    ERROR(ready == -1, "poll: %s\n", strerror(errno));
+
+    /* commands launched below were not polled yet */
+    int polled = running_count;
+
+    for(int i=waiting_count-1; i>=0; i--) {
+      struct waiting *w = &(waiting[i]);
+
+      if (wait_pfds[i].revents & (POLLIN|POLLHUP|POLLERR)) {
+        struct exec_command command;
+
+        if (recv_exec_request(w->conn_fd, &command) == -1) {
+          LOG("bad exec request\n");
+          close(w->conn_fd);
+        } else {
+          launch(w->conn_fd, &command);
+          free_exec_command(&command);
+        }
+      } else if (w->deadline <= now_ms()) {
+        VERBOSE("no exec request in time\n");
+        close(w->conn_fd);
+      } else {
+        continue;
+      }
+
+      *w = waiting[--waiting_count];
+    }
+
+    for(int i=polled-1; i>=0; i--) {
+      struct running *r = &(running[i]);
+
+      if (pfds[1+i*2].revents & (POLLIN|POLLHUP|POLLERR)) {
+        int32_t sig;
+
+        if (recv(r->conn_fd, &sig, sizeof(sig), MSG_DONTWAIT) == sizeof(sig)) {
+          signal_pidfd(r->pidfd, sig);
+        } else {
+          /* the client has gone, like a terminal hanging up */
+          signal_pidfd(r->pidfd, SIGHUP);
+          close(r->conn_fd);
+          r->conn_fd = -1;
+        }
+      }
+
+      if (pfds[2+i*2].revents & POLLIN) {
+        int32_t status = wait_pidfd(r->pidfd);
+        VERBOSE("exited with %d\n", status);
+
+        if (r->conn_fd != -1) {
+          send(r->conn_fd, &status, sizeof(status), MSG_NOSIGNAL);
+          close(r->conn_fd);
+        }
+
+        close(r->pidfd);
+        *r = running[--running_count];
+      }
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      int conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+      if (conn_fd == -1) {
+        continue;
+      }
+
+      struct timeval read_timeout = {.tv_sec = READ_TIMEOUT_MS / 1000, .tv_usec = (READ_TIMEOUT_MS % 1000) * 1000};
+      setsockopt(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout));
+      waiting[waiting_count++] = (struct waiting){.conn_fd = conn_fd, .deadline = now_ms() + WAIT_TIMEOUT_MS};
+    }
+  }
+
+  return EXIT_FAILURE;
+err:
+  fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
+  exit(EXIT_FAILURE);
+}
@@ -1,21 +1,47 @@
+#include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <pty.h>
 #include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/bpf.h>
+#include <linux/fib_rules.h>
+#include <linux/io_uring.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <linux/veth.h>
+#include <linux/sched.h>
 #include <linux/netfilter_ipv4.h>
 
 
@@ -80,8 +106,253 @@ extern int cmd_listen(int argc, char *const argv[]);
 extern int cmd_connect(int argc, char *const argv[]);
 extern int cmd_socketd(int argc, char *const argv[]);
 extern int cmd_proxy(int argc, char *const argv[]);
+extern int cmd_stats(int argc, char *const argv[]);
+extern int cmd_init(int argc, char *const argv[]);
+extern int cmd_pool(int argc, char *const argv[]);
+extern int cmd_execd(int argc, char *const argv[]);
+extern int cmd_exec(int argc, char *const argv[]);
+extern int cmd_up(int argc, char *const argv[]);
+extern int cmd_down(int argc, char *const argv[]);
+extern int cmd_net(int argc, char *const argv[]);
+extern int cmd_rules(int argc, char *const argv[]);
 
 
+/* A socketd request is one byte, the socket type, answered with one
+   socket. SOCKETD_BATCH|type followed by a count byte asks for up to
+   SOCKETD_MAX_FDS sockets, all answered in one message. */
+#define SOCKETD_BATCH   0x80
+#define SOCKETD_MAX_FDS 64
+
+
+extern int send_fds(int sock_fd, int const *fds, int count, int flags);
 extern void send_fd(int sock_fd, int fd);
+extern int recv_fds(int sock_fd, int *fds, int max, int flags);
 extern int recv_fd(int sock_fd);
 extern char *const *make_argv(int optind, int argc, char *const argv[]);
+extern void init_ns();
+extern void init_env(char const *name, char const *domain);
+extern void init_hostname(char const *name, char const *domain);
+extern void unshare_user();
+extern pid_t clone_pidfd(int flags, int *pidfd);
+extern int open_pidfd(pid_t pid);
+extern int signal_pidfd(int pidfd, int sig);
+extern int pidfd_exited(int pidfd);
+extern int wait_pidfd(int pidfd);
+extern unsigned long long proc_start_time(pid_t pid);
+
+
+/* listen and connect talk over the telnetd socket. A connection
+   carries many channels, each a command on a pty, a command on pipes,
+   or a tcp connection inside the namespace. Every frame starts with a
+   struct mux_header. On each channel a side sends at most
+   MUX_WINDOW_SIZE bytes of data before the other side has written them
+   out and returned them with MUX_WINDOW. */
+#define MUX_OPEN    0  /* struct mux_open, then argc strings */
+#define MUX_DATA    1
+#define MUX_STDERR  2
+#define MUX_EOF     3
+#define MUX_RESIZE  4  /* struct winsize */
+#define MUX_WINDOW  5  /* uint32_t */
+#define MUX_CLOSE   6  /* int32_t exit status, empty from connect */
+
+#define MUX_PTY     0
+#define MUX_EXEC    1
+#define MUX_FORWARD 2
+
+#define RELAY_BUFFER_SIZE 65536
+#define MUX_WINDOW_SIZE   RELAY_BUFFER_SIZE
+#define MUX_FRAME_SIZE    16384
+#define MUX_MAX_CHANNELS  256
+
+struct mux_header {
+  uint32_t channel;
+  uint16_t type;
+  uint16_t size;
+};
+
+struct mux_open {
+  uint16_t kind;
+  uint16_t port;
+  uint32_t argc;
+  struct winsize size;
+};
+
+struct relay_buffer {
+  size_t start;
+  size_t end;
+  char data[RELAY_BUFFER_SIZE];
+};
+
+extern ssize_t relay_fill(int fd, struct relay_buffer *buffer);
+extern int relay_flush(int fd, struct relay_buffer *buffer, size_t *written);
+extern int relay_append(struct relay_buffer *buffer, void const *data, size_t size);
+extern int relay_reopen(int fd, int flags);
+extern int mux_put(struct relay_buffer *buffer, uint32_t channel, uint16_t type, void const *data, uint16_t size);
+extern ssize_t mux_read(int fd, struct relay_buffer *buffer, uint32_t channel, uint16_t type, size_t max);
+extern int mux_next(struct relay_buffer *buffer, struct mux_header *header, char **payload);
+
+
+/* Netlink messages are collected in a batch and sent with one
+   sendto. A batch is sent once it is this full, no message comes near
+   NL_MESSAGE_MAX. The acks of a batch have to fit in the receive
+   buffer of the socket. */
+#define NL_BATCH_SIZE  32768
+#define NL_MESSAGE_MAX 1024
+#define NL_MAX_BATCH   128
+
+struct nl_batch {
+  int fd;
+  int quiet;
+  int failed;
+  uint32_t seq;
+  uint32_t first_seq;
+  size_t size;
+  int count;
+  int acks;
+  char const *what[NL_MAX_BATCH];
+  int wants_ack[NL_MAX_BATCH];
+  int fds[NL_MAX_BATCH];
+  int fd_count;
+  char data[NL_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+};
+
+extern void nl_open(struct nl_batch *batch, int protocol);
+extern void nl_flush(struct nl_batch *batch);
+extern void nl_reserve(struct nl_batch *batch);
+extern struct nlmsghdr *nl_begin(struct nl_batch *batch, uint16_t type, uint16_t flags,
+                                 void const *header, size_t size, char const *what);
+extern void nl_end(struct nl_batch *batch, struct nlmsghdr *msg);
+extern void nl_keep_fd(struct nl_batch *batch, int fd);
+extern void nl_data(struct nlmsghdr *msg, void const *data, size_t size);
+extern struct rtattr *nl_attr(struct nlmsghdr *msg, uint16_t type, void const *data, size_t size);
+extern void nl_string(struct nlmsghdr *msg, uint16_t type, char const *str);
+extern void nl_u32(struct nlmsghdr *msg, uint16_t type, uint32_t value);
+extern void nl_nest_end(struct nlmsghdr *msg, struct rtattr *nest);
+extern int net_apply(int argc, char *const argv[], int delete, int quiet);
+
+
+/* A command to run elsewhere, on the stdio of the sender: its stdio
+   fds come first, then this header followed by a name, the cwd, argv
+   and the environment as NUL terminated strings. The exit status is
+   sent back as an int32_t. Used by spawn --from-pool and exec. */
+#define EXEC_REQUEST_MAX (1 << 20)
+
+struct exec_request {
+  uint32_t size;
+  uint32_t argc;
+  uint32_t envc;
+};
+
+struct exec_command {
+  int stdio[3];
+  char *name;
+  char *cwd;
+  char **argv;
+  char **envp;
+  char *data;
+};
+
+extern void send_exec_request(int sock_fd, char const *name, char *const argv[]);
+extern int recv_exec_request(int sock_fd, struct exec_command *command);
+extern void free_exec_command(struct exec_command *command);
+extern int watch_forwarded_signals();
+extern int wait_exec_status(int sock_fd, int signal_fd, int32_t *status);
+
+
+/* Counters of a running proxy, in $XDG_RUNTIME_DIR/userns/NAME/
+   proxy-PROTO-PORT.stats. Every worker owns one slot and is its only
+   writer, so updates are plain relaxed stores. The proxy holds an
+   OFD write lock on the file for as long as it runs. */
+#define PROXY_STATS_MAGIC 0x75737474
+
+
+/* Steps of setting up a tcp connection, timed in microseconds.
+   accept starts from the epoll wakeup that found the connection,
+   setup covers everything up to the first byte from upstream. */
+enum proxy_stage {
+  STAGE_ACCEPT,
+  STAGE_SOCKET,
+  STAGE_CONNECT,
+  STAGE_FIRST_BYTE,
+  STAGE_SETUP,
+  PROXY_STAGES,
+};
+
+
+/* bucket i counts latencies below 2^i microseconds */
+#define PROXY_HIST_BUCKETS 32
+#define PROXY_SLOW_RING    64
+
+
+/* A connection whose setup was slow or failed, error is the errno. */
+struct proxy_slow_conn {
+  uint64_t time;
+  uint32_t addr;
+  uint16_t port;
+  int16_t error;
+  uint32_t stage_us[PROXY_STAGES];
+};
+
+
+struct proxy_counters {
+  uint64_t conns_total;
+  uint64_t conns_closed;
+  uint64_t bytes_out;     /* client to upstream */
+  uint64_t bytes_in;      /* upstream to client */
+  uint64_t udp_flows_total;
+  uint64_t udp_flows_evicted;
+  uint64_t socketd_requests;
+  uint64_t socketd_sockets;
+  uint64_t connect_errors;
+  uint64_t errors;
+
+  uint64_t hist[PROXY_STAGES][PROXY_HIST_BUCKETS];
+
+  /* the entry at slow_head-1 is the latest */
+  uint64_t slow_head;
+  struct proxy_slow_conn slow[PROXY_SLOW_RING];
+} __attribute__((aligned(64)));
+
+
+struct proxy_stats {
+  uint32_t magic;
+  uint32_t workers;
+  char proto[8];
+  int32_t port;
+  struct proxy_counters counters[] __attribute__((aligned(64)));
+};
+
+
+struct uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  unsigned sqe_tail;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+
+extern int uring_init(struct uring *ring, unsigned entries);
+extern int uring_register(struct uring *ring, unsigned opcode, void *arg, unsigned nr_args);
+extern int uring_probe(struct uring *ring, unsigned char const *opcodes, int count);
+extern int uring_submit(struct uring *ring, unsigned wait_nr);
+extern struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+extern void uring_cqe_seen(struct uring *ring);
+
+
+struct sockmap {
+  int map_fd;
+  int prog_fd;
+};
+
+
+extern int sockmap_init(struct sockmap *map, int size);
+extern int sockmap_pair(struct sockmap *map, int a_fd, int b_fd);
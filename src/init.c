@@ -0,0 +1,241 @@
+#include "global.h"
+
+
+static struct option options[] = {
+  {"help",         no_argument,       NULL, 'h'},
+
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options] [--] [command]\n", executable, cmd_name);
+  printf("\n"
+	 "  -h, --help                 print help message and exit\n"
+	 );
+  exit(0);
+}
+
+
+#define STAGING_DIR "/mnt"
+
+/* staged as STAGING_DIR/N, N being the index in the binds */
+#define HOSTNAME_BIND 3
+#define HOSTS_BIND    4
+
+
+/* A file or directory put in place over target, from a bind mount of
+   source, or a new file holding content. */
+struct file_bind {
+  char const *target;
+  char const *source;
+  char content[256];
+};
+
+
+/* Like mkdir -p, path is restored before returning. */
+static void make_dirs(char *path) {
+  for(char *p = path+1; *p; p++) {
+    if (*p != '/') {
+      continue;
+    }
+
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+
+  mkdir(path, 0755);
+}
+
+
+/* A missing mount point is created, as a directory if the source is
+   one, or as an empty file. */
+static void bind_mount(char const *source, char const *target) {
+  struct stat st;
+
+  if (stat(target, &st) == -1) {
+    char path[PATH_MAX] = {0};
+    strncpy(path, target, PATH_MAX-1);
+
+    if ((stat(source, &st) == 0) && S_ISDIR(st.st_mode)) {
+      make_dirs(path);
+    } else {
+      char *slash = strrchr(path, '/');
+      if (slash && (slash != path)) {
+        *slash = '\0';
+        make_dirs(path);
+      }
+
+      int fd = open(target, O_CREAT|O_WRONLY|O_CLOEXEC, 0644);
+      if (fd != -1) {
+        close(fd);
+      }
+    }
+  }
+
+  if (mount(source, target, NULL, MS_BIND, NULL) == -1) {
+    LOG("cannot bind '%s' to '%s': %s\n", source, target, strerror(errno));
+  }
+}
+
+
+static void mount_fs(char const *type, char const *target, char const *options) {
+  if (mount(type, target, type, 0, options) == -1) {
+    LOG("cannot mount %s on '%s': %s\n", type, target, strerror(errno));
+  }
+}
+
+
+static void write_file(char const *path, char const *content) {
+  int fd = -1;
+  PERROR(==-1, fd = open, path, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0644);
+  size_t len = strlen(content);
+  PERROR(!=(ssize_t)len, write, fd, content, len);
+  close(fd);
+}
+
+
+/* Sets up the mounts and environment of a new namespace, as
+   share/init-ns.sh used to. Files are staged on a tmpfs first, since
+   /run is about to be covered by a new tmpfs. */
+void init_ns() {
+  char *rundir = getenv("XDG_RUNTIME_DIR");
+  ERROR(!rundir, "environment XDG_RUNTIME_DIR is not set\n");
+
+  char const *name = getenv("USERNS_NAME");
+  char const *domain = getenv("USERNS_DOMAIN");
+  name = name?name:"";
+  domain = domain?domain:"";
+
+  char userns_dir[PATH_MAX] = {0};
+  snprintf(userns_dir, PATH_MAX, "%s/userns", rundir);
+
+  char source[PATH_MAX] = {0};
+  if (!realpath(userns_dir, source)) {
+    strncpy(source, userns_dir, PATH_MAX-1);
+  }
+
+  struct file_bind binds[] = {
+    {.target = "/run/userns", .source = source},
+    {.target = "/etc/passwd", .content = "root:x:0:0:tty:/root:/bin/bash\n"},
+    {.target = "/etc/group",  .content = "tty:x:0:root\n"},
+    [HOSTNAME_BIND] = {.target = "/etc/hostname"},
+    [HOSTS_BIND] = {.target = "/etc/hosts"},
+  };
+
+  size_t count = sizeof(binds)/sizeof(struct file_bind);
+
+  VERBOSE("staging files in '%s'\n", STAGING_DIR);
+  PERROR(==-1, mount, "tmpfs", STAGING_DIR, "tmpfs", 0, NULL);
+
+  for(size_t i=0; i<count; i++) {
+    char staged[PATH_MAX] = {0};
+    snprintf(staged, PATH_MAX, "%s/%zu", STAGING_DIR, i);
+
+    if (binds[i].source) {
+      bind_mount(binds[i].source, staged);
+    } else {
+      write_file(staged, binds[i].content);
+    }
+  }
+
+  VERBOSE("mounting filesystems\n");
+  mount_fs("proc", "/proc", NULL);
+  mount_fs("sysfs", "/sys", NULL);
+  mount_fs("tmpfs", "/run", NULL);
+  mount_fs("tmpfs", "/tmp", NULL);
+  mount_fs("mqueue", "/dev/mqueue", NULL);
+  mount_fs("devpts", "/dev/pts", "newinstance,gid=0,mode=600");
+  bind_mount("/dev/pts/ptmx", "/dev/ptmx");
+
+  init_hostname(name, domain);
+
+  for(size_t i=0; i<count; i++) {
+    char staged[PATH_MAX] = {0};
+    snprintf(staged, PATH_MAX, "%s/%zu", STAGING_DIR, i);
+    bind_mount(staged, binds[i].target);
+  }
+
+  init_env(name, domain);
+}
+
+
+/* Only these survive, XDG_RUNTIME_DIR now points at the new /run.
+   Also applied to the environment a pool client passes in. */
+void init_env(char const *name, char const *domain) {
+  static char const *keep[] = {"LANG", "PATH", "HOME", "SHELL", "TERM"};
+  char *values[sizeof(keep)/sizeof(char const *)];
+
+  for(size_t i=0; i<sizeof(keep)/sizeof(char const *); i++) {
+    char *value = getenv(keep[i]);
+    values[i] = value?strdup(value):NULL;
+  }
+
+  char *saved_name = strdup(name);
+  char *saved_domain = strdup(domain);
+
+  clearenv();
+  setenv("USERNS_NAME", saved_name, 1);
+  setenv("USERNS_DOMAIN", saved_domain, 1);
+  setenv("XDG_RUNTIME_DIR", "/run", 1);
+
+  for(size_t i=0; i<sizeof(keep)/sizeof(char const *); i++) {
+    if (values[i]) {
+      setenv(keep[i], values[i], 1);
+      free(values[i]);
+    }
+  }
+
+  free(saved_name);
+  free(saved_domain);
+}
+
+
+/* Also used to rename a namespace taken from a pool. The staged files
+   are rewritten in place, so their bind mounts show the new contents. */
+void init_hostname(char const *name, char const *domain) {
+  char path[PATH_MAX] = {0};
+  char content[HOST_NAME_MAX*2+32] = {0};
+
+  snprintf(path, PATH_MAX, "%s/%d", STAGING_DIR, HOSTNAME_BIND);
+  snprintf(content, sizeof(content), "%s.%s\n", name, domain);
+  write_file(path, content);
+
+  snprintf(path, PATH_MAX, "%s/%d", STAGING_DIR, HOSTS_BIND);
+  snprintf(content, sizeof(content), "127.0.0.1 %s.%s %s\n", name, domain, name);
+  write_file(path, content);
+
+  char hostname[HOST_NAME_MAX+1] = {0};
+  snprintf(hostname, sizeof(hostname), "%s.%s", name, domain);
+  PERROR(==-1, sethostname, hostname, strlen(hostname));
+}
+
+
+int cmd_init(int argc, char *const argv[]) {
+  int opt, index;
+
+  while((opt = getopt_long(argc, argv, "+h", options, &index)) != -1) {
+    switch(opt) {
+    case '?':
+      goto err;
+
+    case 'h':
+      show_usage();
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  init_ns();
+
+  char *const *args = make_argv(optind, argc, argv);
+  VERBOSE("exec '%s'\n", args[0]);
+  PERROR(==-1, execvp, args[0], args);
+  exit(EXIT_FAILURE);
+err:
+  fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
+  exit(EXIT_FAILURE);
+}
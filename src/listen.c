@@ -1,4 +1,5 @@
 #include "global.h"
+#include <utmp.h>
 
 
 static struct option options[] = {
@@ -11,11 +12,545 @@ static struct option options[] = {
 static void show_usage() {
   printf("Usage: %s %s [options] [--] [command]\n", executable, cmd_name);
   printf("\n"
+         "  command is run on a pty for connections which do not name one\n"
+         "\n"
 	 "  -h, --help                 print help message and exit\n"
 	 );
   exit(0);
 }
 
+
+/* One channel of a connection. For a pty, sink and source are both
+   the master fd, for a forward the socket, held in fd. */
+struct channel {
+  uint32_t id;
+  int kind;
+  int fd;
+  int pidfd;
+  int status;
+  int exited;
+  int sink_fd;
+  int source_fd;
+  int error_fd;
+  int eof_received;
+  int aborted;
+  uint32_t window;
+  size_t unacked;
+  struct relay_buffer pending;
+};
+
+
+static char *const *default_command = NULL;
+/* A channel that could not be opened, its error and MUX_CLOSE wait
+   for room in output. */
+struct refusal {
+  uint32_t id;
+  uint16_t len;
+  char message[256];
+};
+
+
+static struct channel *channels[MUX_MAX_CHANNELS];
+static int channel_count = 0;
+static struct refusal refusals[MUX_MAX_CHANNELS];
+static int refusal_count = 0;
+static struct relay_buffer input, output;
+
+
+static struct channel *find_channel(uint32_t id) {
+  for(int i=0; i<channel_count; i++) {
+    if (channels[i]->id == id) {
+      return channels[i];
+    }
+  }
+
+  return NULL;
+}
+
+
+static void close_fd(int *fd) {
+  if (*fd != -1) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+
+static void close_sink(struct channel *channel) {
+  if (channel->kind == MUX_EXEC) {
+    close_fd(&(channel->sink_fd));
+  } else if (channel->sink_fd != -1) {
+    if (channel->kind == MUX_FORWARD) {
+      shutdown(channel->fd, SHUT_WR);
+    }
+    channel->sink_fd = -1;
+  }
+}
+
+
+/* the output of a pty is over once its input is */
+static void close_source(struct channel *channel) {
+  if (channel->kind == MUX_EXEC) {
+    close_fd(&(channel->source_fd));
+  } else {
+    channel->source_fd = -1;
+    if (channel->kind == MUX_PTY) {
+      channel->sink_fd = -1;
+    }
+  }
+}
+
+
+static void close_all(struct channel *channel) {
+  close_source(channel);
+  close_sink(channel);
+  close_fd(&(channel->error_fd));
+  close_fd(&(channel->fd));
+}
+
+
+static pid_t start_command(struct channel *channel, char *const argv[], int stdio[3]) {
+  pid_t pid = clone_pidfd(0, &(channel->pidfd));
+  if (pid != 0) {
+    return pid;
+  }
+
+  signal(SIGPIPE, SIG_DFL);
+
+  if (channel->kind == MUX_PTY) {
+    if (login_tty(stdio[0]) == -1) {
+      _exit(EXIT_FAILURE);
+    }
+  } else {
+    for(int i=0; i<3; i++) {
+      if (dup2(stdio[i], i) == -1) {
+        _exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  execvp(argv[0], argv);
+  fprintf(stderr, "%s: cannot run '%s': %s\n", executable, argv[0], strerror(errno));
+  _exit(127);
+}
+
+
+/* Puts out the refusals, in order, as far as output has room for
+   both frames of each. */
+static void send_refusals() {
+  int sent = 0;
+
+  for(; sent<refusal_count; sent++) {
+    struct refusal *refusal = &(refusals[sent]);
+    int32_t status = EXIT_FAILURE;
+    size_t needed = sizeof(struct mux_header)*2 + refusal->len + sizeof(status);
+
+    if (RELAY_BUFFER_SIZE - (output.end - output.start) < needed) {
+      break;
+    }
+
+    if (refusal->len) {
+      mux_put(&output, refusal->id, MUX_STDERR, refusal->message, refusal->len);
+    }
+    mux_put(&output, refusal->id, MUX_CLOSE, &status, sizeof(status));
+  }
+
+  refusal_count -= sent;
+  memmove(refusals, refusals+sent, sizeof(struct refusal) * refusal_count);
+}
+
+
+/* Returns -1 if the client keeps opening channels without reading
+   the refusals. */
+static int refuse_channel(uint32_t id, char const *error) {
+  if (refusal_count == MUX_MAX_CHANNELS) {
+    LOG("too many refused channels\n");
+    return -1;
+  }
+
+  struct refusal *refusal = &(refusals[refusal_count++]);
+  refusal->id = id;
+  refusal->len = 0;
+
+  if (error) {
+    refusal->len = snprintf(refusal->message, sizeof(refusal->message), "%s: %s\r\n", executable, error);
+    refusal->len = (refusal->len < sizeof(refusal->message))?refusal->len:sizeof(refusal->message)-1;
+  }
+
+  send_refusals();
+  return 0;
+}
+
+
+/* Sets up the command, or the connection, behind a new channel. A
+   failure is reported to the client on the channel. Returns -1 if
+   that cannot be done either. */
+static int open_channel(uint32_t id, char *payload, uint16_t size) {
+  struct mux_open request;
+
+  if (size >= sizeof(request)) {
+    memcpy(&request, payload, sizeof(request));
+  }
+
+  /* every argument takes at least its nul */
+  if ((size < sizeof(request)) || (request.argc > size - sizeof(request)) ||
+      find_channel(id) || (channel_count == MUX_MAX_CHANNELS)) {
+    return refuse_channel(id, NULL);
+  }
+
+  char **args = calloc(request.argc + 1, sizeof(char *));
+  ERROR(!args, "cannot allocate arguments\n");
+  char *p = payload + sizeof(request), *end = payload + size;
+
+  for(uint32_t i=0; i<request.argc; i++) {
+    char *nul = memchr(p, '\0', end-p);
+    if (!nul) {
+      request.argc = i;
+      break;
+    }
+    args[i] = p;
+    p = nul+1;
+  }
+
+  args[request.argc] = NULL;
+  char *const *argv = request.argc?args:default_command;
+
+  struct channel *channel = calloc(1, sizeof(struct channel));
+  ERROR(!channel, "cannot allocate channel\n");
+  *channel = (struct channel){
+    .id = id,
+    .kind = request.kind,
+    .fd = -1,
+    .pidfd = -1,
+    .sink_fd = -1,
+    .source_fd = -1,
+    .error_fd = -1,
+    .window = MUX_WINDOW_SIZE,
+  };
+
+  char const *error = NULL;
+
+  if (request.kind == MUX_PTY) {
+    int master_fd, slave_fd;
+
+    if (openpty(&master_fd, &slave_fd, NULL, NULL, &(request.size)) == -1) {
+      error = strerror(errno);
+    } else {
+      fcntl(master_fd, F_SETFD, FD_CLOEXEC);
+      fcntl(slave_fd, F_SETFD, FD_CLOEXEC);
+
+      if (start_command(channel, argv, (int[3]){slave_fd, slave_fd, slave_fd}) == -1) {
+        error = strerror(errno);
+        close(master_fd);
+      } else {
+        fcntl(master_fd, F_SETFL, O_NONBLOCK);
+        channel->fd = channel->sink_fd = channel->source_fd = master_fd;
+      }
+
+      close(slave_fd);
+    }
+  } else if (request.kind == MUX_EXEC) {
+    int pipes[3][2];
+    int made = 0;
+
+    for(; made<3; made++) {
+      if (pipe2(pipes[made], O_CLOEXEC) == -1) {
+        break;
+      }
+    }
+
+    if ((made < 3) ||
+        (start_command(channel, argv, (int[3]){pipes[0][0], pipes[1][1], pipes[2][1]}) == -1)) {
+      error = strerror(errno);
+
+      for(int i=0; i<made; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+      }
+    } else {
+      close(pipes[0][0]);
+      close(pipes[1][1]);
+      close(pipes[2][1]);
+      channel->sink_fd = pipes[0][1];
+      channel->source_fd = pipes[1][0];
+      channel->error_fd = pipes[2][0];
+
+      for(int i=0; i<3; i++) {
+        fcntl(pipes[i][i?0:1], F_SETFL, O_NONBLOCK);
+      }
+    }
+  } else if (request.kind == MUX_FORWARD) {
+    struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(request.port),
+      .sin_addr = {.s_addr = htonl(INADDR_LOOPBACK)},
+    };
+
+    int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+    if ((fd == -1) || (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)) {
+      error = strerror(errno);
+      if (fd != -1) {
+        close(fd);
+      }
+    } else {
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      channel->fd = channel->sink_fd = channel->source_fd = fd;
+      channel->exited = 1;
+    }
+  } else {
+    error = "unknown channel kind";
+  }
+
+  free(args);
+
+  if (error) {
+    free(channel);
+    return refuse_channel(id, error);
+  }
+
+  VERBOSE("channel %u open\n", id);
+  channels[channel_count++] = channel;
+  return 0;
+}
+
+
+/* Returns -1 if the other side has broken the protocol. */
+static int handle_frame(struct mux_header *header, char *payload) {
+  if (header->type == MUX_OPEN) {
+    return open_channel(header->channel, payload, header->size);
+  }
+
+  struct channel *channel = find_channel(header->channel);
+  if (!channel || channel->aborted) {
+    return 0;
+  }
+
+  switch(header->type) {
+  case MUX_DATA:
+    /* data nobody takes any more is returned at once, while the
+       window keeps the rest within the buffer */
+    if ((channel->sink_fd == -1) || channel->eof_received) {
+      channel->unacked += header->size;
+    } else if (relay_append(&(channel->pending), payload, header->size) == -1) {
+      LOG("channel %u: data beyond the window\n", channel->id);
+      return -1;
+    }
+    break;
+
+  case MUX_EOF:
+    channel->eof_received = 1;
+    break;
+
+  case MUX_RESIZE:
+    if ((channel->kind == MUX_PTY) && (channel->source_fd != -1) && (header->size == sizeof(struct winsize))) {
+      ioctl(channel->source_fd, TIOCSWINSZ, payload);
+    }
+    break;
+
+  case MUX_WINDOW:
+    if (header->size == sizeof(uint32_t)) {
+      uint32_t size;
+      memcpy(&size, payload, sizeof(size));
+      channel->window += size;
+    }
+    break;
+
+  case MUX_CLOSE:
+    /* the client has gone, the command is told so and reaped later */
+    channel->aborted = 1;
+    close_all(channel);
+    if (channel->pidfd != -1) {
+      signal_pidfd(channel->pidfd, SIGHUP);
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+
+/* Moves data of a channel both ways, as far as buffers and the window
+   of the client allow. Returns 1 once the channel is over. */
+static int serve_channel(struct channel *channel, struct pollfd *pfds) {
+  if ((pfds[3].revents & POLLIN) && !channel->exited) {
+    channel->status = wait_pidfd(channel->pidfd);
+    channel->exited = 1;
+    close_fd(&(channel->pidfd));
+  }
+
+  if (channel->aborted) {
+    return channel->exited;
+  }
+
+  int fds[2] = {channel->source_fd, channel->error_fd};
+  uint16_t types[2] = {MUX_DATA, MUX_STDERR};
+
+  for(int i=0; i<2; i++) {
+    if ((fds[i] == -1) || !channel->window || !(pfds[i].revents & (POLLIN|POLLHUP|POLLERR))) {
+      continue;
+    }
+
+    size_t max = (channel->window < MUX_FRAME_SIZE)?channel->window:MUX_FRAME_SIZE;
+    ssize_t received = mux_read(fds[i], &output, channel->id, types[i], max);
+
+    if (received > 0) {
+      channel->window -= received;
+    } else if ((received == 0) || (errno != EAGAIN)) {
+      /* EIO from a pty master once the last writer has gone */
+      if (i == 0) {
+        close_source(channel);
+      } else {
+        close_fd(&(channel->error_fd));
+      }
+    }
+  }
+
+  if (channel->sink_fd != -1) {
+    if (relay_flush(channel->sink_fd, &(channel->pending), &(channel->unacked)) == -1) {
+      channel->unacked += channel->pending.end - channel->pending.start;
+      channel->pending.start = channel->pending.end;
+      close_sink(channel);
+    } else if (channel->eof_received && (channel->pending.start == channel->pending.end)) {
+      /* a pty has no end of input, it gets the EOF character */
+      if (channel->kind == MUX_PTY) {
+        struct termios termios;
+        char eof = ((tcgetattr(channel->sink_fd, &termios) == 0) && termios.c_cc[VEOF])?termios.c_cc[VEOF]:4;
+        if (write(channel->sink_fd, &eof, 1) == -1) {
+          VERBOSE("cannot send EOF to channel %u\n", channel->id);
+        }
+      }
+      close_sink(channel);
+    }
+  }
+
+  if (channel->unacked &&
+      ((channel->unacked >= MUX_WINDOW_SIZE/4) || (channel->pending.start == channel->pending.end))) {
+    uint32_t size = channel->unacked;
+    if (mux_put(&output, channel->id, MUX_WINDOW, &size, sizeof(size)) == 0) {
+      channel->unacked = 0;
+    }
+  }
+
+  if (channel->exited && (channel->source_fd == -1) && (channel->error_fd == -1) &&
+      ((channel->kind != MUX_FORWARD) || (channel->sink_fd == -1))) {
+    int32_t status = channel->status;
+    return mux_put(&output, channel->id, MUX_CLOSE, &status, sizeof(status)) == 0;
+  }
+
+  return 0;
+}
+
+
+static void free_channel(int i) {
+  struct channel *channel = channels[i];
+  VERBOSE("channel %u closed\n", channel->id);
+
+  close_all(channel);
+  close_fd(&(channel->pidfd));
+  free(channel);
+
+  channels[i] = channels[--channel_count];
+}
+
+
+/* Serves the channels of one connection, until the client goes
+   away. Then all commands left get a SIGHUP. */
+static void serve(int sock_fd) {
+  fcntl(sock_fd, F_SETFL, O_NONBLOCK);
+  struct pollfd pfds[1 + MUX_MAX_CHANNELS * 4];
+
+  for(;;) {
+    int output_room = (RELAY_BUFFER_SIZE - (output.end - output.start)) > (sizeof(struct mux_header) + MUX_FRAME_SIZE);
+
+    pfds[0] = (struct pollfd){
+      .fd = sock_fd,
+      .events = POLLIN | ((output.end > output.start)?POLLOUT:0),
+    };
+
+    for(int i=0; i<channel_count; i++) {
+      struct channel *channel = channels[i];
+      struct pollfd *p = pfds + 1 + i*4;
+      int reading = output_room && channel->window && !channel->aborted;
+      int writing = (channel->pending.end > channel->pending.start) && !channel->aborted;
+
+      p[0] = (struct pollfd){.fd = reading?channel->source_fd:-1, .events = POLLIN};
+      p[1] = (struct pollfd){.fd = reading?channel->error_fd:-1, .events = POLLIN};
+      p[2] = (struct pollfd){.fd = writing?channel->sink_fd:-1, .events = POLLOUT};
+      p[3] = (struct pollfd){.fd = channel->exited?-1:channel->pidfd, .events = POLLIN};
+
+      /* the pty is polled once, for both ways */
+      if ((p[2].fd != -1) && (p[2].fd == p[0].fd)) {
+        p[0].events |= POLLOUT;
+        p[2].fd = -1;
+      }
+    }
+
+    int ready;
+    RETRY_ON_INTR(ready = poll, pfds, 1 + channel_count*4, -1);
+    ERROR(ready == -1, "poll: %s\n", strerror(errno));
+
+    /* channels opened below were not polled yet */
+    int polled = channel_count;
+
+    if (pfds[0].revents & (POLLIN|POLLHUP|POLLERR)) {
+      ssize_t received = relay_fill(sock_fd, &input);
+
+      if ((received == 0) || ((received == -1) && (errno != EAGAIN))) {
+        break;
+      }
+
+      struct mux_header header;
+      char *payload;
+
+      int broken = 0;
+
+      while (!broken && mux_next(&input, &header, &payload)) {
+        broken = (handle_frame(&header, payload) == -1);
+      }
+
+      if (broken) {
+        break;
+      }
+    }
+
+    send_refusals();
+
+    for(int i=channel_count-1; i>=0; i--) {
+      if (i >= polled) {
+        memset(pfds + 1 + i*4, 0, sizeof(struct pollfd) * 4);
+      }
+
+      if (serve_channel(channels[i], pfds + 1 + i*4)) {
+        free_channel(i);
+      }
+    }
+
+    if (relay_flush(sock_fd, &output, NULL) == -1) {
+      break;
+    }
+  }
+
+  for(int i=channel_count-1; i>=0; i--) {
+    if (channels[i]->pidfd != -1) {
+      signal_pidfd(channels[i]->pidfd, SIGHUP);
+    }
+    free_channel(i);
+  }
+}
+
+
+static void reap(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  while (waitpid(-1, NULL, WNOHANG) > 0);
+  errno = saved_errno;
+}
+
+
 int cmd_listen(int argc, char *const argv[]) {
   int opt, index;
 
@@ -39,19 +574,47 @@ int cmd_listen(int argc, char *const argv[]) {
   char *name = getenv("USERNS_NAME");
   ERROR(!name, "running outside a user namespace\n");
 
-  char arg_unix_listen[PATH_MAX+17] = {0};
-  PERROR(<0, snprintf, arg_unix_listen, sizeof(arg_unix_listen), "UNIX-LISTEN:%s/userns/%s/telnetd,fork", rundir, name);
+  char socket_path[PATH_MAX] = {0};
+  snprintf(socket_path, PATH_MAX, "%s/userns/%s/telnetd", rundir, name);
+  unlink(socket_path);
 
-  char *command = (optind >= argc)?getenv("SHELL"):argv[optind];
-  if (!command) {
-    command = "/bin/sh";
-  }
+  int listen_fd = -1;
+  PERROR(==-1, listen_fd = socket, AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
 
-  char arg_exec[PATH_MAX+36] = {0};
-  PERROR(<0, snprintf, arg_exec, sizeof(arg_exec), "EXEC:%s,pty,setsid,setpgid,stderr,ctty", command);
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+  PERROR(==-1, bind, listen_fd, &addr, sizeof(addr));
+  PERROR(==-1, listen, listen_fd, SOMAXCONN);
 
-  PERROR(==-1, execlp, "socat", "socat", arg_unix_listen, arg_exec, NULL);
-  exit(EXIT_FAILURE);
+  default_command = make_argv(optind, argc, argv);
+
+  struct sigaction action = {.sa_handler = reap, .sa_flags = SA_RESTART|SA_NOCLDSTOP};
+  PERROR(==-1, sigaction, SIGCHLD, &action, NULL);
+  VERBOSE("start listening on '%s'\n", socket_path);
+
+  /* a process for each connection, serving all of its channels */
+  for(;;) {
+    int sock_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock_fd == -1) {
+      ERROR(errno != EINTR && errno != ECONNABORTED, "accept: %s\n", strerror(errno));
+      continue;
+    }
+
+    pid_t pid = -1;
+    PERROR(==-1, pid = fork);
+
+    if (pid == 0) {
+      close(listen_fd);
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGPIPE, SIG_IGN);
+      serve(sock_fd);
+      exit(EXIT_SUCCESS);
+    }
+
+    close(sock_fd);
+  }
+
+  return EXIT_FAILURE;
 err:
   fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
   exit(EXIT_FAILURE);
@@ -0,0 +1,702 @@
+#include "global.h"
+
+
+static char *opt_netns = NULL;
+static char *opt_file = NULL;
+static int opt_delete = 0;
+
+
+static struct option options[] = {
+  {"netns",        required_argument, NULL, 'n'},
+  {"file",         required_argument, NULL, 'f'},
+  {"delete",       no_argument,       NULL, 'd'},
+  {"help",         no_argument,       NULL, 'h'},
+
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options] [operation [, operation]...]\n", executable, cmd_name);
+  printf("\n"
+         "  -n, --netns=NETNS          configure the netns named NETNS\n"
+         "  -f, --file=FILE            read operations from FILE, one per line\n"
+         "  -d, --delete               remove what veth, address, route and rule\n"
+         "                             operations would add\n"
+         "\n"
+         "  -h, --help                 print help message and exit\n"
+         "\n"
+         "Operations are\n"
+         "\n"
+         "  veth NAME PEER [netns NETNS]\n"
+         "  move LINK NETNS\n"
+         "  up LINK\n"
+         "  down LINK\n"
+         "  address LINK ADDRESS[/PREFIX]\n"
+         "  route [local] PREFIX|default [via ADDRESS] [dev LINK] [src ADDRESS]\n"
+         "        [metric N] [table N]\n"
+         "  rule [from PREFIX] [to PREFIX] [fwmark MARK[/MASK]] [iif LINK]\n"
+         "       [priority N] table N\n"
+         "\n"
+         "NETNS is a name as given to 'ip netns add'. Operations go to the\n"
+         "kernel in as few messages as possible, in the order given.\n"
+         );
+  exit(0);
+}
+
+
+struct operation {
+  int count;
+  char **words;
+};
+
+
+static struct operation *operations = NULL;
+static int operation_count = 0;
+static char *current = NULL;
+static int failed = 0;
+
+static struct nl_batch batch;
+
+
+static void add_operation(char **words, int count) {
+  if (!count) {
+    return;
+  }
+
+  if (!(operation_count & (operation_count-1))) {
+    operations = realloc(operations, (operation_count?operation_count*2:1) * sizeof(struct operation));
+    ERROR(!operations, "out of memory\n");
+  }
+
+  operations[operation_count++] = (struct operation){.count = count, .words = words};
+}
+
+
+/* operations on the command line are separated by a lone ',' */
+static void args_operations(int start, int argc, char *const argv[]) {
+  for(int i=start; i<=argc; i++) {
+    if ((i == argc) || !strcmp(argv[i], ",")) {
+      add_operation((char **)(argv+start), i-start);
+      start = i+1;
+    }
+  }
+}
+
+
+static void file_operations() {
+  FILE *file = strcmp(opt_file, "-")?fopen(opt_file, "re"):stdin;
+  ERROR(!file, "cannot open '%s': %s\n", opt_file, strerror(errno));
+
+  char *line = NULL;
+  size_t size = 0;
+
+  while (getline(&line, &size, file) != -1) {
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+
+    char **words = calloc(strlen(line)/2+2, sizeof(char *));
+    ERROR(!words, "out of memory\n");
+    int count = 0;
+    char *saveptr = NULL;
+
+    for(char *word = strtok_r(line, " \t\n", &saveptr); word; word = strtok_r(NULL, " \t\n", &saveptr)) {
+      words[count++] = strdup(word);
+    }
+
+    add_operation(words, count);
+  }
+
+  free(line);
+
+  if (file != stdin) {
+    fclose(file);
+  }
+}
+
+
+static void report(char const *error, char const *detail) {
+  if (!batch.quiet) {
+    LOG("'%s': %s%s%s\n", current, error, detail?", ":"", detail?detail:"");
+  }
+
+  failed = 1;
+}
+
+
+/* operations are named by their words in messages */
+static char *join_words(char **words, int count) {
+  size_t size = 1;
+  for(int i=0; i<count; i++) {
+    size += strlen(words[i]) + 1;
+  }
+
+  char *text = calloc(size, 1);
+  ERROR(!text, "out of memory\n");
+
+  for(int i=0; i<count; i++) {
+    strcat(text, i?" ":"");
+    strcat(text, words[i]);
+  }
+
+  return text;
+}
+
+
+/* With --delete, new_type becomes del_type and nothing is created. */
+static struct nlmsghdr *begin_message(uint16_t new_type, uint16_t del_type, void const *header, size_t size) {
+  uint16_t type = opt_delete?del_type:new_type;
+  uint16_t flags = (opt_delete || (new_type == RTM_SETLINK))?0:(NLM_F_CREATE|NLM_F_EXCL);
+  return nl_begin(&batch, type, NLM_F_ACK|flags, header, size, current);
+}
+
+
+/* The fd stays open until its message has been sent, so the batch
+   must not be sent in between. Returns -1 after reporting the error. */
+static int open_netns(char const *name) {
+  nl_reserve(&batch);
+
+  char path[PATH_MAX] = {0};
+  snprintf(path, PATH_MAX, "/var/run/netns/%s", name);
+
+  int fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    report("cannot open netns", strerror(errno));
+    return -1;
+  }
+
+  nl_keep_fd(&batch, fd);
+  return fd;
+}
+
+
+/* the kernel refuses names that do not fit in an ifreq */
+static int check_name(char const *name) {
+  if (strlen(name) >= IFNAMSIZ) {
+    report("name too long", name);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* An earlier operation in the batch may be what creates name, so the
+   batch is sent first if name is not found. Returns 0 after reporting
+   the error. */
+static int link_index(char const *name) {
+  if (check_name(name) == -1) {
+    return 0;
+  }
+
+  struct ifreq ifr = {0};
+  strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
+
+  if (ioctl(batch.fd, SIOCGIFINDEX, &ifr) == -1) {
+    if (!batch.count) {
+      report("no such link", name);
+      return 0;
+    }
+
+    nl_flush(&batch);
+    return link_index(name);
+  }
+
+  return ifr.ifr_ifindex;
+}
+
+
+/* ADDRESS[/PREFIX], the prefix defaults to the whole address */
+static int parse_prefix(char const *text, int *family, unsigned char *address, int *prefix) {
+  char buffer[INET6_ADDRSTRLEN+8] = {0};
+  strncpy(buffer, text, sizeof(buffer)-1);
+
+  char *slash = strchr(buffer, '/');
+  if (slash) {
+    *slash = '\0';
+  }
+
+  if (inet_pton(AF_INET, buffer, address) == 1) {
+    *family = AF_INET;
+    *prefix = 32;
+  } else if (inet_pton(AF_INET6, buffer, address) == 1) {
+    *family = AF_INET6;
+    *prefix = 128;
+  } else {
+    report("bad address", text);
+    return -1;
+  }
+
+  if (slash) {
+    char *end = NULL;
+    long value = strtol(slash+1, &end, 10);
+
+    if (*end || (end == slash+1) || (value < 0) || (value > *prefix)) {
+      report("bad prefix length", text);
+      return -1;
+    }
+
+    *prefix = value;
+  }
+
+  return 0;
+}
+
+
+static int parse_u32(char const *text, uint32_t *value) {
+  char *end = NULL;
+  unsigned long long number = strtoull(text, &end, 0);
+
+  if (*end || (end == text) || (number > UINT32_MAX)) {
+    report("bad number", text);
+    return -1;
+  }
+
+  *value = number;
+  return 0;
+}
+
+
+static void op_veth(char **words, int count) {
+  if ((count != 3) && !((count == 5) && !strcmp(words[3], "netns"))) {
+    report("expected veth NAME PEER [netns NETNS]", NULL);
+    return;
+  }
+
+  if ((check_name(words[1]) == -1) || (check_name(words[2]) == -1)) {
+    return;
+  }
+
+  struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+
+  /* the peer goes with it */
+  if (opt_delete) {
+    struct nlmsghdr *msg = begin_message(RTM_NEWLINK, RTM_DELLINK, &ifi, sizeof(ifi));
+    nl_string(msg, IFLA_IFNAME, words[1]);
+    nl_end(&batch, msg);
+    return;
+  }
+
+  int netns_fd = -1;
+  if ((count == 5) && ((netns_fd = open_netns(words[4])) == -1)) {
+    return;
+  }
+
+  struct nlmsghdr *msg = begin_message(RTM_NEWLINK, RTM_DELLINK, &ifi, sizeof(ifi));
+  nl_string(msg, IFLA_IFNAME, words[1]);
+
+  struct rtattr *info = nl_attr(msg, IFLA_LINKINFO, NULL, 0);
+  nl_string(msg, IFLA_INFO_KIND, "veth");
+  struct rtattr *data = nl_attr(msg, IFLA_INFO_DATA, NULL, 0);
+  struct rtattr *peer = nl_attr(msg, VETH_INFO_PEER, NULL, 0);
+  nl_data(msg, &ifi, sizeof(ifi));
+  nl_string(msg, IFLA_IFNAME, words[2]);
+
+  if (netns_fd != -1) {
+    nl_u32(msg, IFLA_NET_NS_FD, netns_fd);
+  }
+
+  nl_nest_end(msg, peer);
+  nl_nest_end(msg, data);
+  nl_nest_end(msg, info);
+  nl_end(&batch, msg);
+}
+
+
+/* move, up and down change a link found by name */
+static void op_link(char **words, int count) {
+  int is_move = !strcmp(words[0], "move");
+
+  if (count != (is_move?3:2)) {
+    report(is_move?"expected move LINK NETNS":"expected up|down LINK", NULL);
+    return;
+  }
+
+  if (opt_delete) {
+    report("cannot be undone", NULL);
+    return;
+  }
+
+  if (check_name(words[1]) == -1) {
+    return;
+  }
+
+  int netns_fd = -1;
+  if (is_move && ((netns_fd = open_netns(words[2])) == -1)) {
+    return;
+  }
+
+  struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+
+  if (!is_move) {
+    ifi.ifi_change = IFF_UP;
+    ifi.ifi_flags = strcmp(words[0], "up")?0:IFF_UP;
+  }
+
+  struct nlmsghdr *msg = begin_message(RTM_SETLINK, RTM_SETLINK, &ifi, sizeof(ifi));
+  nl_string(msg, IFLA_IFNAME, words[1]);
+
+  if (is_move) {
+    nl_u32(msg, IFLA_NET_NS_FD, netns_fd);
+  }
+
+  nl_end(&batch, msg);
+}
+
+
+static void op_address(char **words, int count) {
+  if (count != 3) {
+    report("expected address LINK ADDRESS[/PREFIX]", NULL);
+    return;
+  }
+
+  int family, prefix;
+  unsigned char address[16];
+
+  if (parse_prefix(words[2], &family, address, &prefix) == -1) {
+    return;
+  }
+
+  int index = link_index(words[1]);
+  if (!index) {
+    return;
+  }
+
+  struct ifaddrmsg ifa = {.ifa_family = family, .ifa_prefixlen = prefix, .ifa_index = index};
+  struct nlmsghdr *msg = begin_message(RTM_NEWADDR, RTM_DELADDR, &ifa, sizeof(ifa));
+  size_t size = (family == AF_INET)?4:16;
+  nl_attr(msg, IFA_LOCAL, address, size);
+  nl_attr(msg, IFA_ADDRESS, address, size);
+  nl_end(&batch, msg);
+}
+
+
+static void op_route(char **words, int count) {
+  struct rtmsg rtm = {
+    .rtm_table = RT_TABLE_MAIN,
+    .rtm_protocol = RTPROT_BOOT,
+    .rtm_scope = RT_SCOPE_UNIVERSE,
+    .rtm_type = RTN_UNICAST,
+  };
+
+  int i = 1;
+
+  if ((i < count) && !strcmp(words[i], "local")) {
+    rtm.rtm_type = RTN_LOCAL;
+    rtm.rtm_scope = RT_SCOPE_HOST;
+    i += 1;
+  }
+
+  if (i >= count) {
+    report("missing destination", NULL);
+    return;
+  }
+
+  int family = AF_UNSPEC, prefix = 0;
+  unsigned char dst[16], gateway[16], src[16];
+  int has_gateway = 0, has_src = 0, oif = 0;
+  uint32_t table = RT_TABLE_MAIN, metric = 0;
+  int has_metric = 0;
+
+  if (strcmp(words[i], "default") && (parse_prefix(words[i], &family, dst, &prefix) == -1)) {
+    return;
+  }
+
+  for(i += 1; i < count; i += 2) {
+    if (i+1 >= count) {
+      report("missing value of", words[i]);
+      return;
+    }
+
+    int value_family = family;
+
+    if (!strcmp(words[i], "via")) {
+      int length;
+      if (parse_prefix(words[i+1], &value_family, gateway, &length) == -1) {
+        return;
+      }
+      has_gateway = 1;
+    } else if (!strcmp(words[i], "src")) {
+      int length;
+      if (parse_prefix(words[i+1], &value_family, src, &length) == -1) {
+        return;
+      }
+      has_src = 1;
+    } else if (!strcmp(words[i], "dev")) {
+      if (!(oif = link_index(words[i+1]))) {
+        return;
+      }
+    } else if (!strcmp(words[i], "table")) {
+      if (parse_u32(words[i+1], &table) == -1) {
+        return;
+      }
+    } else if (!strcmp(words[i], "metric")) {
+      if (parse_u32(words[i+1], &metric) == -1) {
+        return;
+      }
+      has_metric = 1;
+    } else {
+      report("unknown route option", words[i]);
+      return;
+    }
+
+    if ((family != AF_UNSPEC) && (value_family != family)) {
+      report("mixed address families", NULL);
+      return;
+    }
+
+    family = value_family;
+  }
+
+  /* a route without a gateway reaches hosts on the link directly,
+     any scope matches a route to delete */
+  if ((rtm.rtm_type == RTN_UNICAST) && !has_gateway) {
+    rtm.rtm_scope = RT_SCOPE_LINK;
+  }
+
+  if (opt_delete) {
+    rtm.rtm_scope = RT_SCOPE_NOWHERE;
+  }
+
+  rtm.rtm_family = (family == AF_UNSPEC)?AF_INET:family;
+  rtm.rtm_dst_len = prefix;
+  rtm.rtm_table = (table < 256)?table:RT_TABLE_UNSPEC;
+  size_t size = (rtm.rtm_family == AF_INET)?4:16;
+
+  struct nlmsghdr *msg = begin_message(RTM_NEWROUTE, RTM_DELROUTE, &rtm, sizeof(rtm));
+  nl_u32(msg, RTA_TABLE, table);
+
+  if (prefix) {
+    nl_attr(msg, RTA_DST, dst, size);
+  }
+
+  if (has_gateway) {
+    nl_attr(msg, RTA_GATEWAY, gateway, size);
+  }
+
+  if (has_src) {
+    nl_attr(msg, RTA_PREFSRC, src, size);
+  }
+
+  if (oif) {
+    nl_u32(msg, RTA_OIF, oif);
+  }
+
+  if (has_metric) {
+    nl_u32(msg, RTA_PRIORITY, metric);
+  }
+
+  nl_end(&batch, msg);
+}
+
+
+static void op_rule(char **words, int count) {
+  struct fib_rule_hdr frh = {.family = AF_UNSPEC, .action = FR_ACT_TO_TBL};
+  unsigned char from[16], to[16];
+  uint32_t table = 0, priority = 0, mark = 0, mask = 0;
+  int has_priority = 0, has_mark = 0;
+  char const *iif = NULL;
+
+  for(int i=1; i<count; i+=2) {
+    if (i+1 >= count) {
+      report("missing value of", words[i]);
+      return;
+    }
+
+    int family = frh.family, length;
+
+    if (!strcmp(words[i], "from")) {
+      if (parse_prefix(words[i+1], &family, from, &length) == -1) {
+        return;
+      }
+      frh.src_len = length;
+    } else if (!strcmp(words[i], "to")) {
+      if (parse_prefix(words[i+1], &family, to, &length) == -1) {
+        return;
+      }
+      frh.dst_len = length;
+    } else if (!strcmp(words[i], "fwmark")) {
+      char *slash = strchr(words[i+1], '/');
+      if (slash) {
+        *slash = '\0';
+      }
+
+      if ((parse_u32(words[i+1], &mark) == -1) || (slash && (parse_u32(slash+1, &mask) == -1))) {
+        return;
+      }
+
+      mask = slash?mask:UINT32_MAX;
+      has_mark = 1;
+    } else if (!strcmp(words[i], "iif")) {
+      if (check_name(words[i+1]) == -1) {
+        return;
+      }
+      iif = words[i+1];
+    } else if (!strcmp(words[i], "table") || !strcmp(words[i], "lookup")) {
+      if (parse_u32(words[i+1], &table) == -1) {
+        return;
+      }
+    } else if (!strcmp(words[i], "priority") || !strcmp(words[i], "pref")) {
+      if (parse_u32(words[i+1], &priority) == -1) {
+        return;
+      }
+      has_priority = 1;
+    } else {
+      report("unknown rule option", words[i]);
+      return;
+    }
+
+    if ((frh.family != AF_UNSPEC) && (family != frh.family)) {
+      report("mixed address families", NULL);
+      return;
+    }
+
+    frh.family = family;
+  }
+
+  if (!table) {
+    report("missing table", NULL);
+    return;
+  }
+
+  frh.family = (frh.family == AF_UNSPEC)?AF_INET:frh.family;
+  frh.table = (table < 256)?table:RT_TABLE_UNSPEC;
+  size_t size = (frh.family == AF_INET)?4:16;
+
+  struct nlmsghdr *msg = begin_message(RTM_NEWRULE, RTM_DELRULE, &frh, sizeof(frh));
+  nl_u32(msg, FRA_TABLE, table);
+
+  if (frh.src_len) {
+    nl_attr(msg, FRA_SRC, from, size);
+  }
+
+  if (frh.dst_len) {
+    nl_attr(msg, FRA_DST, to, size);
+  }
+
+  if (has_mark) {
+    nl_u32(msg, FRA_FWMARK, mark);
+    nl_u32(msg, FRA_FWMASK, mask);
+  }
+
+  if (iif) {
+    nl_string(msg, FRA_IIFNAME, iif);
+  }
+
+  if (has_priority) {
+    nl_u32(msg, FRA_PRIORITY, priority);
+  }
+
+  nl_end(&batch, msg);
+}
+
+
+struct operation_type {
+  char const *name;
+  void (*func)(char **words, int count);
+};
+
+
+static struct operation_type operation_types[] = {
+  {"veth",    op_veth},
+  {"move",    op_link},
+  {"up",      op_link},
+  {"down",    op_link},
+  {"address", op_address},
+  {"route",   op_route},
+  {"rule",    op_rule},
+};
+
+
+static int run_operations(int quiet) {
+  nl_open(&batch, NETLINK_ROUTE);
+  batch.quiet = quiet;
+
+  for(int i=0; i<operation_count; i++) {
+    char **words = operations[i].words;
+    size_t type = 0;
+    current = join_words(words, operations[i].count);
+
+    while ((type < sizeof(operation_types)/sizeof(struct operation_type)) && strcmp(operation_types[type].name, words[0])) {
+      type += 1;
+    }
+
+    if (type == sizeof(operation_types)/sizeof(struct operation_type)) {
+      report("unknown operation", words[0]);
+      continue;
+    }
+
+    operation_types[type].func(words, operations[i].count);
+  }
+
+  nl_flush(&batch);
+  close(batch.fd);
+  return (failed || batch.failed)?EXIT_FAILURE:EXIT_SUCCESS;
+}
+
+
+/* Runs operations as 'net' does with the words of argv, in the
+   current netns. With quiet, failures are not reported. */
+int net_apply(int argc, char *const argv[], int delete, int quiet) {
+  opt_delete = delete;
+  operation_count = 0;
+  failed = 0;
+  args_operations(0, argc, argv);
+  return run_operations(quiet);
+}
+
+
+int cmd_net(int argc, char *const argv[]) {
+  int opt, index;
+
+  while((opt = getopt_long(argc, argv, "+n:f:dh", options, &index)) != -1) {
+    switch(opt) {
+    case '?':
+      goto err;
+
+    case 'h':
+      show_usage();
+      break;
+
+    case 'n':
+      opt_netns = optarg;
+      break;
+
+    case 'f':
+      opt_file = optarg;
+      break;
+
+    case 'd':
+      opt_delete = 1;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  BADOPT(opt_file && (optind < argc), "operations are given either in a file or as arguments\n");
+
+  if (opt_file) {
+    file_operations();
+  } else {
+    args_operations(optind, argc, argv);
+  }
+
+  if (opt_netns) {
+    char path[PATH_MAX] = {0};
+    snprintf(path, PATH_MAX, "/var/run/netns/%s", opt_netns);
+
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    BADOPT(fd == -1, "cannot open netns named '%s'\n", opt_netns);
+    PERROR(==-1, setns, fd, CLONE_NEWNET);
+    close(fd);
+  }
+
+  return run_operations(0);
+err:
+  fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
+  exit(EXIT_FAILURE);
+}
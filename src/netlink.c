@@ -0,0 +1,168 @@
+#include "global.h"
+
+
+void nl_open(struct nl_batch *batch, int protocol) {
+  *batch = (struct nl_batch){.first_seq = 1};
+  PERROR(==-1, batch->fd = socket, AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, protocol);
+
+  int on = 1;
+  setsockopt(batch->fd, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof(on));
+  setsockopt(batch->fd, SOL_NETLINK, NETLINK_EXT_ACK, &on, sizeof(on));
+
+  struct sockaddr_nl local = {.nl_family = AF_NETLINK};
+  PERROR(==-1, bind, batch->fd, (struct sockaddr *)&local, sizeof(local));
+}
+
+
+static void report_error(struct nl_batch *batch, struct nlmsghdr *msg, int index) {
+  struct nlmsgerr *err = NLMSG_DATA(msg);
+  char const *detail = NULL;
+
+  if (msg->nlmsg_flags & NLM_F_ACK_TLVS) {
+    struct rtattr *attr = (struct rtattr *)(err+1);
+    int attr_length = msg->nlmsg_len - NLMSG_LENGTH(sizeof(struct nlmsgerr));
+
+    for(; RTA_OK(attr, attr_length); attr = RTA_NEXT(attr, attr_length)) {
+      if (attr->rta_type == NLMSGERR_ATTR_MSG) {
+        detail = RTA_DATA(attr);
+      }
+    }
+  }
+
+  if (!batch->quiet) {
+    LOG("'%s': %s%s%s\n", batch->what[index], strerror(-err->error), detail?", ":"", detail?detail:"");
+  }
+
+  batch->failed = 1;
+}
+
+
+/* Sends the batch and reads an ack for each message asking for one,
+   the kernel goes on after a message fails. An error on a message not
+   asking for an ack ends the batch, as when the kernel refuses a
+   whole nfnetlink batch. */
+void nl_flush(struct nl_batch *batch) {
+  if (!batch->count) {
+    return;
+  }
+
+  struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+  ssize_t sent;
+  RETRY_ON_INTR(sent = sendto, batch->fd, batch->data, batch->size, 0, (struct sockaddr *)&kernel, sizeof(kernel));
+  ERROR(sent != (ssize_t)batch->size, "netlink sendto: %s\n", strerror(errno));
+
+  static char reply[NL_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+  for(int acked=0; acked<batch->acks;) {
+    ssize_t received;
+    RETRY_ON_INTR(received = recv, batch->fd, reply, sizeof(reply), 0);
+    ERROR(received == -1, "netlink recv: %s\n", strerror(errno));
+
+    int length = received;
+
+    for(struct nlmsghdr *msg = (struct nlmsghdr *)reply; NLMSG_OK(msg, length); msg = NLMSG_NEXT(msg, length)) {
+      uint32_t index = msg->nlmsg_seq - batch->first_seq;
+
+      if ((msg->nlmsg_type != NLMSG_ERROR) || (index >= (uint32_t)batch->count)) {
+        continue;
+      }
+
+      struct nlmsgerr *err = NLMSG_DATA(msg);
+
+      if (err->error) {
+        report_error(batch, msg, index);
+      }
+
+      acked = batch->wants_ack[index]?(acked+1):batch->acks;
+    }
+  }
+
+  for(int i=0; i<batch->fd_count; i++) {
+    close(batch->fds[i]);
+  }
+
+  VERBOSE("%d messages in %zu bytes\n", batch->count, batch->size);
+  batch->fd_count = 0;
+  batch->count = 0;
+  batch->acks = 0;
+  batch->size = 0;
+  batch->first_seq = batch->seq+1;
+}
+
+
+/* makes room for one more message */
+void nl_reserve(struct nl_batch *batch) {
+  if ((batch->size + NL_MESSAGE_MAX > sizeof(batch->data)) || (batch->count == NL_MAX_BATCH)) {
+    nl_flush(batch);
+  }
+}
+
+
+/* A failure of the message is reported as one of what, which has to
+   stay valid until the batch is sent. */
+struct nlmsghdr *nl_begin(struct nl_batch *batch, uint16_t type, uint16_t flags,
+                          void const *header, size_t size, char const *what) {
+  nl_reserve(batch);
+
+  struct nlmsghdr *msg = (struct nlmsghdr *)(batch->data + batch->size);
+  *msg = (struct nlmsghdr){
+    .nlmsg_len = NLMSG_LENGTH(size),
+    .nlmsg_type = type,
+    .nlmsg_flags = NLM_F_REQUEST|flags,
+    .nlmsg_seq = ++(batch->seq),
+  };
+
+  memcpy(NLMSG_DATA(msg), header, size);
+  batch->what[batch->count] = what;
+  batch->wants_ack[batch->count] = (flags & NLM_F_ACK) != 0;
+  batch->acks += batch->wants_ack[batch->count];
+  batch->count += 1;
+  return msg;
+}
+
+
+void nl_end(struct nl_batch *batch, struct nlmsghdr *msg) {
+  batch->size += NLMSG_ALIGN(msg->nlmsg_len);
+}
+
+
+/* fd is closed once the batch has been sent */
+void nl_keep_fd(struct nl_batch *batch, int fd) {
+  batch->fds[batch->fd_count++] = fd;
+}
+
+
+void nl_data(struct nlmsghdr *msg, void const *data, size_t size) {
+  memcpy((char *)msg + NLMSG_ALIGN(msg->nlmsg_len), data, size);
+  msg->nlmsg_len = NLMSG_ALIGN(msg->nlmsg_len) + size;
+}
+
+
+/* with no data, starts a nested attribute closed by nl_nest_end() */
+struct rtattr *nl_attr(struct nlmsghdr *msg, uint16_t type, void const *data, size_t size) {
+  struct rtattr *attr = (struct rtattr *)((char *)msg + NLMSG_ALIGN(msg->nlmsg_len));
+  attr->rta_type = type;
+  attr->rta_len = RTA_LENGTH(size);
+
+  if (size) {
+    memcpy(RTA_DATA(attr), data, size);
+  }
+
+  msg->nlmsg_len = NLMSG_ALIGN(msg->nlmsg_len) + RTA_ALIGN(attr->rta_len);
+  return attr;
+}
+
+
+void nl_string(struct nlmsghdr *msg, uint16_t type, char const *str) {
+  nl_attr(msg, type, str, strlen(str)+1);
+}
+
+
+void nl_u32(struct nlmsghdr *msg, uint16_t type, uint32_t value) {
+  nl_attr(msg, type, &value, sizeof(value));
+}
+
+
+void nl_nest_end(struct nlmsghdr *msg, struct rtattr *nest) {
+  nest->rta_len = (char *)msg + msg->nlmsg_len - (char *)nest;
+}
@@ -0,0 +1,450 @@
+#include "global.h"
+
+
+#define OPT_USERNS 0
+#define OPT_NETNS  1
+#define OPT_INIT   2
+
+
+#define MEMBER_STACK_SIZE (1 << 20)
+#define MAX_MEMBERS       256
+#define RESPAWN_MIN_MS    100
+#define RESPAWN_MAX_MS    10000
+
+
+static char *opt_name = NULL;
+static char *opt_domain = NULL;
+static int opt_size = 4;
+static int opt_userns = 0;
+static int opt_netns = 0;
+static int opt_init = 0;
+
+
+static struct option options[] = {
+  {"name",         required_argument, NULL, 'n'},
+  {"domain",       required_argument, NULL, 'd'},
+  {"size",         required_argument, NULL, 'k'},
+  {"user",         no_argument,       NULL, OPT_USERNS},
+  {"net",          no_argument,       NULL, OPT_NETNS},
+  {"init",         no_argument,       NULL, OPT_INIT},
+  {"help",         no_argument,       NULL, 'h'},
+
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options]\n", executable, cmd_name);
+  printf("\n"
+         "  -n, --name=NAME            name of the pool\n"
+         "  -d, --domain=DOMAIN        domain of the namespaces\n"
+         "  -k, --size=K               idle namespaces kept ready (default 4)\n"
+         "      --user                 new USER namespace\n"
+         "      --net                  new NET namespace for each\n"
+         "      --init                 set up mounts and environment inside\n"
+         "\n"
+         "  -h, --help                 print help message and exit\n"
+         );
+  exit(0);
+}
+
+
+/* An idle namespace, its init process waits on ctl_fd for the
+   connection of the client claiming it. */
+struct member {
+  pid_t pid;
+  int ctl_fd;
+};
+
+
+static struct member members[MAX_MEMBERS];
+static int member_count = 0;
+static int listen_fd = -1;
+static int signal_fd = -1;
+static long long respawn_at = 0;
+static int respawn_delay = 0;
+
+
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Reads the claim, renames the namespace, runs the payload on the
+   client's stdio and reports its exit status back. */
+static int serve_claim(int client_fd) {
+  struct exec_command command;
+
+  if (recv_exec_request(client_fd, &command) == -1) {
+    LOG("bad pool request\n");
+    return EXIT_FAILURE;
+  }
+
+  /* claimed, the namespace now belongs to the client and outlives the
+     pool */
+  PERROR(==-1, prctl, PR_SET_PDEATHSIG, 0);
+
+  char *name = command.name;
+  char **args = command.argv;
+
+  clearenv();
+  for(char **env = command.envp; *env; env++) {
+    putenv(*env);
+  }
+
+  /* the client's environment is cut down as init_ns does it */
+  if (opt_init) {
+    init_hostname(name, opt_domain);
+    init_env(name, opt_domain);
+  } else {
+    PERROR(==-1, sethostname, name, strlen(name));
+    setenv("USERNS_NAME", name, 1);
+    setenv("USERNS_DOMAIN", opt_domain, 1);
+  }
+
+  if (chdir(command.cwd) == -1) {
+    VERBOSE("cannot change directory to '%s': %s\n", command.cwd, strerror(errno));
+  }
+
+  /* as the init of the namespace, orphans are reaped here too */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  PERROR(==-1, sigprocmask, SIG_BLOCK, &mask, NULL);
+
+  int child_fd = -1;
+  PERROR(==-1, child_fd = signalfd, -1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+
+  pid_t pid = -1;
+  PERROR(==-1, pid = fork);
+
+  if (pid == 0) {
+    sigemptyset(&mask);
+    PERROR(==-1, sigprocmask, SIG_SETMASK, &mask, NULL);
+
+    for(int i=0; i<3; i++) {
+      PERROR(==-1, dup2, command.stdio[i], i);
+    }
+
+    VERBOSE("exec '%s'\n", args[0]);
+    PERROR(==-1, execvp, args[0], args);
+    return EXIT_FAILURE;
+  }
+
+  for(int i=0; i<3; i++) {
+    close(command.stdio[i]);
+  }
+
+  /* signals from the client are passed on, and its going away is a
+     hangup, as with execd */
+  int32_t status = -1;
+  int conn_fd = client_fd;
+
+  while (status == -1) {
+    struct pollfd pfds[2] = {
+      {.fd = conn_fd, .events = POLLIN},
+      {.fd = child_fd, .events = POLLIN},
+    };
+
+    int ready;
+    RETRY_ON_INTR(ready = poll, pfds, 2, -1);
+    ERROR(ready == -1, "poll: %s\n", strerror(errno));
+
+    if (pfds[0].revents & (POLLIN|POLLHUP|POLLERR)) {
+      int32_t sig;
+
+      if (recv(conn_fd, &sig, sizeof(sig), MSG_DONTWAIT) == sizeof(sig)) {
+        kill(pid, sig);
+      } else {
+        kill(pid, SIGHUP);
+        conn_fd = -1;
+      }
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(child_fd, &info, sizeof(info)) == sizeof(info));
+
+      int child_status;
+      pid_t child_pid;
+
+      while ((child_pid = waitpid(-1, &child_status, WNOHANG)) > 0) {
+        if (child_pid == pid) {
+          status = WIFSIGNALED(child_status)?(WTERMSIG(child_status)+128):WEXITSTATUS(child_status);
+        }
+      }
+    }
+  }
+
+  send(client_fd, &status, sizeof(status), MSG_NOSIGNAL);
+  return status;
+}
+
+
+static int member_main(void *arg) {
+  int ctl_fd = *(int *)arg;
+
+  PERROR(==-1, prctl, PR_SET_PDEATHSIG, SIGKILL);
+  close(listen_fd);
+  close(signal_fd);
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  PERROR(==-1, sigprocmask, SIG_SETMASK, &mask, NULL);
+
+  for(int i=0; i<member_count; i++) {
+    close(members[i].ctl_fd);
+  }
+
+  setenv("USERNS_NAME", opt_name, 1);
+  PERROR(==-1, sethostname, opt_name, strlen(opt_name));
+  setenv("USERNS_DOMAIN", opt_domain, 1);
+  PERROR(==-1, setdomainname, opt_domain, strlen(opt_domain));
+
+  if (opt_init) {
+    init_ns();
+  }
+
+  int client_fd = recv_fd(ctl_fd);
+  close(ctl_fd);
+
+  if (client_fd == -1) {
+    return EXIT_FAILURE;
+  }
+  return serve_claim(client_fd);
+}
+
+
+static void add_member() {
+  static char *stack = NULL;
+  if (!stack) {
+    stack = mmap(NULL, MEMBER_STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+    ERROR(stack == MAP_FAILED, "cannot allocate stack\n");
+  }
+
+  int fds[2];
+  PERROR(==-1, socketpair, AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds);
+
+  int flags = CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC | CLONE_NEWPID;
+  if (opt_netns) {
+    flags |= CLONE_NEWNET;
+  }
+
+  pid_t pid = -1;
+  PERROR(==-1, pid = clone, member_main, stack+MEMBER_STACK_SIZE, flags|SIGCHLD, &(fds[1]));
+  close(fds[1]);
+
+  members[member_count].pid = pid;
+  members[member_count].ctl_fd = fds[0];
+  member_count += 1;
+  VERBOSE("namespace %ld is ready\n", (long)pid);
+}
+
+
+static void remove_member(int i) {
+  close(members[i].ctl_fd);
+  members[i] = members[member_count-1];
+  member_count -= 1;
+}
+
+
+/* The oldest idle namespace goes to the client, which gets its pid
+   first to write its pid file. A namespace that has died meanwhile
+   is skipped, one started afresh is the last resort. */
+static void hand_off(int client_fd) {
+  int fresh = 0;
+  struct member member;
+
+  for(;;) {
+    if (!member_count) {
+      if (fresh) {
+        LOG("no namespace could take the claim\n");
+        return;
+      }
+
+      add_member();
+      fresh = 1;
+    }
+
+    member = members[0];
+    memmove(members, members+1, sizeof(struct member) * (member_count-1));
+    member_count -= 1;
+
+    if (send_fds(member.ctl_fd, &client_fd, 1, 0) == 0) {
+      break;
+    }
+
+    VERBOSE("namespace %ld is gone: %s\n", (long)member.pid, strerror(errno));
+    kill(member.pid, SIGKILL);
+    close(member.ctl_fd);
+  }
+
+  int32_t pid = member.pid;
+
+  if (send(client_fd, &pid, sizeof(pid), MSG_NOSIGNAL) != sizeof(pid)) {
+    kill(member.pid, SIGKILL);
+  }
+
+  close(member.ctl_fd);
+}
+
+
+/* Idle namespaces should not die, when they do, e.g. as their setup
+   fails, they are replaced more and more slowly. The delay starts
+   over once failures have stopped for a while. */
+static void backoff() {
+  long long now = now_ms();
+
+  if (!respawn_delay || (now - respawn_at > RESPAWN_MAX_MS)) {
+    respawn_delay = RESPAWN_MIN_MS;
+  } else if (respawn_delay < RESPAWN_MAX_MS) {
+    respawn_delay = (respawn_delay*2 < RESPAWN_MAX_MS)?respawn_delay*2:RESPAWN_MAX_MS;
+  }
+
+  respawn_at = now + respawn_delay;
+  LOG("replacing idle namespace in %d ms\n", respawn_delay);
+}
+
+
+static void reap() {
+  pid_t pid;
+
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    for(int i=0; i<member_count; i++) {
+      if (members[i].pid == pid) {
+        VERBOSE("idle namespace %ld died\n", (long)pid);
+        remove_member(i);
+        backoff();
+        break;
+      }
+    }
+  }
+}
+
+
+int cmd_pool(int argc, char *const argv[]) {
+  int opt, index;
+
+  while((opt = getopt_long(argc, argv, "+n:d:k:h", options, &index)) != -1) {
+    switch(opt) {
+    case '?':
+      goto err;
+
+    case 'h':
+      show_usage();
+      break;
+
+    case 'n':
+      opt_name = optarg;
+      break;
+
+    case 'd':
+      opt_domain = optarg;
+      break;
+
+    case 'k':
+      opt_size = atoi(optarg);
+      BADOPT((opt_size <= 0) || (opt_size > MAX_MEMBERS),
+             "size must be between 1 and %d\n", MAX_MEMBERS);
+      break;
+
+    case OPT_USERNS:
+      opt_userns = 1;
+      break;
+
+    case OPT_NETNS:
+      opt_netns = 1;
+      break;
+
+    case OPT_INIT:
+      opt_init = 1;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  BADOPT(!opt_name, "missing name\n");
+
+  opt_domain = (opt_domain)?opt_domain:getenv("USERNS_DOMAIN");
+  opt_domain = (opt_domain)?opt_domain:"localdomain";
+
+  char *rundir = getenv("XDG_RUNTIME_DIR");
+  ERROR(!rundir, "environment XDG_RUNTIME_DIR is not set\n");
+
+  char socket_path[PATH_MAX] = {0};
+  snprintf(socket_path, PATH_MAX, "%s/userns", rundir);
+  PERROR(==-1 && (errno != EEXIST), mkdir, socket_path, 0700);
+  snprintf(socket_path, PATH_MAX, "%s/userns/%s", rundir, opt_name);
+  PERROR(==-1 && (errno != EEXIST), mkdir, socket_path, 0700);
+  snprintf(socket_path, PATH_MAX, "%s/userns/%s/pool", rundir, opt_name);
+  unlink(socket_path);
+
+  PERROR(==-1, listen_fd = socket, AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+  PERROR(==-1, bind, listen_fd, &addr, sizeof(addr));
+  PERROR(==-1, listen, listen_fd, SOMAXCONN);
+
+  if (opt_userns) {
+    unshare_user();
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  PERROR(==-1, sigprocmask, SIG_BLOCK, &mask, NULL);
+  PERROR(==-1, signal_fd = signalfd, -1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+
+  VERBOSE("start listening on '%s'\n", socket_path);
+
+  /* claims are answered first, the pool is refilled while no client
+     is waiting */
+  for(;;) {
+    struct pollfd pfds[2] = {
+      {.fd = listen_fd, .events = POLLIN},
+      {.fd = signal_fd, .events = POLLIN},
+    };
+
+    int timeout = -1;
+
+    if (member_count < opt_size) {
+      long long left = respawn_at - now_ms();
+      timeout = (left > 0)?left:0;
+    }
+
+    int ready;
+    RETRY_ON_INTR(ready = poll, pfds, 2, timeout);
+    ERROR(ready == -1, "poll: %s\n", strerror(errno));
+
+    if (pfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+      reap();
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (client_fd != -1) {
+        hand_off(client_fd);
+        close(client_fd);
+      }
+      continue;
+    }
+
+    if ((member_count < opt_size) && (now_ms() >= respawn_at)) {
+      add_member();
+    }
+  }
+
+  return EXIT_FAILURE;
+err:
+  fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
+  exit(EXIT_FAILURE);
+}
@@ -1,227 +1,1830 @@
 #include "global.h"
 
 
+#define OPT_SPLICE    0
+#define OPT_PIPE_SIZE 1
+#define OPT_PIN_CPUS  2
+#define OPT_IO_URING  3
+#define OPT_UDP_MAX_FLOWS 4
+#define OPT_UDP_GRO   5
+#define OPT_PREFETCH  6
+#define OPT_CONNECT_TIMEOUT 7
+#define OPT_FASTOPEN  8
+#define OPT_SLOW_MS   9
+#define OPT_SOCKMAP   10
+
+
+static int opt_splice = 0;
+static int opt_pipe_size = 65536;
+static int opt_workers = 1;
+static int opt_pin_cpus = 0;
+static int opt_io_uring = 0;
+static int opt_udp_max_flows = 4096;
+static int opt_udp_gro = 0;
+static int opt_prefetch = 16;
+static int opt_connect_timeout = 30000;
+static int opt_fastopen = 0;
+static int opt_slow_ms = 100;
+static int opt_sockmap = 0;
+
+
 static struct option options[] = {
+  {"splice",       no_argument,       NULL, OPT_SPLICE},
+  {"pipe-size",    required_argument, NULL, OPT_PIPE_SIZE},
+  {"workers",      required_argument, NULL, 'w'},
+  {"pin-cpus",     no_argument,       NULL, OPT_PIN_CPUS},
+  {"io-uring",     no_argument,       NULL, OPT_IO_URING},
+  {"udp-max-flows", required_argument, NULL, OPT_UDP_MAX_FLOWS},
+  {"udp-gro",      no_argument,       NULL, OPT_UDP_GRO},
+  {"prefetch",     required_argument, NULL, OPT_PREFETCH},
+  {"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+  {"fastopen",     no_argument,       NULL, OPT_FASTOPEN},
+  {"slow-ms",      required_argument, NULL, OPT_SLOW_MS},
+  {"sockmap",      no_argument,       NULL, OPT_SOCKMAP},
   {"help",         no_argument,       NULL, 'h'},
 
-  {NULL,           no_argument,       NULL, 0}
-};
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options] protocol port\n", executable, cmd_name);
+  printf("\n"
+         "      --splice               relay tcp with splice(2) through pipes\n"
+         "      --pipe-size=BYTES      size of each splice pipe (default 65536)\n"
+         "  -w, --workers=N            run N worker processes sharing the port\n"
+         "      --pin-cpus             pin each worker to its own cpu\n"
+         "      --io-uring             relay tcp with io_uring instead of epoll, not\n"
+         "                             with --prefetch, --fastopen or --sockmap\n"
+         "      --udp-max-flows=N      udp flows kept before evicting (default 4096)\n"
+         "      --udp-gro              receive coalesced udp, and send it with gso\n"
+         "      --prefetch=N           upstream sockets kept ready (default 16)\n"
+         "      --connect-timeout=MS   give up connecting upstream after MS (default 30000)\n"
+         "      --fastopen             send the first client bytes along with the SYN\n"
+         "      --slow-ms=MS           record tcp setups slower than MS (default 100)\n"
+         "      --sockmap              let a bpf sockmap relay established tcp connections\n"
+         "\n"
+	 "  -h, --help                 print help message and exit\n"
+	 );
+  exit(0);
+}
+
+
+/* counters go here until a stats segment is set up, so the data path
+   never has to check */
+static struct proxy_counters local_counters;
+static struct proxy_counters *stats = &local_counters;
+
+
+static inline void stat_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+
+#define STAT_ADD(counter, n) stat_add(&(stats->counter), (n))
+
+
+/* Creates the stats segment, or returns NULL if it cannot be made.
+   The write lock fails while another proxy still owns the file. It is
+   an OFD lock so stats can test it with F_OFD_GETLK without taking it. */
+static struct proxy_stats *stats_create(char const *rundir, char const *name, char const *proto, int port) {
+  char path[PATH_MAX] = {0};
+  snprintf(path, PATH_MAX, "%s/userns/%s/proxy-%s-%d.stats", rundir, name, proto, port);
+
+  int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+  if (fd == -1) {
+    LOG("cannot open '%s': %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  if (fcntl(fd, F_OFD_SETLK, &lock) == -1) {
+    LOG("another proxy is using '%s', running without stats\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = sizeof(struct proxy_stats) + sizeof(struct proxy_counters) * opt_workers;
+  struct proxy_stats *segment = MAP_FAILED;
+
+  if ((ftruncate(fd, 0) == -1) || (ftruncate(fd, size) == -1) ||
+      ((segment = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+    LOG("cannot map '%s': %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  segment->workers = opt_workers;
+  strncpy(segment->proto, proto, sizeof(segment->proto)-1);
+  segment->port = port;
+  __atomic_store_n(&(segment->magic), PROXY_STATS_MAGIC, __ATOMIC_RELEASE);
+
+  /* the fd stays open, and locked, in every worker */
+  return segment;
+}
+
+
+static long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static long long now_ms() {
+  return now_us() / 1000;
+}
+
+
+static void hist_add(enum proxy_stage stage, long long us) {
+  int bucket = (us > 0)?(64 - __builtin_clzll(us)):0;
+  if (bucket >= PROXY_HIST_BUCKETS) {
+    bucket = PROXY_HIST_BUCKETS - 1;
+  }
+
+  stat_add(&(stats->hist[stage][bucket]), 1);
+}
+
+
+/* The entry is filled in before slow_head moves past it, a reader
+   racing with a full turn of the ring may still see it torn. */
+static void slow_record(struct sockaddr_in const *dst, int error, long long const *stage_us) {
+  struct proxy_slow_conn *entry = &(stats->slow[stats->slow_head % PROXY_SLOW_RING]);
+
+  entry->time = time(NULL);
+  entry->addr = dst->sin_addr.s_addr;
+  entry->port = dst->sin_port;
+  entry->error = error;
+
+  for(int i=0; i<PROXY_STAGES; i++) {
+    entry->stage_us[i] = (stage_us[i] > UINT32_MAX)?UINT32_MAX:stage_us[i];
+  }
+
+  __atomic_store_n(&(stats->slow_head), stats->slow_head + 1, __ATOMIC_RELEASE);
+}
+
+
+static long parse_number(char const *what, char const *str) {
+  errno = 0;
+  char *endptr = NULL;
+  long n = strtol(str, &endptr, 10);
+  ERROR(errno || (endptr == str) || *endptr, "bad %s '%s'\n", what, str);
+  return n;
+}
+
+
+static void epoll_set(int poll_fd, int op, int fd, uint32_t events) {
+  struct epoll_event event = {
+    .events = events,
+    .data = {
+      .fd = fd
+    }
+  };
+
+  PERROR(==-1, epoll_ctl, poll_fd, op, fd, &event);
+}
+
+
+static void set_nonblocking(int fd) {
+  int flag = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+}
+
+
+static int raise_fd_limit() {
+  struct rlimit limit;
+  PERROR(==-1, getrlimit, RLIMIT_NOFILE, &limit);
+
+  if (limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    PERROR(==-1, getrlimit, RLIMIT_NOFILE, &limit);
+  }
+
+  return (limit.rlim_cur > INT_MAX)?INT_MAX:(int)limit.rlim_cur;
+}
+
+
+/* Upstream sockets fetched from socketd ahead of time. Once the pool
+   runs low, a batch request tops it up, and the answer is picked up
+   by the event loop when socketd_fd becomes readable. */
+struct socket_pool {
+  int socketd_fd;
+  char sock_type;
+  int fds[SOCKETD_MAX_FDS];
+  int count;
+  int requested;
+};
+
+
+static void pool_init(struct socket_pool *pool, int socketd_fd, char sock_type) {
+  pool->socketd_fd = socketd_fd;
+  pool->sock_type = sock_type;
+  pool->count = 0;
+  pool->requested = 0;
+}
+
+
+static void pool_request(struct socket_pool *pool) {
+  int want = opt_prefetch - pool->count - pool->requested;
+  if (want <= 0) {
+    return;
+  }
+
+  char request[2] = {pool->sock_type|SOCKETD_BATCH, want};
+  PERROR(!=2, send, pool->socketd_fd, request, sizeof(request), MSG_NOSIGNAL);
+  pool->requested += want;
+  STAT_ADD(socketd_requests, 1);
+}
+
+
+/* Takes in the answer to an earlier request, returns -1 if it has
+   not arrived yet and flags has MSG_DONTWAIT. */
+static int pool_receive(struct socket_pool *pool, int flags) {
+  if (!pool->requested) {
+    return -1;
+  }
+
+  int received = recv_fds(pool->socketd_fd, pool->fds+pool->count, SOCKETD_MAX_FDS-pool->count, flags);
+  if ((received == -1) && (errno == EAGAIN)) {
+    return -1;
+  }
+
+  ERROR(received == -1, "socketd: %s\n", strerror(errno));
+
+  pool->count += received;
+  pool->requested -= received;
+  STAT_ADD(socketd_sockets, received);
+  return received;
+}
+
+
+static int pool_take(struct socket_pool *pool) {
+  if (!opt_prefetch) {
+    PERROR(==-1, send, pool->socketd_fd, &(pool->sock_type), 1, MSG_NOSIGNAL);
+    STAT_ADD(socketd_requests, 1);
+    STAT_ADD(socketd_sockets, 1);
+    int fd = recv_fd(pool->socketd_fd);
+    ERROR(fd == -1, "socketd: %s\n", strerror(errno));
+    return fd;
+  }
+
+  if (!pool->count) {
+    pool_request(pool);
+    pool_receive(pool, 0);
+  }
+
+  int fd = pool->fds[--pool->count];
+
+  if (pool->count + pool->requested <= opt_prefetch / 2) {
+    pool_request(pool);
+  }
+
+  return fd;
+}
+
+
+#define MAX_EVENTS  64
+#define BUFFER_SIZE 4096
+#define SOCKMAP_ENTRIES  65536
+#define SOCKMAP_DRAIN_MS 5
+
+
+/* Either a memory buffer, or a pipe when splicing. In both cases
+   the bytes from start to end are waiting to be written. */
+struct buffer {
+  char *data;
+  int pipe_fds[2];
+  size_t size;
+  size_t start;
+  size_t end;
+};
+
+
+static int buffer_init_pipe(struct buffer *buf) {
+  if (pipe2(buf->pipe_fds, O_NONBLOCK|O_CLOEXEC) == -1) {
+    return -1;
+  }
+
+  int size = fcntl(buf->pipe_fds[1], F_SETPIPE_SZ, opt_pipe_size);
+  if (size == -1) {
+    size = fcntl(buf->pipe_fds[1], F_GETPIPE_SZ);
+  }
+
+  buf->size = size;
+  return 0;
+}
+
+
+static int buffer_init_memory(struct buffer *buf) {
+  buf->pipe_fds[0] = -1;
+  buf->pipe_fds[1] = -1;
+  buf->size = BUFFER_SIZE;
+  buf->data = malloc(BUFFER_SIZE);
+  return buf->data?0:-1;
+}
+
+
+static int buffer_init(struct buffer *buf) {
+  if (opt_splice && (buffer_init_pipe(buf) == 0)) {
+    return 0;
+  }
+
+  return buffer_init_memory(buf);
+}
+
+
+static void buffer_free(struct buffer *buf) {
+  if (buf->pipe_fds[0] != -1) {
+    close(buf->pipe_fds[0]);
+    close(buf->pipe_fds[1]);
+  }
+
+  free(buf->data);
+}
+
+
+static ssize_t buffer_read(int fd, struct buffer *buf) {
+  if (buf->data) {
+    return recv(fd, buf->data+buf->end, buf->size-buf->end, 0);
+  }
+
+  ssize_t received = splice(fd, NULL, buf->pipe_fds[1], NULL, buf->size-buf->end, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+  /* fall back to the memory buffer if the kernel cannot splice this socket */
+  if ((received == -1) && ((errno == EINVAL) || (errno == ENOSYS)) && (buf->start == buf->end)) {
+    buffer_free(buf);
+    if (buffer_init_memory(buf) == -1) {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    return buffer_read(fd, buf);
+  }
+
+  return received;
+}
+
+
+static ssize_t buffer_write(int fd, struct buffer *buf) {
+  if (buf->data) {
+    return send(fd, buf->data+buf->start, buf->end-buf->start, MSG_NOSIGNAL);
+  }
+
+  return splice(buf->pipe_fds[0], NULL, fd, NULL, buf->end-buf->start, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+}
+
+
+enum tcp_state {
+  TCP_CONNECTING,
+  TCP_RELAYING,
+  TCP_OFFLOADED, /* relayed by the sockmap */
+};
+
+
+struct tcp_conn {
+  enum tcp_state state;
+  struct sockaddr_in dst;
+
+  int in_fd;  /* accepted from the redirected client */
+  int out_fd; /* connected to the original destination */
+  int in_eof;
+  int out_eof;
+
+  struct buffer to_in;  /* read from out_fd, write to in_fd */
+  struct buffer to_out; /* read from in_fd, write to out_fd */
+
+  int closing;
+  int inflight; /* io_uring operations not completed yet */
+  struct tcp_conn *next;
+
+  /* connections still connecting, oldest first */
+  long long deadline;
+  struct tcp_conn *connect_prev;
+  struct tcp_conn *connect_next;
+
+  /* when each setup step finished, in microseconds, until the first
+     byte from upstream completes the setup */
+  long long woken_at;
+  long long accepted_at;
+  long long socket_at;
+  long long connected_at;
+  int setup_done;
+
+  /* once offloaded, for each direction, client to upstream first: the
+     kernel count of bytes received minus bytes sent at that point, the
+     bytes sent, and whether the end was passed on */
+  long long offload_lag[2];
+  long long offload_sent[2];
+  int offload_tried;
+  int shut[2];
+  int draining;
+  struct tcp_conn *drain_next;
+};
+
+
+/* Moves data from src_fd to dst_fd until one of them would block.
+   Returns the number of bytes written, or -1 if the connection is
+   broken. */
+static ssize_t pump(int src_fd, int *src_eof, int dst_fd, struct buffer *buf, uint64_t *bytes) {
+  ssize_t moved = 0;
+
+  for(;;) {
+    if (buf->start < buf->end) {
+      ssize_t sent = buffer_write(dst_fd, buf);
+
+      if (sent == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINPROGRESS))?moved:-1;
+      }
+
+      buf->start += sent;
+      moved += sent;
+      stat_add(bytes, sent);
+      if (buf->start < buf->end) {
+        continue;
+      }
+
+      buf->start = 0;
+      buf->end = 0;
+    }
+
+    if (*src_eof) {
+      return moved;
+    }
+
+    ssize_t received = buffer_read(src_fd, buf);
+
+    if (received == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return ((errno == EAGAIN) || (errno == EWOULDBLOCK))?moved:-1;
+    }
+
+    if (received == 0) {
+      *src_eof = 1;
+      shutdown(dst_fd, SHUT_WR);
+      return moved;
+    }
+
+    buf->end += received;
+  }
+}
+
+
+struct tcp_counts {
+  long long received;
+  long long unread;
+  long long sent;
+};
+
+
+/* What the kernel counted on fd: bytes that arrived, of which unread
+   are still queued, and bytes handed to it for sending. A SYN or a FIN
+   counts as one byte, so the counts only make sense compared with
+   earlier ones. */
+static int tcp_counts(int fd, struct tcp_counts *counts) {
+  struct tcp_info info;
+  socklen_t optlen = sizeof(info);
+  int unread, unsent;
+
+  if ((getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &optlen) == -1) ||
+      (ioctl(fd, SIOCINQ, &unread) == -1) ||
+      (ioctl(fd, SIOCOUTQ, &unsent) == -1)) {
+    return -1;
+  }
+
+  counts->received = info.tcpi_bytes_received;
+  counts->unread = unread;
+  counts->sent = info.tcpi_bytes_acked + unsent;
+  return 0;
+}
+
+
+/* Connects with TCP Fast Open, sending what the client has already
+   written along with the SYN. Without a cookie for dst, the kernel
+   sends a plain SYN and takes nothing, so the bytes stay in buf until
+   the handshake completes. TCP_FASTOPEN_CONNECT is not used, as it
+   holds back the SYN until the first write, which never comes when
+   the server is the one to speak first. */
+static int connect_fastopen(int in_fd, int out_fd, struct sockaddr_in *dst, struct buffer *buf) {
+  ssize_t received = recv(in_fd, buf->data, buf->size, MSG_DONTWAIT);
+
+  if (received <= 0) {
+    return connect(out_fd, dst, sizeof(*dst));
+  }
+
+  buf->end = received;
+
+  ssize_t sent = sendto(out_fd, buf->data, received, MSG_FASTOPEN|MSG_NOSIGNAL, dst, sizeof(*dst));
+
+  if (sent == -1) {
+    /* client side fast open is turned off in net.ipv4.tcp_fastopen */
+    return (errno == EOPNOTSUPP)?connect(out_fd, dst, sizeof(*dst)):-1;
+  }
+
+  buf->start = sent;
+  STAT_ADD(bytes_out, sent);
+  if (buf->start == buf->end) {
+    buf->start = 0;
+    buf->end = 0;
+  }
+
+  errno = EINPROGRESS;
+  return -1;
+}
+
+
+/* Records how long each setup step took, from the wakeup that saw
+   the client until the first byte from upstream, or the error. */
+static void finish_setup(struct tcp_conn *conn, int error) {
+  long long now = now_us();
+  long long stage_us[PROXY_STAGES] = {
+    [STAGE_ACCEPT] = conn->accepted_at - conn->woken_at,
+    [STAGE_SOCKET] = conn->socket_at - conn->accepted_at,
+    [STAGE_CONNECT] = (conn->connected_at?conn->connected_at:now) - conn->socket_at,
+    [STAGE_FIRST_BYTE] = conn->connected_at?(now - conn->connected_at):0,
+    [STAGE_SETUP] = now - conn->woken_at,
+  };
+
+  conn->setup_done = 1;
+
+  if (!error) {
+    for(int i=0; i<PROXY_STAGES; i++) {
+      hist_add(i, stage_us[i]);
+    }
+  }
+
+  if (error || (stage_us[STAGE_SETUP] >= opt_slow_ms * 1000LL)) {
+    slow_record(&(conn->dst), error, stage_us);
+  }
+}
+
+
+static int tcp_listen(int port, int flags) {
+  int listen_fd = -1;
+  PERROR(==-1, listen_fd = socket, AF_INET, SOCK_STREAM|flags, 0);
+  int opt = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (opt_workers > 1) {
+    PERROR(==-1, setsockopt, listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+  }
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr = {
+      .s_addr = htonl(INADDR_LOOPBACK)
+    }};
+
+  PERROR(==-1, bind, listen_fd, &addr, sizeof(addr));
+  PERROR(==-1, listen, listen_fd, SOMAXCONN);
+  return listen_fd;
+}
+
+
+static int tcp_proxy(int port, int socketd_fd) {
+  struct socket_pool pool;
+  pool_init(&pool, socketd_fd, SOCK_STREAM);
+  pool_request(&pool);
+
+  int max_fds = raise_fd_limit();
+  struct tcp_conn **conns = calloc(max_fds, sizeof(struct tcp_conn *));
+  ERROR(!conns, "cannot allocate connection table\n");
+
+  int listen_fd = tcp_listen(port, SOCK_NONBLOCK);
+
+  struct sockmap sockmap;
+  int offload = 0;
+  if (opt_sockmap) {
+    offload = (sockmap_init(&sockmap, SOCKMAP_ENTRIES) == 0);
+    if (!offload) {
+      LOG("sockmap: %s, relaying in userspace\n", strerror(errno));
+    }
+  }
+
+  int poll_fd;
+  PERROR(==-1, poll_fd = epoll_create, 1);
+
+  /* level triggered, so that a failed accept is retried on the next wakeup */
+  epoll_set(poll_fd, EPOLL_CTL_ADD, listen_fd, EPOLLIN);
+  epoll_set(poll_fd, EPOLL_CTL_ADD, socketd_fd, EPOLLIN);
+
+  /* fds are closed only after the whole batch of events is handled,
+     so a stale event never refers to a reused fd */
+  struct tcp_conn *closed = NULL;
+
+  struct tcp_conn *connecting = NULL;
+  struct tcp_conn *connecting_tail = NULL;
+
+  /* offloaded connections with an end not passed on yet */
+  struct tcp_conn *draining = NULL;
+
+  void connecting_add(struct tcp_conn *conn) {
+    conn->state = TCP_CONNECTING;
+    conn->deadline = now_ms() + opt_connect_timeout;
+    conn->connect_prev = connecting_tail;
+    conn->connect_next = NULL;
+
+    if (connecting_tail) {
+      connecting_tail->connect_next = conn;
+    } else {
+      connecting = conn;
+    }
+
+    connecting_tail = conn;
+  }
+
+  void connecting_remove(struct tcp_conn *conn) {
+    if (conn->connect_prev) {
+      conn->connect_prev->connect_next = conn->connect_next;
+    } else {
+      connecting = conn->connect_next;
+    }
+
+    if (conn->connect_next) {
+      conn->connect_next->connect_prev = conn->connect_prev;
+    } else {
+      connecting_tail = conn->connect_prev;
+    }
+  }
+
+  void close_conn(struct tcp_conn *conn) {
+    if (conn->state == TCP_CONNECTING) {
+      connecting_remove(conn);
+    }
+
+    struct tcp_counts in, out;
+    if ((conn->state == TCP_OFFLOADED) &&
+        (tcp_counts(conn->in_fd, &in) == 0) && (tcp_counts(conn->out_fd, &out) == 0)) {
+      /* less the FIN, when there was one */
+      STAT_ADD(bytes_out, out.sent - conn->offload_sent[0] - conn->shut[0]);
+      STAT_ADD(bytes_in, in.sent - conn->offload_sent[1] - conn->shut[1]);
+    }
+
+    STAT_ADD(conns_closed, 1);
+    conn->closing = 1;
+    conns[conn->in_fd] = NULL;
+    conns[conn->out_fd] = NULL;
+    conn->next = closed;
+    closed = conn;
+  }
+
+  /* Hands the pair to the sockmap, once everything read so far has
+     been written. The counts are taken twice, in case data arrived
+     in between. The first byte from upstream is not seen here after
+     that, so the setup ends with the handover. */
+  void offload_conn(struct tcp_conn *conn) {
+    if (conn->in_eof || conn->out_eof ||
+        (conn->to_in.start < conn->to_in.end) || (conn->to_out.start < conn->to_out.end)) {
+      return;
+    }
+
+    conn->offload_tried = 1;
+
+    struct tcp_counts in[2], out[2];
+    int stable = 0;
+
+    for(int i=0; (i<4) && !stable; i++) {
+      if ((tcp_counts(conn->in_fd, &(in[0])) == -1) || (tcp_counts(conn->out_fd, &(out[0])) == -1) ||
+          (tcp_counts(conn->in_fd, &(in[1])) == -1) || (tcp_counts(conn->out_fd, &(out[1])) == -1)) {
+        return;
+      }
+
+      stable = !memcmp(&(in[0]), &(in[1]), sizeof(in[0])) && !memcmp(&(out[0]), &(out[1]), sizeof(out[0]));
+    }
+
+    if (!stable) {
+      return;
+    }
+
+    if (sockmap_pair(&sockmap, conn->in_fd, conn->out_fd) == -1) {
+      VERBOSE("sockmap: %s\n", strerror(errno));
+      return;
+    }
+
+    if (!conn->setup_done) {
+      finish_setup(conn, 0);
+    }
+
+    conn->state = TCP_OFFLOADED;
+    conn->offload_lag[0] = in[0].received - in[0].unread - out[0].sent;
+    conn->offload_lag[1] = out[0].received - out[0].unread - in[0].sent;
+    conn->offload_sent[0] = out[0].sent;
+    conn->offload_sent[1] = in[0].sent;
+
+    /* only the ends are left to handle here */
+    epoll_set(poll_fd, EPOLL_CTL_MOD, conn->in_fd, EPOLLRDHUP|EPOLLET);
+    epoll_set(poll_fd, EPOLL_CTL_MOD, conn->out_fd, EPOLLRDHUP|EPOLLET);
+  }
+
+  void relay(struct tcp_conn *conn) {
+    ssize_t replied;
+
+    if ((pump(conn->in_fd, &(conn->in_eof), conn->out_fd, &(conn->to_out), &(stats->bytes_out)) == -1) ||
+        ((replied = pump(conn->out_fd, &(conn->out_eof), conn->in_fd, &(conn->to_in), &(stats->bytes_in))) == -1) ||
+        (conn->in_eof && conn->out_eof)) {
+      close_conn(conn);
+      return;
+    }
+
+    if (replied && !conn->setup_done) {
+      finish_setup(conn, 0);
+    }
+
+    if (offload && !conn->offload_tried) {
+      offload_conn(conn);
+    }
+  }
+
+  /* The kernel sends what it relays from a work queue, so the end of
+     a direction is passed on only once the destination has been
+     handed everything the source received, less its FIN. Returns
+     whether a direction is still waiting for that. */
+  int drain_conn(struct tcp_conn *conn) {
+    int src_fds[2] = {conn->in_fd, conn->out_fd};
+    int eofs[2] = {conn->in_eof, conn->out_eof};
+
+    for(int dir=0; dir<2; dir++) {
+      struct tcp_counts src, dst;
+
+      if (!eofs[dir] || conn->shut[dir] ||
+          ((tcp_counts(src_fds[dir], &src) == 0) && (tcp_counts(src_fds[1-dir], &dst) == 0) &&
+           (src.received - 1 - dst.sent > conn->offload_lag[dir]))) {
+        continue;
+      }
+
+      shutdown(src_fds[1-dir], SHUT_WR);
+      conn->shut[dir] = 1;
+    }
+
+    if (conn->shut[0] && conn->shut[1]) {
+      close_conn(conn);
+      return 0;
+    }
+
+    return (eofs[0] && !conn->shut[0]) || (eofs[1] && !conn->shut[1]);
+  }
+
+  void handle_offloaded(struct tcp_conn *conn, int fd, uint32_t events) {
+    if (events & EPOLLERR) {
+      close_conn(conn);
+      return;
+    }
+
+    if (fd == conn->in_fd) {
+      conn->in_eof = 1;
+    } else {
+      conn->out_eof = 1;
+    }
+
+    if (drain_conn(conn) && !conn->draining) {
+      conn->draining = 1;
+      conn->drain_next = draining;
+      draining = conn;
+    }
+  }
+
+  void drain_offloaded() {
+    struct tcp_conn **link = &draining;
+
+    while (*link) {
+      struct tcp_conn *conn = *link;
+
+      if (!conn->closing && drain_conn(conn)) {
+        link = &(conn->drain_next);
+        continue;
+      }
+
+      conn->draining = 0;
+      *link = conn->drain_next;
+    }
+  }
+
+  long long woken_at = 0;
+
+  void open_conn(int in_fd) {
+    long long accepted_at = now_us();
+    struct sockaddr_in dst;
+    socklen_t optlen = sizeof(dst);
+
+    if (getsockopt(in_fd, SOL_IP, SO_ORIGINAL_DST, &dst, &optlen) == -1) {
+      VERBOSE("getsockopt(SO_ORIGINAL_DST): %s\n", strerror(errno));
+      STAT_ADD(errors, 1);
+      close(in_fd);
+      return;
+    }
+
+    int out_fd = pool_take(&pool);
+    struct tcp_conn *conn = NULL;
+
+    if ((out_fd >= max_fds) || !(conn = calloc(1, sizeof(struct tcp_conn)))) {
+      LOG("too many connections\n");
+      STAT_ADD(errors, 1);
+      close(in_fd);
+      close(out_fd);
+      return;
+    }
+
+    if ((buffer_init(&(conn->to_in)) == -1) || (buffer_init(&(conn->to_out)) == -1)) {
+      LOG("cannot allocate buffers\n");
+      STAT_ADD(errors, 1);
+      buffer_free(&(conn->to_in));
+      close(in_fd);
+      close(out_fd);
+      free(conn);
+      return;
+    }
+
+    set_nonblocking(out_fd);
+    conn->in_fd = in_fd;
+    conn->out_fd = out_fd;
+    conn->state = TCP_RELAYING;
+    conn->dst = dst;
+    conn->woken_at = woken_at;
+    conn->accepted_at = accepted_at;
+    conn->socket_at = now_us();
+
+    int connected = (opt_fastopen && conn->to_out.data)?
+      connect_fastopen(in_fd, out_fd, &dst, &(conn->to_out)):
+      connect(out_fd, &dst, sizeof(dst));
+
+    if (connected == -1) {
+      if (errno != EINPROGRESS) {
+        VERBOSE("connect: %s\n", strerror(errno));
+        STAT_ADD(connect_errors, 1);
+        finish_setup(conn, errno);
+        close(in_fd);
+        close(out_fd);
+        buffer_free(&(conn->to_in));
+        buffer_free(&(conn->to_out));
+        free(conn);
+        return;
+      }
+
+      connecting_add(conn);
+    } else {
+      conn->connected_at = conn->socket_at;
+    }
+
+    STAT_ADD(conns_total, 1);
+    conns[in_fd] = conn;
+    conns[out_fd] = conn;
+    epoll_set(poll_fd, EPOLL_CTL_ADD, in_fd, EPOLLIN|EPOLLOUT|EPOLLET);
+    epoll_set(poll_fd, EPOLL_CTL_ADD, out_fd, EPOLLIN|EPOLLOUT|EPOLLET);
+
+    if (conn->state == TCP_RELAYING) {
+      relay(conn);
+    }
+  }
+
+  void accept_conns() {
+    for(;;) {
+      int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+      if (fd == -1) {
+        if ((errno == EINTR) || (errno == ECONNABORTED)) {
+          continue;
+        }
+
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+          LOG("accept: %s\n", strerror(errno));
+          STAT_ADD(errors, 1);
+        }
+
+        return;
+      }
+
+      if (fd >= max_fds) {
+        close(fd);
+        continue;
+      }
+
+      open_conn(fd);
+    }
+  }
+
+  void handle_event(struct tcp_conn *conn, int fd, uint32_t events) {
+    if (conn->state == TCP_OFFLOADED) {
+      handle_offloaded(conn, fd, events);
+      return;
+    }
+
+    if (conn->state == TCP_CONNECTING) {
+      if ((fd != conn->out_fd) || !(events & (EPOLLOUT|EPOLLERR|EPOLLHUP))) {
+        return;
+      }
+
+      int error = 0;
+      socklen_t optlen = sizeof(error);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &optlen);
+
+      if (error) {
+        VERBOSE("connect: %s\n", strerror(error));
+        STAT_ADD(connect_errors, 1);
+        finish_setup(conn, error);
+        close_conn(conn);
+        return;
+      }
+
+      connecting_remove(conn);
+      conn->state = TCP_RELAYING;
+      conn->connected_at = now_us();
+    }
+
+    relay(conn);
+  }
+
+  void expire_connecting() {
+    long long now = now_ms();
+
+    while (connecting && (connecting->deadline <= now)) {
+      VERBOSE("connect: %s\n", strerror(ETIMEDOUT));
+      STAT_ADD(connect_errors, 1);
+      finish_setup(connecting, ETIMEDOUT);
+      close_conn(connecting);
+    }
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+
+  for(;;) {
+    int timeout = -1;
+    if (connecting && opt_connect_timeout) {
+      long long left = connecting->deadline - now_ms();
+      timeout = (left > 0)?left:0;
+    }
+
+    if (draining && ((timeout == -1) || (timeout > SOCKMAP_DRAIN_MS))) {
+      timeout = SOCKMAP_DRAIN_MS;
+    }
+
+    int nfds;
+    PERROR(==-1, nfds = epoll_wait, poll_fd, events, MAX_EVENTS, timeout);
+
+    for(int i=0; i<nfds; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == listen_fd) {
+        woken_at = now_us();
+        accept_conns();
+      } else if (fd == socketd_fd) {
+        ERROR(events[i].events & (EPOLLHUP|EPOLLERR), "socketd went away\n");
+        pool_receive(&pool, MSG_DONTWAIT);
+      } else if (conns[fd]) {
+        handle_event(conns[fd], fd, events[i].events);
+      }
+    }
+
+    if (opt_connect_timeout) {
+      expire_connecting();
+    }
+
+    if (draining) {
+      drain_offloaded();
+    }
+
+    while (closed) {
+      struct tcp_conn *conn = closed;
+      closed = conn->next;
+      close(conn->in_fd);
+      close(conn->out_fd);
+      buffer_free(&(conn->to_in));
+      buffer_free(&(conn->to_out));
+      free(conn);
+    }
+  }
+
+  return 0;
+}
+
+#define URING_ENTRIES     1024
+#define URING_ARENA_SLOTS 2048
+#define URING_PAUSE_MS    100
+
+
+enum uring_op {
+  URING_ACCEPT,
+  URING_SOCKETD_SEND,
+  URING_SOCKETD_RECV,
+  URING_CONNECT,
+  URING_POLL,
+  URING_TO_OUT,
+  URING_TO_IN,
+  URING_TIMEOUT,
+  URING_ACCEPT_PAUSE,
+};
+
+
+/* the operation is kept in the low bits of the connection pointer,
+   calloc() aligns it to 16 bytes */
+#define URING_DATA(conn, op) (((uint64_t)(uintptr_t)(conn)) | (op))
+#define URING_CONN(data)     ((struct tcp_conn *)(uintptr_t)((data) & ~(uint64_t)15))
+#define URING_OP(data)       ((int)((data) & 15))
+
+
+/* Same relay as tcp_proxy, but every accept, socketd request, connect
+   and transfer is an io_uring operation, submitted in batches. The
+   listening socket and socketd are registered files, and memory
+   buffers come from a registered arena while it lasts. */
+static int tcp_uring_proxy(int port, int socketd_fd) {
+  struct uring ring;
+
+  if (uring_init(&ring, URING_ENTRIES) == -1) {
+    LOG("io_uring: %s, falling back to epoll\n", strerror(errno));
+    return tcp_proxy(port, socketd_fd);
+  }
+
+  unsigned char opcodes[] = {
+    IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_TIMEOUT, IORING_OP_LINK_TIMEOUT,
+    IORING_OP_SEND, IORING_OP_RECV, IORING_OP_RECVMSG,
+    IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_POLL_ADD, IORING_OP_SPLICE,
+  };
+
+  /* splice is the last, and only needed with --splice */
+  int needed = sizeof(opcodes) - (opt_splice?0:1);
+
+  if (uring_probe(&ring, opcodes, needed) == -1) {
+    LOG("io_uring: %s, falling back to epoll\n", strerror(errno));
+    close(ring.fd);
+    return tcp_proxy(port, socketd_fd);
+  }
+
+  raise_fd_limit();
+
+  /* splice is always punted to a kernel worker, so the sockets are
+     non-blocking there and readiness is polled first */
+  int sock_flags = opt_splice?SOCK_NONBLOCK:0;
+  int listen_fd = tcp_listen(port, 0);
+
+  int files[2] = {listen_fd, socketd_fd};
+  int fixed_files = (uring_register(&ring, IORING_REGISTER_FILES, files, 2) == 0);
+  int listen_file = fixed_files?0:listen_fd;
+  int socketd_file = fixed_files?1:socketd_fd;
+  int file_flags = fixed_files?IOSQE_FIXED_FILE:0;
+
+  size_t arena_size = (size_t)URING_ARENA_SLOTS * BUFFER_SIZE;
+  char *arena = mmap(NULL, arena_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  ERROR(arena == MAP_FAILED, "cannot allocate buffer arena\n");
+
+  struct iovec arena_iov = {.iov_base = arena, .iov_len = arena_size};
+  int fixed_buffers = (uring_register(&ring, IORING_REGISTER_BUFFERS, &arena_iov, 1) == 0);
+  VERBOSE("io_uring: registered files %s, registered buffers %s\n",
+          fixed_files?"on":"off", fixed_buffers?"on":"off");
+
+  int free_slots[URING_ARENA_SLOTS];
+  int free_slot_count = URING_ARENA_SLOTS;
+  for(int i=0; i<URING_ARENA_SLOTS; i++) {
+    free_slots[i] = URING_ARENA_SLOTS-1-i;
+  }
+
+  int in_arena(struct buffer *buf) {
+    return (buf->data >= arena) && (buf->data < arena+arena_size);
+  }
+
+  int arena_buffer_init(struct buffer *buf) {
+    if (opt_splice || !free_slot_count) {
+      return buffer_init(buf);
+    }
+
+    free_slot_count -= 1;
+    buf->data = arena + (size_t)free_slots[free_slot_count] * BUFFER_SIZE;
+    buf->pipe_fds[0] = -1;
+    buf->pipe_fds[1] = -1;
+    buf->size = BUFFER_SIZE;
+    return 0;
+  }
+
+  void arena_buffer_free(struct buffer *buf) {
+    if (in_arena(buf)) {
+      free_slots[free_slot_count] = (buf->data - arena) / BUFFER_SIZE;
+      free_slot_count += 1;
+      buf->data = NULL;
+    }
+
+    buffer_free(buf);
+  }
+
+  long long woken_at = 0;
+
+  /* connections waiting for an upstream socket, in request order */
+  struct tcp_conn *waiting = NULL;
+  struct tcp_conn **waiting_tail = &waiting;
+
+  /* sockets are asked for in batches, each answered in one message */
+  char requests[URING_ENTRIES];
+  int socketd_queued = 0;
+  int socketd_sending = 0;
+  int socketd_sending_size = 0;
+  int socketd_pending = 0;
+  int socketd_receiving = 0;
+
+  char socketd_byte = 0;
+  char socketd_control[CMSG_SPACE(sizeof(int) * SOCKETD_MAX_FDS)];
+  struct iovec socketd_iov;
+  struct msghdr socketd_msg;
+
+  void submit_accept() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_file;
+    sqe->flags = file_flags;
+    sqe->accept_flags = SOCK_CLOEXEC|sock_flags;
+    sqe->user_data = URING_DATA(NULL, URING_ACCEPT);
+  }
+
+  struct __kernel_timespec accept_pause = {
+    .tv_sec = URING_PAUSE_MS / 1000,
+    .tv_nsec = (URING_PAUSE_MS % 1000) * 1000000,
+  };
+
+  /* after errors such as EMFILE, accepting again at once would only
+     fail again */
+  void submit_accept_pause() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&accept_pause;
+    sqe->len = 1;
+    sqe->user_data = URING_DATA(NULL, URING_ACCEPT_PAUSE);
+  }
+
+  void submit_socketd_send() {
+    if (socketd_sending || !socketd_queued) {
+      return;
+    }
+
+    socketd_sending_size = 0;
+
+    while ((socketd_sending < socketd_queued) && (socketd_sending_size < URING_ENTRIES)) {
+      int count = socketd_queued - socketd_sending;
+      count = (count < SOCKETD_MAX_FDS)?count:SOCKETD_MAX_FDS;
+      requests[socketd_sending_size++] = SOCK_STREAM|SOCKETD_BATCH;
+      requests[socketd_sending_size++] = count;
+      socketd_sending += count;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = socketd_file;
+    sqe->flags = file_flags;
+    sqe->addr = (uint64_t)(uintptr_t)requests;
+    sqe->len = socketd_sending_size;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_DATA(NULL, URING_SOCKETD_SEND);
+  }
+
+  void submit_socketd_recv() {
+    if (socketd_receiving || !socketd_pending) {
+      return;
+    }
+
+    socketd_receiving = 1;
+    socketd_iov.iov_base = &socketd_byte;
+    socketd_iov.iov_len = 1;
+    memset(&socketd_msg, 0, sizeof(socketd_msg));
+    socketd_msg.msg_iov = &socketd_iov;
+    socketd_msg.msg_iovlen = 1;
+    socketd_msg.msg_control = socketd_control;
+    socketd_msg.msg_controllen = sizeof(socketd_control);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socketd_file;
+    sqe->flags = file_flags;
+    sqe->addr = (uint64_t)(uintptr_t)&socketd_msg;
+    sqe->len = 1;
+    sqe->user_data = URING_DATA(NULL, URING_SOCKETD_RECV);
+  }
+
+  struct __kernel_timespec connect_timeout = {
+    .tv_sec = opt_connect_timeout / 1000,
+    .tv_nsec = (opt_connect_timeout % 1000) * 1000000,
+  };
+
+  /* a linked timeout cancels the connect, which then fails with
+     -ECANCELED */
+  void submit_connect(struct tcp_conn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = conn->out_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&(conn->dst);
+    sqe->off = sizeof(conn->dst);
+    sqe->user_data = URING_DATA(conn, URING_CONNECT);
+    conn->inflight += 1;
+
+    if (opt_connect_timeout) {
+      sqe->flags = IOSQE_IO_LINK;
+      sqe = uring_get_sqe(&ring);
+      sqe->opcode = IORING_OP_LINK_TIMEOUT;
+      sqe->addr = (uint64_t)(uintptr_t)&connect_timeout;
+      sqe->len = 1;
+      sqe->user_data = URING_DATA(NULL, URING_TIMEOUT);
+    }
+  }
+
+  void submit_transfer(struct tcp_conn *conn, int op) {
+    struct buffer *buf = (op == URING_TO_OUT)?&(conn->to_out):&(conn->to_in);
+    int src_fd = (op == URING_TO_OUT)?conn->in_fd:conn->out_fd;
+    int dst_fd = (op == URING_TO_OUT)?conn->out_fd:conn->in_fd;
+    int writing = (buf->start < buf->end);
+    struct io_uring_sqe *sqe;
+
+    if (!buf->data) {
+      sqe = uring_get_sqe(&ring);
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = writing?dst_fd:src_fd;
+      sqe->poll32_events = writing?POLLOUT:POLLIN;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = URING_DATA(conn, URING_POLL);
+      conn->inflight += 1;
+
+      sqe = uring_get_sqe(&ring);
+      sqe->opcode = IORING_OP_SPLICE;
+      sqe->splice_fd_in = writing?buf->pipe_fds[0]:src_fd;
+      sqe->splice_off_in = (uint64_t)-1;
+      sqe->fd = writing?dst_fd:buf->pipe_fds[1];
+      sqe->off = (uint64_t)-1;
+      sqe->len = writing?(buf->end-buf->start):(buf->size-buf->end);
+      sqe->splice_flags = SPLICE_F_MOVE|SPLICE_F_NONBLOCK;
+    } else if (fixed_buffers && in_arena(buf)) {
+      sqe = uring_get_sqe(&ring);
+      sqe->opcode = writing?IORING_OP_WRITE_FIXED:IORING_OP_READ_FIXED;
+      sqe->fd = writing?dst_fd:src_fd;
+      sqe->addr = (uint64_t)(uintptr_t)(writing?(buf->data+buf->start):(buf->data+buf->end));
+      sqe->len = writing?(buf->end-buf->start):(buf->size-buf->end);
+      sqe->off = (uint64_t)-1;
+      sqe->buf_index = 0;
+    } else {
+      sqe = uring_get_sqe(&ring);
+      sqe->opcode = writing?IORING_OP_SEND:IORING_OP_RECV;
+      sqe->fd = writing?dst_fd:src_fd;
+      sqe->addr = (uint64_t)(uintptr_t)(writing?(buf->data+buf->start):(buf->data+buf->end));
+      sqe->len = writing?(buf->end-buf->start):(buf->size-buf->end);
+      sqe->msg_flags = writing?MSG_NOSIGNAL:0;
+    }
+
+    sqe->user_data = URING_DATA(conn, op);
+    conn->inflight += 1;
+  }
+
+  void free_conn(struct tcp_conn *conn) {
+    close(conn->in_fd);
+    if (conn->out_fd != -1) {
+      close(conn->out_fd);
+    }
+    arena_buffer_free(&(conn->to_in));
+    arena_buffer_free(&(conn->to_out));
+    free(conn);
+  }
+
+  /* pending operations are woken up by the shutdown, the connection
+     is freed when the last of them completes */
+  void close_conn(struct tcp_conn *conn) {
+    STAT_ADD(conns_closed, 1);
+    conn->closing = 1;
+    shutdown(conn->in_fd, SHUT_RDWR);
+    shutdown(conn->out_fd, SHUT_RDWR);
+
+    if (!conn->inflight) {
+      free_conn(conn);
+    }
+  }
+
+  void open_conn(int in_fd) {
+    struct tcp_conn *conn = calloc(1, sizeof(struct tcp_conn));
+    ERROR(!conn, "cannot allocate connection\n");
+
+    conn->in_fd = in_fd;
+    conn->out_fd = -1;
+    conn->state = TCP_CONNECTING;
+
+    socklen_t optlen = sizeof(conn->dst);
+    if (getsockopt(in_fd, SOL_IP, SO_ORIGINAL_DST, &(conn->dst), &optlen) == -1) {
+      VERBOSE("getsockopt(SO_ORIGINAL_DST): %s\n", strerror(errno));
+      close(in_fd);
+      free(conn);
+      return;
+    }
+
+    if ((arena_buffer_init(&(conn->to_in)) == -1) || (arena_buffer_init(&(conn->to_out)) == -1)) {
+      LOG("cannot allocate buffers\n");
+      arena_buffer_free(&(conn->to_in));
+      close(in_fd);
+      free(conn);
+      return;
+    }
+
+    conn->woken_at = woken_at;
+    conn->accepted_at = now_us();
+    STAT_ADD(conns_total, 1);
+    *waiting_tail = conn;
+    waiting_tail = &(conn->next);
+    socketd_queued += 1;
+  }
+
+  void complete_socketd_recv(int res) {
+    socketd_receiving = 0;
+    ERROR(res <= 0, "socketd: %s\n", res?strerror(-res):"connection closed");
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&socketd_msg);
+    ERROR((cmsg==NULL) ||
+          (cmsg->cmsg_level != SOL_SOCKET) ||
+          (cmsg->cmsg_type != SCM_RIGHTS) ||
+          (socketd_msg.msg_flags & MSG_CTRUNC),
+          "cmsg: bad message!\n");
+
+    int fds[SOCKETD_MAX_FDS];
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+    ERROR(count > socketd_pending, "socketd: more sockets than asked for\n");
+
+    socketd_pending -= count;
+    STAT_ADD(socketd_requests, 1);
+    STAT_ADD(socketd_sockets, count);
+    long long socket_at = now_us();
+
+    for(int i=0; i<count; i++) {
+      struct tcp_conn *conn = waiting;
+      waiting = conn->next;
+      if (!waiting) {
+        waiting_tail = &waiting;
+      }
+
+      conn->out_fd = fds[i];
+      conn->socket_at = socket_at;
+
+      if (sock_flags) {
+        set_nonblocking(conn->out_fd);
+      }
+
+      submit_connect(conn);
+    }
+  }
+
+  void complete_transfer(struct tcp_conn *conn, int op, int res) {
+    struct buffer *buf = (op == URING_TO_OUT)?&(conn->to_out):&(conn->to_in);
+    int *src_eof = (op == URING_TO_OUT)?&(conn->in_eof):&(conn->out_eof);
+    int dst_fd = (op == URING_TO_OUT)?conn->out_fd:conn->in_fd;
+
+    if ((res == -EAGAIN) || (res == -EINTR)) {
+      submit_transfer(conn, op);
+      return;
+    }
+
+    if (res < 0) {
+      close_conn(conn);
+      return;
+    }
+
+    if (buf->start < buf->end) {
+      buf->start += res;
+      stat_add((op == URING_TO_OUT)?&(stats->bytes_out):&(stats->bytes_in), res);
+      if (buf->start == buf->end) {
+        buf->start = 0;
+        buf->end = 0;
+      }
+
+      submit_transfer(conn, op);
+      return;
+    }
+
+    if (res == 0) {
+      *src_eof = 1;
+      shutdown(dst_fd, SHUT_WR);
+
+      if (conn->in_eof && conn->out_eof) {
+        close_conn(conn);
+      }
+
+      return;
+    }
+
+    if ((op == URING_TO_IN) && !conn->setup_done) {
+      finish_setup(conn, 0);
+    }
+
+    buf->end += res;
+    submit_transfer(conn, op);
+  }
+
+  void complete(uint64_t data, int res) {
+    struct tcp_conn *conn = URING_CONN(data);
+    int op = URING_OP(data);
+
+    if (conn) {
+      conn->inflight -= 1;
+
+      if (conn->closing) {
+        if (!conn->inflight) {
+          free_conn(conn);
+        }
+        return;
+      }
+    }
+
+    switch(op) {
+    case URING_ACCEPT:
+      if (res >= 0) {
+        open_conn(res);
+      } else if ((res != -EAGAIN) && (res != -EINTR) && (res != -ECONNABORTED)) {
+        LOG("accept: %s\n", strerror(-res));
+        STAT_ADD(errors, 1);
+        submit_accept_pause();
+        break;
+      }
+
+      submit_accept();
+      break;
+
+    case URING_ACCEPT_PAUSE:
+      submit_accept();
+      break;
+
+    case URING_SOCKETD_SEND:
+      ERROR(res < 0, "socketd: %s\n", strerror(-res));
+      ERROR(res != socketd_sending_size, "socketd: short send\n");
+      socketd_queued -= socketd_sending;
+      socketd_pending += socketd_sending;
+      socketd_sending = 0;
+      break;
+
+    case URING_SOCKETD_RECV:
+      complete_socketd_recv(res);
+      break;
+
+    case URING_CONNECT:
+      if ((res < 0) && (res != -EISCONN)) {
+        /* the linked timeout cancelled it */
+        int error = (res == -ECANCELED)?ETIMEDOUT:-res;
+        VERBOSE("connect: %s\n", strerror(error));
+        STAT_ADD(connect_errors, 1);
+        finish_setup(conn, error);
+        close_conn(conn);
+        break;
+      }
+
+      conn->connected_at = now_us();
+      conn->state = TCP_RELAYING;
+      submit_transfer(conn, URING_TO_OUT);
+      submit_transfer(conn, URING_TO_IN);
+      break;
+
+    case URING_POLL:
+    case URING_TIMEOUT:
+      break;
+
+    default:
+      complete_transfer(conn, op, res);
+      break;
+    }
+  }
+
+  submit_accept();
+
+  for(;;) {
+    submit_socketd_send();
+    submit_socketd_recv();
+    PERROR(==-1, uring_submit, &ring, 1);
+
+    woken_at = now_us();
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&ring))) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      uring_cqe_seen(&ring);
+      complete(data, res);
+    }
+  }
+
+  return 0;
+}
+
+
+
+#define UDP_REPLY_SOCKETS 4
+
+
+/* A transparent socket bound to an original destination, for sending
+   replies from it back to the client. It is never connected: TPROXY
+   hands packets to a connected socket matching the 4-tuple, which
+   would steal the client's next datagrams from the listener. */
+struct udp_reply {
+  struct sockaddr_in src;
+  int fd;
+};
+
+
+/* A flow is one client address talking through one upstream socket.
+   Flows are found by client address through a hash table, and by
+   upstream fd through a table indexed by fd. The LRU list is kept
+   most recently used first, so the victim is always its tail. */
+struct udp_flow {
+  struct sockaddr_in addr;
+  int out_fd;
+
+  /* most recently used first */
+  struct udp_reply replies[UDP_REPLY_SOCKETS];
+  int reply_count;
+
+  struct udp_flow *hash_next;
+  struct udp_flow *lru_prev;
+  struct udp_flow *lru_next;
+};
+
+
+struct udp_table {
+  struct udp_flow **buckets;
+  uint32_t bucket_mask;
+  struct udp_flow **by_fd;
+  int max_fds;
+  struct udp_flow lru;
+  int count;
+  int capacity;
+};
+
+
+static int is_same_addr(struct sockaddr_in const *a, struct sockaddr_in const *b) {
+  return ((a->sin_family == b->sin_family) &&
+          (a->sin_port == b->sin_port) &&
+          (a->sin_addr.s_addr == b->sin_addr.s_addr));
+}
+
+
+static uint32_t hash_addr(struct sockaddr_in const *addr) {
+  uint32_t h = addr->sin_addr.s_addr ^ ((uint32_t)addr->sin_port << 16);
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h;
+}
+
+
+static void udp_table_init(struct udp_table *table, int capacity, int max_fds) {
+  uint32_t buckets = 1;
+  while (buckets < (uint32_t)capacity) {
+    buckets <<= 1;
+  }
 
+  table->buckets = calloc(buckets, sizeof(struct udp_flow *));
+  table->bucket_mask = buckets - 1;
+  table->by_fd = calloc(max_fds, sizeof(struct udp_flow *));
+  table->max_fds = max_fds;
+  table->lru.lru_prev = &(table->lru);
+  table->lru.lru_next = &(table->lru);
+  table->count = 0;
+  table->capacity = capacity;
+  ERROR(!table->buckets || !table->by_fd, "cannot allocate udp flow table\n");
+}
 
-static void show_usage() {
-  printf("Usage: %s %s [options] protocol port\n", executable, cmd_name);
-  printf("\n"
-	 "  -h, --help                 print help message and exit\n"
-	 );
-  exit(0);
+
+static void lru_unlink(struct udp_flow *flow) {
+  flow->lru_prev->lru_next = flow->lru_next;
+  flow->lru_next->lru_prev = flow->lru_prev;
 }
 
 
-static void epoll_set(int poll_fd, int op, int fd, uint32_t events) {
-  struct epoll_event event = {
-    .events = events,
-    .data = {
-      .fd = fd
+static void lru_push_front(struct udp_table *table, struct udp_flow *flow) {
+  flow->lru_prev = &(table->lru);
+  flow->lru_next = table->lru.lru_next;
+  table->lru.lru_next->lru_prev = flow;
+  table->lru.lru_next = flow;
+}
+
+
+static void udp_table_touch(struct udp_table *table, struct udp_flow *flow) {
+  if (table->lru.lru_next != flow) {
+    lru_unlink(flow);
+    lru_push_front(table, flow);
+  }
+}
+
+
+static struct udp_flow *udp_table_find_by_addr(struct udp_table *table, struct sockaddr_in const *addr) {
+  struct udp_flow *flow = table->buckets[hash_addr(addr) & table->bucket_mask];
+
+  for(; flow; flow = flow->hash_next) {
+    if (is_same_addr(addr, &(flow->addr))) {
+      return flow;
     }
-  };
+  }
 
-  PERROR(==-1, epoll_ctl, poll_fd, op, fd, &event);
+  return NULL;
 }
 
 
-static void set_nonblocking(int fd) {
-  int flag = fcntl(fd, F_GETFL);
-  fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+static struct udp_flow *udp_table_find_by_out_fd(struct udp_table *table, int fd) {
+  return ((fd >= 0) && (fd < table->max_fds))?table->by_fd[fd]:NULL;
 }
 
 
-static int handle_connection(int in_fd, int out_fd) {
-  struct sockaddr_in dst;
-  socklen_t optlen = sizeof(dst);
-  PERROR(==-1, getsockopt, in_fd, SOL_IP, SO_ORIGINAL_DST, &dst, &optlen);
-  PERROR(==-1, connect, out_fd, &dst, sizeof(dst));
+/* Returns -1 if the fd does not fit in the table, the caller still owns it. */
+static int udp_table_insert(struct udp_table *table, struct udp_flow *flow) {
+  if ((flow->out_fd < 0) || (flow->out_fd >= table->max_fds)) {
+    return -1;
+  }
 
-  int poll_fd;
-  PERROR(==-1, poll_fd = epoll_create, 1);
+  struct udp_flow **bucket = &(table->buckets[hash_addr(&(flow->addr)) & table->bucket_mask]);
+  flow->hash_next = *bucket;
+  *bucket = flow;
+  table->by_fd[flow->out_fd] = flow;
+  lru_push_front(table, flow);
+  table->count += 1;
+  return 0;
+}
 
-  set_nonblocking(in_fd);
-  set_nonblocking(out_fd);
 
-  uint32_t in_fd_events = EPOLLIN;
-  uint32_t out_fd_events = EPOLLIN;
+static void udp_table_remove(struct udp_table *table, struct udp_flow *flow) {
+  struct udp_flow **link = &(table->buckets[hash_addr(&(flow->addr)) & table->bucket_mask]);
 
-  epoll_set(poll_fd, EPOLL_CTL_ADD, in_fd, in_fd_events);
-  epoll_set(poll_fd, EPOLL_CTL_ADD, out_fd, out_fd_events);
+  while (*link != flow) {
+    link = &((*link)->hash_next);
+  }
 
-  /* read from out_fd, write to in_fd */
-  char in_buffer[4096] = {0};
-  ssize_t in_start = 0;
-  ssize_t in_end = 0;
+  *link = flow->hash_next;
+  table->by_fd[flow->out_fd] = NULL;
+  lru_unlink(flow);
+  table->count -= 1;
+}
 
-  /* read from in_fd, write to out_fd */
-  char out_buffer[4096] = {0};
-  ssize_t out_start = 0;
-  ssize_t out_end = 0;
 
-  struct epoll_event event = {0};
+static struct udp_flow *udp_table_least_recent(struct udp_table *table) {
+  return (table->lru.lru_prev == &(table->lru))?NULL:table->lru.lru_prev;
+}
 
-  for(;;) {
-    int nfds;
-    PERROR(==-1, nfds = epoll_wait, poll_fd, &event, 1, -1);
-    if (!nfds) {
-      continue;
-    }
 
-    fprintf(stderr, "%d: %08x\n", event.data.fd, event.events);
+static int open_reply_socket(struct sockaddr_in const *src) {
+  int fd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
 
-    if (event.events & EPOLLIN) {
-      if (event.data.fd == in_fd) {
-        ssize_t received;
-        PERROR(==-1, received = recv, in_fd, out_buffer+out_end, sizeof(out_buffer)-out_end, 0);
-        out_end += received;
-        in_fd_events &= ~EPOLLIN;
-        if (received) {
-          out_fd_events |= EPOLLOUT;
-        }
-      } else if (event.data.fd == out_fd) {
-        ssize_t received;
-        PERROR(==-1, received = recv, out_fd, in_buffer+in_end, sizeof(in_buffer)-in_end, 0);
-        in_end += received;
-        out_fd_events &= ~EPOLLIN;
-        if (received) {
-          in_fd_events |= EPOLLOUT;
-        }
-      }
-    } else if (event.events & EPOLLOUT) {
-      if (event.data.fd == in_fd) {
-        ssize_t sent;
-        PERROR(==-1, sent = send, in_fd, in_buffer+in_start, in_end-in_start, 0);
-        in_start += sent;
-
-        if (in_start == in_end) {
-          in_start = 0;
-          in_end = 0;
-          in_fd_events &= ~EPOLLOUT;
-          out_fd_events |= EPOLLIN;
-        }
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  setsockopt(fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt));
+  int ttl = 255;
+  setsockopt(fd, SOL_IP, IP_TTL, &ttl, sizeof(ttl));
 
-      } else if (event.data.fd == out_fd) {
-        ssize_t sent;
-        PERROR(==-1, sent = send, out_fd, out_buffer+out_start, out_end-out_start, 0);
-        out_start += sent;
+  if (bind(fd, src, sizeof(struct sockaddr_in)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
 
-        if (out_start == out_end) {
-          out_start = 0;
-          out_end = 0;
-          out_fd_events &= ~EPOLLOUT;
-          in_fd_events |= EPOLLIN;
-        }
-      }
-    }
 
-    epoll_set(poll_fd, EPOLL_CTL_MOD, in_fd, in_fd_events);
-    epoll_set(poll_fd, EPOLL_CTL_MOD, out_fd, out_fd_events);
+static int udp_flow_reply_fd(struct udp_flow *flow, struct sockaddr_in const *src) {
+  struct udp_reply reply;
+  int i = 0;
 
-    if ((!in_fd_events) && (!out_fd_events)) {
+  for(; i<flow->reply_count; i++) {
+    if (is_same_addr(src, &(flow->replies[i].src))) {
       break;
     }
+  }
 
+  if (i == 0 && flow->reply_count) {
+    return flow->replies[0].fd;
   }
 
-  return 0;
+  if (i < flow->reply_count) {
+    reply = flow->replies[i];
+  } else {
+    reply.src = *src;
+    reply.fd = open_reply_socket(src);
+    if (reply.fd == -1) {
+      VERBOSE("cannot open reply socket for %s:%d: %s\n",
+              inet_ntoa(src->sin_addr), ntohs(src->sin_port), strerror(errno));
+      return -1;
+    }
+
+    if (flow->reply_count == UDP_REPLY_SOCKETS) {
+      close(flow->replies[UDP_REPLY_SOCKETS-1].fd);
+      i = UDP_REPLY_SOCKETS-1;
+    } else {
+      i = flow->reply_count;
+      flow->reply_count += 1;
+    }
+  }
+
+  memmove(flow->replies+1, flow->replies, i*sizeof(struct udp_reply));
+  flow->replies[0] = reply;
+  return reply.fd;
 }
 
 
-static int tcp_proxy(int port, int socketd_fd) {
-  int get_new_out_fd() {
-    char sock_type = SOCK_STREAM;
-    PERROR(==-1, send, socketd_fd, &sock_type, sizeof(sock_type), 0);
-    return recv_fd(socketd_fd);
+static void udp_flow_close(struct udp_flow *flow) {
+  close(flow->out_fd);
+
+  for(int i=0; i<flow->reply_count; i++) {
+    close(flow->replies[i].fd);
   }
 
-  int listen_fd = -1;
-  PERROR(==-1, listen_fd = socket, AF_INET, SOCK_STREAM, 0);
-  int opt = 1;
-  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  flow->reply_count = 0;
+}
 
-  struct sockaddr_in addr = {
-    .sin_family = AF_INET,
-    .sin_port = htons(port),
-    .sin_addr = {
-      .s_addr = htonl(INADDR_LOOPBACK)
-    }};
 
-  PERROR(==-1, bind, listen_fd, &addr, sizeof(addr));
-  PERROR(==-1, listen, listen_fd, SOMAXCONN);
+#define UDP_BATCH       32
+#define UDP_BUFFER_SIZE 65536
 
-  for(;;) {
-    int fd;
-    struct sockaddr_in peer;
-    socklen_t size = sizeof(struct sockaddr_in);
-    PERROR(==-1, fd = accept, listen_fd, &peer, &size);
-    int out_fd = get_new_out_fd();
 
-    pid_t pid;
-    PERROR(==-1, pid = fork);
+/* a buffer holds the largest datagram, or a GRO super-datagram */
+struct udp_batch {
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iovs[UDP_BATCH];
+  struct sockaddr_in addrs[UDP_BATCH];
+  char controls[UDP_BATCH][CMSG_SPACE(sizeof(struct sockaddr_in)) + CMSG_SPACE(sizeof(int))];
+  char bufs[UDP_BATCH][UDP_BUFFER_SIZE];
+};
 
-    if (pid == 0) {
-      close(listen_fd);
-      close(socketd_fd);
-      return handle_connection(fd, out_fd);
-    }
 
-    close(fd);
-    close(out_fd);
+static void enable_gro(int fd) {
+  int opt = 1;
+  if (setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) == -1) {
+    VERBOSE("setsockopt(UDP_GRO): %s\n", strerror(errno));
+  }
+}
+
+
+/* Returns the segment size of a GRO super-datagram, or 0. */
+static int gro_size(struct msghdr *msg) {
+  for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+      int size;
+      memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+      return size;
+    }
   }
 
   return 0;
 }
 
 
-struct udp_entry {
-  struct sockaddr_in addr;
-  int out_fd;
-  unsigned long long last_access; // 0 means empty
-};
+static struct sockaddr_in *orig_dst(struct msghdr *msg) {
+  for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_ORIGDSTADDR)) {
+      return (struct sockaddr_in *)CMSG_DATA(cmsg);
+    }
+  }
 
+  return NULL;
+}
 
-#define TABLE_SIZE  8
 
+/* Sends a super-datagram one segment at a time, when the kernel
+   refuses UDP_SEGMENT for the route. */
+static void send_segments(int fd, struct msghdr const *msg, size_t segment) {
+  char *data = msg->msg_iov[0].iov_base;
+  size_t len = msg->msg_iov[0].iov_len;
 
-static int is_same_addr(struct sockaddr_in const *a, struct sockaddr_in const *b) {
-  return ((a->sin_family == b->sin_family) &&
-          (a->sin_port == b->sin_port) &&
-          (a->sin_addr.s_addr == b->sin_addr.s_addr));
+  for(size_t offset=0; offset<len; offset+=segment) {
+    size_t size = (len-offset < segment)?(len-offset):segment;
+    sendto(fd, data+offset, size, 0, msg->msg_name, msg->msg_namelen);
+  }
 }
 
 
-static void send_back(struct sockaddr_in *src, struct sockaddr_in *dst, char const *buf, ssize_t buflen) {
-  int fd;
-  PERROR(==-1, fd = socket, AF_INET, SOCK_DGRAM, 0);
-  int opt = 1;
-  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-  setsockopt(fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt));
-  int ttl = 255;
-  setsockopt(fd, SOL_IP, IP_TTL, &ttl, sizeof(ttl));
-  PERROR(==-1, bind, fd, src, sizeof(struct sockaddr_in));
-  PERROR(==-1, sendto, fd, buf, buflen, 0, dst, sizeof(struct sockaddr_in));
-  close(fd);
+static void udp_batch_prepare(struct udp_batch *batch) {
+  for(int i=0; i<UDP_BATCH; i++) {
+    batch->iovs[i].iov_base = batch->bufs[i];
+    batch->iovs[i].iov_len = UDP_BUFFER_SIZE;
+    batch->msgs[i].msg_hdr = (struct msghdr){
+      .msg_name = &(batch->addrs[i]),
+      .msg_namelen = sizeof(struct sockaddr_in),
+      .msg_iov = &(batch->iovs[i]),
+      .msg_iovlen = 1,
+      .msg_control = batch->controls[i],
+      .msg_controllen = sizeof(batch->controls[i]),
+      .msg_flags = 0,
+    };
+    batch->msgs[i].msg_len = 0;
+  }
 }
 
 
 static int udp_proxy(int port, int socketd_fd) {
-  int get_new_out_fd() {
-    char sock_type = SOCK_DGRAM;
-    PERROR(==-1, send, socketd_fd, &sock_type, sizeof(sock_type), 0);
-    return recv_fd(socketd_fd);
-  }
+  struct socket_pool pool;
+  pool_init(&pool, socketd_fd, SOCK_DGRAM);
+  pool_request(&pool);
 
   int listen_fd = -1;
   PERROR(==-1, listen_fd = socket, AF_INET, SOCK_DGRAM, 0);
   int opt = 1;
   setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (opt_workers > 1) {
+    PERROR(==-1, setsockopt, listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+  }
   setsockopt(listen_fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt));
   setsockopt(listen_fd, SOL_IP, IP_ORIGDSTADDR, &opt, sizeof(opt));
+  if (opt_udp_gro) {
+    enable_gro(listen_fd);
+  }
 
   struct sockaddr_in addr = {
     .sin_family = AF_INET,
@@ -232,144 +1835,253 @@ static int udp_proxy(int port, int socketd_fd) {
 
   PERROR(==-1, bind, listen_fd, &addr, sizeof(addr));
 
-  struct udp_entry table[TABLE_SIZE];
-  memset(table, 0, sizeof(table));
+  /* every flow holds an upstream socket, and usually one reply socket */
+  int max_fds = raise_fd_limit();
+  if (opt_udp_max_flows > (max_fds - 16) / 2) {
+    opt_udp_max_flows = (max_fds > 48)?((max_fds - 16) / 2):16;
+    LOG("limiting udp flows to %d by the open files limit\n", opt_udp_max_flows);
+  }
 
-  int entry_count = 0;
-  unsigned long long counter = 0;
+  struct udp_table table;
+  udp_table_init(&table, opt_udp_max_flows, max_fds);
 
-  struct udp_entry *find_entry_by_addr(struct sockaddr_in const *addr) {
-    for(int i=0; i<TABLE_SIZE; i++) {
-      if (table[i].last_access == 0) {
-        continue;
-      }
+  int poll_fd;
+  PERROR(==-1, poll_fd = epoll_create, 1);
+
+  epoll_set(poll_fd, EPOLL_CTL_ADD, listen_fd, EPOLLIN);
+  epoll_set(poll_fd, EPOLL_CTL_ADD, socketd_fd, EPOLLIN);
+
+  static struct udp_batch batch;
+
+  /* received datagrams are forwarded in runs sharing one socket, and
+     a run is sent before the next flow is looked up, so an eviction
+     never closes a socket that still has datagrams queued */
+  struct mmsghdr out[UDP_BATCH];
+  struct iovec out_iovs[UDP_BATCH];
+  struct sockaddr_in out_addrs[UDP_BATCH];
+  char out_controls[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+  uint16_t out_segments[UDP_BATCH];
+  int out_count = 0;
+  int out_fd = -1;
+
+  void flush() {
+    struct mmsghdr *msgs = out;
+    uint16_t *segments = out_segments;
+    int count = out_count;
+
+    while (count > 0) {
+      int sent = sendmmsg(out_fd, msgs, count, 0);
+
+      if (sent == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
 
-      if (is_same_addr(addr, &(table[i].addr))) {
-        return &table[i];
+        if (*segments && ((errno == EIO) || (errno == EINVAL))) {
+          send_segments(out_fd, &(msgs->msg_hdr), *segments);
+        } else {
+          VERBOSE("sendmmsg: %s\n", strerror(errno));
+          STAT_ADD(errors, 1);
+        }
+
+        sent = 1;
       }
+
+      msgs += sent;
+      segments += sent;
+      count -= sent;
     }
 
-    return NULL;
+    out_count = 0;
+  }
+
+  void queue(int fd, struct iovec const *iov, struct sockaddr_in const *dst, int segment) {
+    out_fd = fd;
+    out_iovs[out_count] = *iov;
+    out_addrs[out_count] = *dst;
+    out[out_count].msg_hdr = (struct msghdr){
+      .msg_name = &(out_addrs[out_count]),
+      .msg_namelen = sizeof(struct sockaddr_in),
+      .msg_iov = &(out_iovs[out_count]),
+      .msg_iovlen = 1,
+    };
+    out_segments[out_count] = 0;
+
+    /* split a super-datagram again on the way out */
+    if ((segment > 0) && (iov->iov_len > (size_t)segment)) {
+      struct msghdr *msg = &(out[out_count].msg_hdr);
+      msg->msg_control = out_controls[out_count];
+      msg->msg_controllen = sizeof(out_controls[out_count]);
+
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      out_segments[out_count] = segment;
+      memcpy(CMSG_DATA(cmsg), &(out_segments[out_count]), sizeof(uint16_t));
+    }
+
+    out_count += 1;
+  }
+
+  struct udp_flow *open_flow(struct sockaddr_in const *src) {
+    struct udp_flow *flow;
+
+    if (table.count >= table.capacity) {
+      flow = udp_table_least_recent(&table);
+      udp_table_remove(&table, flow);
+      VERBOSE("evicting udp flow from %s:%d\n", inet_ntoa(flow->addr.sin_addr), ntohs(flow->addr.sin_port));
+      udp_flow_close(flow);
+      STAT_ADD(udp_flows_evicted, 1);
+    } else {
+      flow = malloc(sizeof(struct udp_flow));
+      ERROR(flow==NULL, "cannot allocate udp flow\n");
+      flow->reply_count = 0;
+    }
+
+    flow->out_fd = pool_take(&pool);
+    flow->addr.sin_family = src->sin_family;
+    flow->addr.sin_port = src->sin_port;
+    flow->addr.sin_addr.s_addr = src->sin_addr.s_addr;
+
+    if (udp_table_insert(&table, flow) == -1) {
+      LOG("too many udp flows\n");
+      STAT_ADD(errors, 1);
+      close(flow->out_fd);
+      free(flow);
+      return NULL;
+    }
+
+    if (opt_udp_gro) {
+      enable_gro(flow->out_fd);
+    }
+
+    STAT_ADD(udp_flows_total, 1);
+    epoll_set(poll_fd, EPOLL_CTL_ADD, flow->out_fd, EPOLLIN);
+    return flow;
   }
 
-  struct udp_entry *find_entry_by_out_fd(int fd) {
-    for(int i=0; i<TABLE_SIZE; i++) {
-      if (table[i].last_access == 0) {
+  /* client -> original destination, through the flow's upstream socket */
+  void forward(int received) {
+    struct sockaddr_in const *run = NULL;
+
+    for(int i=0; i<received; i++) {
+      struct msghdr *msg = &(batch.msgs[i].msg_hdr);
+      struct sockaddr_in *src = &(batch.addrs[i]);
+      struct sockaddr_in *dst = orig_dst(msg);
+
+      if (!dst) {
+        VERBOSE("cmsg: bad message!\n");
         continue;
       }
 
-      if (table[i].out_fd == fd) {
-        return &table[i];
+      if (msg->msg_flags & MSG_TRUNC) {
+        VERBOSE("datagram truncated\n");
+        continue;
       }
-    }
 
-    return NULL;
-  }
+      if (!run || !is_same_addr(run, src)) {
+        flush();
+        run = src;
+      }
 
-  struct udp_entry *find_first_empty_entry() {
-    for(int i=0; i<TABLE_SIZE; i++) {
-      if (table[i].last_access == 0) {
-        return &table[i];
+      struct udp_flow *flow = udp_table_find_by_addr(&table, src);
+
+      if (!flow) {
+        flow = open_flow(src);
+        if (!flow) {
+          run = NULL;
+          continue;
+        }
+      } else {
+        udp_table_touch(&table, flow);
       }
+
+      struct iovec iov = {.iov_base = batch.bufs[i], .iov_len = batch.msgs[i].msg_len};
+      queue(flow->out_fd, &iov, dst, gro_size(msg));
+      STAT_ADD(bytes_out, iov.iov_len);
     }
 
-    return NULL;
+    flush();
   }
 
-  struct udp_entry *find_least_recent_accessed_entry() {
-    int min_index = 0;
-    unsigned long long min_access = table[0].last_access;
+  /* original destination -> client, through a cached reply socket */
+  void reply(struct udp_flow *flow, int received) {
+    struct sockaddr_in const *run = NULL;
+    int fd = -1;
 
-    for(int i=1; i<TABLE_SIZE; i++) {
-      if (table[i].last_access == 0) {
-        continue;
+    for(int i=0; i<received; i++) {
+      struct sockaddr_in *src = &(batch.addrs[i]);
+
+      if (!run || !is_same_addr(run, src)) {
+        flush();
+        run = src;
+        fd = udp_flow_reply_fd(flow, src);
       }
 
-      if (table[i].last_access < min_access) {
-        min_access = table[i].last_access;
-        min_index = i;
+      if (fd == -1) {
+        continue;
       }
+
+      struct iovec iov = {.iov_base = batch.bufs[i], .iov_len = batch.msgs[i].msg_len};
+      queue(fd, &iov, &(flow->addr), gro_size(&(batch.msgs[i].msg_hdr)));
+      STAT_ADD(bytes_in, iov.iov_len);
     }
 
-    return &table[min_index];
+    flush();
   }
 
-  int poll_fd;
-  PERROR(==-1, poll_fd = epoll_create, 1);
+  /* drains a socket a batch at a time, returns the last batch size */
+  int receive(int fd) {
+    int received;
+    udp_batch_prepare(&batch);
+    RETRY_ON_INTR(received = recvmmsg, fd, batch.msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
 
-  epoll_set(poll_fd, EPOLL_CTL_ADD, listen_fd, EPOLLIN);
+    if ((received == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      VERBOSE("recvmmsg: %s\n", strerror(errno));
+      STAT_ADD(errors, 1);
+    }
+
+    return received;
+  }
 
-  struct epoll_event event = {0};
+  struct epoll_event events[MAX_EVENTS];
 
   for(;;) {
     int nfds;
-    PERROR(==-1, nfds = epoll_wait, poll_fd, &event, 1, -1);
-    if (!nfds) {
-      continue;
-    }
+    PERROR(==-1, nfds = epoll_wait, poll_fd, events, MAX_EVENTS, -1);
 
-    if (event.data.fd == listen_fd) {
-      char control[CMSG_SPACE(sizeof(struct sockaddr_in))];
-      char buf[4096];
-      struct sockaddr_in src = {0};
-
-      struct iovec iov = {.iov_base = &buf, .iov_len = sizeof(buf)};
-      struct msghdr msg = {
-        .msg_name = &src,
-        .msg_namelen = sizeof(src),
-        .msg_iov = &iov,
-        .msg_iovlen = 1,
-        .msg_control = control,
-        .msg_controllen = CMSG_LEN(sizeof(struct sockaddr_in)),
-        .msg_flags = 0,
-      };
-
-      ssize_t recvlen;
-      PERROR(==-1, recvlen = recvmsg, listen_fd, &msg, 0);
-      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-
-      ERROR((cmsg==NULL) ||
-            (cmsg->cmsg_level != SOL_IP) ||
-            (cmsg->cmsg_type != IP_ORIGDSTADDR),
-            "cmsg: bad message!\n");
-
-      struct sockaddr_in *dst = (struct sockaddr_in *)CMSG_DATA(cmsg);
-      struct udp_entry *entry = find_entry_by_addr(&src);
-
-      if (!entry) {
-        if (entry_count >= TABLE_SIZE) {
-          entry = find_least_recent_accessed_entry();
-          PERROR(==-1, epoll_ctl, poll_fd, EPOLL_CTL_DEL, entry->out_fd, NULL);
-          close(entry->out_fd);
-        } else {
-          entry = find_first_empty_entry();
-          entry_count += 1;
-          ERROR(entry==NULL, "cannot find empty entry");
-        }
+    for(int i=0; i<nfds; i++) {
+      int fd = events[i].data.fd;
+      int received;
 
-        entry->out_fd = get_new_out_fd();
-        epoll_set(poll_fd, EPOLL_CTL_ADD, entry->out_fd, EPOLLIN);
-        entry->addr.sin_family = src.sin_family;
-        entry->addr.sin_port = src.sin_port;
-        entry->addr.sin_addr.s_addr = src.sin_addr.s_addr;
+      if (fd == listen_fd) {
+        do {
+          received = receive(listen_fd);
+          forward(received);
+        } while (received == UDP_BATCH);
+
+        continue;
       }
 
-      counter += 1;
-      entry->last_access = counter;
-      sendto(entry->out_fd, buf, recvlen, 0, dst, sizeof(struct sockaddr_in));
-    } else {
-      struct udp_entry *entry = find_entry_by_out_fd(event.data.fd);
-      ERROR(entry==NULL, "cannot find entry");
-      counter += 1;
-      entry->last_access = counter;
+      if (fd == socketd_fd) {
+        ERROR(events[i].events & (EPOLLHUP|EPOLLERR), "socketd went away\n");
+        pool_receive(&pool, MSG_DONTWAIT);
+        continue;
+      }
+
+      struct udp_flow *flow = udp_table_find_by_out_fd(&table, fd);
+      if (!flow) {
+        /* evicted earlier in this batch of events */
+        continue;
+      }
 
-      char buf[4096];
-      struct sockaddr_in src;
-      ssize_t recvlen;
-      socklen_t addr_len = sizeof(struct sockaddr_in);
-      PERROR(==-1, recvlen = recvfrom, entry->out_fd, buf, sizeof(buf), 0, &src, &addr_len);
+      udp_table_touch(&table, flow);
 
-      send_back(&src, &(entry->addr), buf, recvlen);
+      do {
+        received = receive(fd);
+        reply(flow, received);
+      } while (received == UDP_BATCH);
     }
   }
 
@@ -389,10 +2101,100 @@ static struct proto protos[] = {
 };
 
 
+static int connect_socketd(char const *socket_path) {
+  int fd = -1;
+  PERROR(==-1, fd = socket, AF_UNIX, SOCK_STREAM, 0);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+
+  PERROR(==-1, connect, fd, &addr, sizeof(addr));
+  return fd;
+}
+
+
+static int next_cpu(cpu_set_t const *cpus, int cpu) {
+  for(int i=1; i<=CPU_SETSIZE; i++) {
+    int next = (cpu+i) % CPU_SETSIZE;
+    if (CPU_ISSET(next, cpus)) {
+      return next;
+    }
+  }
+
+  return -1;
+}
+
+
+/* Every worker binds its own SO_REUSEPORT listener and has its own
+   socketd connection, the kernel spreads new flows across them. */
+static int run_workers(int (*proxy)(int port, int fd), int port, char const *socket_path, struct proxy_stats *segment) {
+  cpu_set_t cpus;
+  PERROR(==-1, sched_getaffinity, 0, sizeof(cpus), &cpus);
+
+  pid_t *pids = calloc(opt_workers, sizeof(pid_t));
+  ERROR(!pids, "cannot allocate worker table\n");
+
+  int cpu = -1;
+  pid_t parent = getpid();
+
+  for(int i=0; i<opt_workers; i++) {
+    cpu = next_cpu(&cpus, cpu);
+
+    pid_t pid;
+    PERROR(==-1, pid = fork);
+
+    if (pid == 0) {
+      PERROR(==-1, prctl, PR_SET_PDEATHSIG, SIGTERM);
+
+      /* the parent may have died before the signal was asked for */
+      if (getppid() != parent) {
+        exit(EXIT_FAILURE);
+      }
+
+      if (segment) {
+        stats = &(segment->counters[i]);
+      }
+
+      if (opt_pin_cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        PERROR(==-1, sched_setaffinity, 0, sizeof(set), &set);
+        VERBOSE("worker %d pinned to cpu %d\n", i, cpu);
+      }
+
+      return proxy(port, connect_socketd(socket_path));
+    }
+
+    pids[i] = pid;
+  }
+
+  /* a worker never exits on its own, take the others down with it */
+  int status;
+  pid_t pid;
+  PERROR(==-1, pid = wait, &status);
+
+  for(int i=0; i<opt_workers; i++) {
+    if (pids[i] != pid) {
+      kill(pids[i], SIGTERM);
+    }
+  }
+
+  while (wait(NULL) != -1);
+
+  if (WIFSIGNALED(status)) {
+    return WTERMSIG(status) + 128;
+  } else {
+    return WEXITSTATUS(status);
+  }
+}
+
+
 int cmd_proxy(int argc, char *const argv[]) {
   int opt, index;
+  int prefetch_given = 0;
 
-  while((opt = getopt_long(argc, argv, "+h", options, &index)) != -1) {
+  while((opt = getopt_long(argc, argv, "+w:h", options, &index)) != -1) {
     switch(opt) {
     case '?':
       goto err;
@@ -401,6 +2203,62 @@ int cmd_proxy(int argc, char *const argv[]) {
       show_usage();
       break;
 
+    case 'w':
+      opt_workers = parse_number("number of workers", optarg);
+      BADOPT(opt_workers <= 0, "bad number of workers '%s'\n", optarg);
+      break;
+
+    case OPT_PIN_CPUS:
+      opt_pin_cpus = 1;
+      break;
+
+    case OPT_IO_URING:
+      opt_io_uring = 1;
+      break;
+
+    case OPT_UDP_GRO:
+      opt_udp_gro = 1;
+      break;
+
+    case OPT_PREFETCH:
+      prefetch_given = 1;
+      opt_prefetch = parse_number("number of sockets", optarg);
+      BADOPT((opt_prefetch < 0) || (opt_prefetch > SOCKETD_MAX_FDS),
+             "number of sockets must be between 0 and %d\n", SOCKETD_MAX_FDS);
+      break;
+
+    case OPT_CONNECT_TIMEOUT:
+      opt_connect_timeout = parse_number("connect timeout", optarg);
+      BADOPT(opt_connect_timeout < 0, "bad connect timeout '%s'\n", optarg);
+      break;
+
+    case OPT_FASTOPEN:
+      opt_fastopen = 1;
+      break;
+
+    case OPT_SLOW_MS:
+      opt_slow_ms = parse_number("slow threshold", optarg);
+      BADOPT(opt_slow_ms < 0, "bad slow threshold '%s'\n", optarg);
+      break;
+
+    case OPT_SOCKMAP:
+      opt_sockmap = 1;
+      break;
+
+    case OPT_UDP_MAX_FLOWS:
+      opt_udp_max_flows = parse_number("number of udp flows", optarg);
+      BADOPT(opt_udp_max_flows <= 0, "bad number of udp flows '%s'\n", optarg);
+      break;
+
+    case OPT_SPLICE:
+      opt_splice = 1;
+      break;
+
+    case OPT_PIPE_SIZE:
+      opt_pipe_size = parse_number("pipe size", optarg);
+      BADOPT(opt_pipe_size <= 0, "bad pipe size '%s'\n", optarg);
+      break;
+
     default:
       break;
     }
@@ -409,6 +2267,15 @@ int cmd_proxy(int argc, char *const argv[]) {
   BADOPT(argc-optind < 2, "Too few arguments\n");
   BADOPT(argc-optind > 2, "Too many arguments\n");
 
+  /* only workers are pinned, a single proxy keeps its affinity */
+  BADOPT(opt_pin_cpus && (opt_workers == 1), "--pin-cpus needs --workers\n");
+
+  /* the io_uring relay asks for sockets as connections come in, and
+     relays everything itself */
+  BADOPT(opt_io_uring && prefetch_given, "--prefetch does not work with --io-uring\n");
+  BADOPT(opt_io_uring && opt_fastopen, "--fastopen does not work with --io-uring\n");
+  BADOPT(opt_io_uring && opt_sockmap, "--sockmap does not work with --io-uring\n");
+
   char *rundir = getenv("XDG_RUNTIME_DIR");
   ERROR(!rundir, "environment XDG_RUNTIME_DIR is not set\n");
 
@@ -437,15 +2304,23 @@ int cmd_proxy(int argc, char *const argv[]) {
   char socket_path[PATH_MAX] = {0};
   snprintf(socket_path, PATH_MAX, "%s/userns/%s/socketd", rundir, name);
 
-  int fd = -1;
-  PERROR(==-1, fd = socket, AF_UNIX, SOCK_STREAM, 0);
+  if (opt_io_uring && (proxy == tcp_proxy)) {
+    proxy = tcp_uring_proxy;
+  }
 
-  struct sockaddr_un addr = {.sun_family = AF_UNIX};
-  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+  signal(SIGPIPE, SIG_IGN);
 
-  PERROR(==-1, connect, fd, &addr, sizeof(addr));
+  struct proxy_stats *segment = stats_create(rundir, name, argv[optind], port);
+
+  if (opt_workers > 1) {
+    return run_workers(proxy, port, socket_path, segment);
+  }
+
+  if (segment) {
+    stats = &(segment->counters[0]);
+  }
 
-  return proxy(port, fd);
+  return proxy(port, connect_socketd(socket_path));
 err:
   fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
   exit(EXIT_FAILURE);
@@ -0,0 +1,163 @@
+#include "global.h"
+
+
+/* The room at the tail, the contents are moved back to the start when
+   the tail has less than want bytes. */
+static size_t space(struct relay_buffer *buffer, size_t want) {
+  if (buffer->start == buffer->end) {
+    buffer->start = buffer->end = 0;
+  } else if (buffer->start && (RELAY_BUFFER_SIZE - buffer->end < want)) {
+    memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+    buffer->end -= buffer->start;
+    buffer->start = 0;
+  }
+
+  return RELAY_BUFFER_SIZE - buffer->end;
+}
+
+
+/* Reads all fd has at once, up to the free space in buffer, so many
+   small reads go out as one write. fd must be non-blocking. Returns
+   the number of bytes read, 0 on EOF, or -1 with errno set, EAGAIN if
+   nothing was there or the buffer is full. */
+ssize_t relay_fill(int fd, struct relay_buffer *buffer) {
+  ssize_t total = 0;
+
+  while (space(buffer, 1)) {
+    ssize_t received;
+    RETRY_ON_INTR(received = read, fd, buffer->data + buffer->end, RELAY_BUFFER_SIZE - buffer->end);
+
+    if (received <= 0) {
+      return total?total:received;
+    }
+
+    buffer->end += received;
+    total += received;
+  }
+
+  if (!total) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return total;
+}
+
+
+/* Writes out what it can, adding the bytes to *written if given.
+   Returns -1 on errors other than EAGAIN. */
+int relay_flush(int fd, struct relay_buffer *buffer, size_t *written) {
+  while (buffer->start < buffer->end) {
+    ssize_t sent;
+    RETRY_ON_INTR(sent = write, fd, buffer->data + buffer->start, buffer->end - buffer->start);
+
+    if (sent == -1) {
+      return (errno == EAGAIN)?0:-1;
+    }
+
+    buffer->start += sent;
+    if (written) {
+      *written += sent;
+    }
+  }
+
+  return 0;
+}
+
+
+int relay_append(struct relay_buffer *buffer, void const *data, size_t size) {
+  if (space(buffer, size) < size) {
+    return -1;
+  }
+
+  memcpy(buffer->data + buffer->end, data, size);
+  buffer->end += size;
+  return 0;
+}
+
+
+/* A non-blocking fd on the same file as fd. Pipes and terminals are
+   opened again, so the O_NONBLOCK does not leak to whoever shares
+   them. Regular files never block and are only duplicated. */
+int relay_reopen(int fd, int flags) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return -1;
+  }
+
+  if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)) {
+    char path[PATH_MAX] = {0};
+    snprintf(path, PATH_MAX, "/proc/self/fd/%d", fd);
+    return open(path, flags|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+  }
+
+  int new_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+  if ((new_fd != -1) && S_ISSOCK(st.st_mode)) {
+    fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  return new_fd;
+}
+
+
+/* Returns -1 if the frame does not fit in buffer for now. */
+int mux_put(struct relay_buffer *buffer, uint32_t channel, uint16_t type, void const *data, uint16_t size) {
+  if (space(buffer, sizeof(struct mux_header) + size) < sizeof(struct mux_header) + size) {
+    return -1;
+  }
+
+  struct mux_header header = {.channel = channel, .type = type, .size = size};
+  memcpy(buffer->data + buffer->end, &header, sizeof(header));
+  memcpy(buffer->data + buffer->end + sizeof(header), data, size);
+  buffer->end += sizeof(header) + size;
+  return 0;
+}
+
+
+/* One read of at most max bytes from fd, stored as a frame. Returns
+   like relay_fill. */
+ssize_t mux_read(int fd, struct relay_buffer *buffer, uint32_t channel, uint16_t type, size_t max) {
+  size_t room = space(buffer, sizeof(struct mux_header) + max);
+
+  if (room <= sizeof(struct mux_header)) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  room -= sizeof(struct mux_header);
+  max = (max < room)?max:room;
+  max = (max < UINT16_MAX)?max:UINT16_MAX;
+
+  ssize_t received;
+  RETRY_ON_INTR(received = read, fd, buffer->data + buffer->end + sizeof(struct mux_header), max);
+
+  if (received > 0) {
+    struct mux_header header = {.channel = channel, .type = type, .size = received};
+    memcpy(buffer->data + buffer->end, &header, sizeof(header));
+    buffer->end += sizeof(header) + received;
+  }
+
+  return received;
+}
+
+
+/* Takes the next whole frame out of buffer. The payload stays valid
+   until the buffer is filled again. Returns 0 if there is none yet. */
+int mux_next(struct relay_buffer *buffer, struct mux_header *header, char **payload) {
+  size_t available = buffer->end - buffer->start;
+
+  if (available < sizeof(struct mux_header)) {
+    return 0;
+  }
+
+  memcpy(header, buffer->data + buffer->start, sizeof(struct mux_header));
+
+  if (available < sizeof(struct mux_header) + header->size) {
+    return 0;
+  }
+
+  *payload = buffer->data + buffer->start + sizeof(struct mux_header);
+  buffer->start += sizeof(struct mux_header) + header->size;
+  return 1;
+}
@@ -0,0 +1,385 @@
+#include "global.h"
+
+
+#define RULES_TABLE "userns_proxy"
+
+
+static int opt_port = 0;
+static char *opt_mark = "1";
+static char *opt_table = "100";
+static int opt_delete = 0;
+
+
+static struct option options[] = {
+  {"mark",         required_argument, NULL, 'm'},
+  {"table",        required_argument, NULL, 't'},
+  {"delete",       no_argument,       NULL, 'd'},
+  {"help",         no_argument,       NULL, 'h'},
+
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options] port\n", executable, cmd_name);
+  printf("\n"
+         "  -m, --mark=MARK            mark of the udp packets to proxy (default 1)\n"
+         "  -t, --table=N              routing table delivering them (default 100)\n"
+         "  -d, --delete               remove the rules\n"
+         "\n"
+         "  -h, --help                 print help message and exit\n"
+         "\n"
+         "Redirects tcp, and udp with TPROXY, to the proxy listening on port,\n"
+         "as share/setup-proxy-rules.sh did with iptables. The nftables table\n"
+         "'" RULES_TABLE "' is replaced in one transaction.\n"
+         );
+  exit(0);
+}
+
+
+static struct nl_batch batch;
+
+
+/* the kernel keeps its nftables changes only if the whole batch
+   between the markers succeeds */
+static void batch_marker(uint16_t type) {
+  struct nfgenmsg nfg = {
+    .nfgen_family = AF_UNSPEC,
+    .version = NFNETLINK_V0,
+    .res_id = htons(NFNL_SUBSYS_NFTABLES),
+  };
+
+  nl_end(&batch, nl_begin(&batch, type, 0, &nfg, sizeof(nfg), "nftables batch"));
+}
+
+
+static struct nlmsghdr *begin_nft(uint16_t type, uint16_t flags, char const *what) {
+  struct nfgenmsg nfg = {.nfgen_family = NFPROTO_IPV4, .version = NFNETLINK_V0};
+  return nl_begin(&batch, (NFNL_SUBSYS_NFTABLES << 8) | type, NLM_F_ACK|flags, &nfg, sizeof(nfg), what);
+}
+
+
+static struct rtattr *begin_nest(struct nlmsghdr *msg, uint16_t type) {
+  return nl_attr(msg, NLA_F_NESTED|type, NULL, 0);
+}
+
+
+/* numbers in nftables attributes are big endian */
+static void add_be32(struct nlmsghdr *msg, uint16_t type, uint32_t value) {
+  nl_u32(msg, type, htonl(value));
+}
+
+
+static void add_value(struct nlmsghdr *msg, uint16_t type, void const *data, size_t size) {
+  struct rtattr *nest = begin_nest(msg, type);
+  nl_attr(msg, NFTA_DATA_VALUE, data, size);
+  nl_nest_end(msg, nest);
+}
+
+
+static void add_table(uint16_t type, uint16_t flags, char const *what) {
+  struct nlmsghdr *msg = begin_nft(type, flags, what);
+  nl_string(msg, NFTA_TABLE_NAME, RULES_TABLE);
+  nl_end(&batch, msg);
+}
+
+
+static void add_chain(char const *name, char const *chain_type, uint32_t hook, int32_t priority) {
+  struct nlmsghdr *msg = begin_nft(NFT_MSG_NEWCHAIN, NLM_F_CREATE, name);
+  nl_string(msg, NFTA_CHAIN_TABLE, RULES_TABLE);
+  nl_string(msg, NFTA_CHAIN_NAME, name);
+  nl_string(msg, NFTA_CHAIN_TYPE, chain_type);
+
+  struct rtattr *nest = begin_nest(msg, NFTA_CHAIN_HOOK);
+  add_be32(msg, NFTA_HOOK_HOOKNUM, hook);
+  add_be32(msg, NFTA_HOOK_PRIORITY, priority);
+  nl_nest_end(msg, nest);
+  nl_end(&batch, msg);
+}
+
+
+/* A rule is a list of expressions, each of them working on register 1
+   and ending the rule if a comparison fails. */
+struct rule {
+  struct nlmsghdr *msg;
+  struct rtattr *list;
+  struct rtattr *elem;
+  struct rtattr *data;
+};
+
+
+static struct rule begin_rule(char const *chain) {
+  struct rule rule = {.msg = begin_nft(NFT_MSG_NEWRULE, NLM_F_CREATE|NLM_F_APPEND, chain)};
+  nl_string(rule.msg, NFTA_RULE_TABLE, RULES_TABLE);
+  nl_string(rule.msg, NFTA_RULE_CHAIN, chain);
+  rule.list = begin_nest(rule.msg, NFTA_RULE_EXPRESSIONS);
+  return rule;
+}
+
+
+static void begin_expr(struct rule *rule, char const *name) {
+  rule->elem = begin_nest(rule->msg, NFTA_LIST_ELEM);
+  nl_string(rule->msg, NFTA_EXPR_NAME, name);
+  rule->data = begin_nest(rule->msg, NFTA_EXPR_DATA);
+}
+
+
+static void end_expr(struct rule *rule) {
+  nl_nest_end(rule->msg, rule->data);
+  nl_nest_end(rule->msg, rule->elem);
+}
+
+
+static void end_rule(struct rule *rule) {
+  nl_nest_end(rule->msg, rule->list);
+  nl_end(&batch, rule->msg);
+}
+
+
+static void expr_payload(struct rule *rule, uint32_t offset, uint32_t size) {
+  begin_expr(rule, "payload");
+  add_be32(rule->msg, NFTA_PAYLOAD_DREG, NFT_REG_1);
+  add_be32(rule->msg, NFTA_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+  add_be32(rule->msg, NFTA_PAYLOAD_OFFSET, offset);
+  add_be32(rule->msg, NFTA_PAYLOAD_LEN, size);
+  end_expr(rule);
+}
+
+
+static void expr_meta(struct rule *rule, uint32_t key, int store) {
+  begin_expr(rule, "meta");
+  add_be32(rule->msg, NFTA_META_KEY, key);
+  add_be32(rule->msg, store?NFTA_META_SREG:NFTA_META_DREG, NFT_REG_1);
+  end_expr(rule);
+}
+
+
+static void expr_cmp(struct rule *rule, uint32_t op, void const *data, size_t size) {
+  begin_expr(rule, "cmp");
+  add_be32(rule->msg, NFTA_CMP_SREG, NFT_REG_1);
+  add_be32(rule->msg, NFTA_CMP_OP, op);
+  add_value(rule->msg, NFTA_CMP_DATA, data, size);
+  end_expr(rule);
+}
+
+
+static void expr_immediate(struct rule *rule, void const *data, size_t size) {
+  begin_expr(rule, "immediate");
+  add_be32(rule->msg, NFTA_IMMEDIATE_DREG, NFT_REG_1);
+  add_value(rule->msg, NFTA_IMMEDIATE_DATA, data, size);
+  end_expr(rule);
+}
+
+
+static void expr_verdict(struct rule *rule, int32_t code) {
+  begin_expr(rule, "immediate");
+  add_be32(rule->msg, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+  struct rtattr *data = begin_nest(rule->msg, NFTA_IMMEDIATE_DATA);
+  struct rtattr *verdict = begin_nest(rule->msg, NFTA_DATA_VERDICT);
+  add_be32(rule->msg, NFTA_VERDICT_CODE, code);
+  nl_nest_end(rule->msg, verdict);
+  nl_nest_end(rule->msg, data);
+  end_expr(rule);
+}
+
+
+static void match_protocol(struct rule *rule, uint8_t protocol) {
+  expr_meta(rule, NFT_META_L4PROTO, 0);
+  expr_cmp(rule, NFT_CMP_EQ, &protocol, sizeof(protocol));
+}
+
+
+/* ip daddr 127.0.0.0/8, or not */
+static void match_loopback(struct rule *rule, uint32_t op) {
+  uint32_t mask = htonl(0xff000000), zero = 0, loopback = htonl(0x7f000000);
+
+  expr_payload(rule, offsetof(struct iphdr, daddr), sizeof(uint32_t));
+  begin_expr(rule, "bitwise");
+  add_be32(rule->msg, NFTA_BITWISE_SREG, NFT_REG_1);
+  add_be32(rule->msg, NFTA_BITWISE_DREG, NFT_REG_1);
+  add_be32(rule->msg, NFTA_BITWISE_LEN, sizeof(uint32_t));
+  add_value(rule->msg, NFTA_BITWISE_MASK, &mask, sizeof(mask));
+  add_value(rule->msg, NFTA_BITWISE_XOR, &zero, sizeof(zero));
+  end_expr(rule);
+  expr_cmp(rule, op, &loopback, sizeof(loopback));
+}
+
+
+/* tcp to anywhere but loopback goes to the proxy */
+static void add_redirect(char const *chain) {
+  struct rule rule = begin_rule(chain);
+  match_protocol(&rule, IPPROTO_TCP);
+  match_loopback(&rule, NFT_CMP_EQ);
+  expr_verdict(&rule, NFT_RETURN);
+  end_rule(&rule);
+
+  uint16_t port = htons(opt_port);
+  rule = begin_rule(chain);
+  match_protocol(&rule, IPPROTO_TCP);
+  expr_immediate(&rule, &port, sizeof(port));
+  begin_expr(&rule, "redir");
+  add_be32(rule.msg, NFTA_REDIR_REG_PROTO_MIN, NFT_REG_1);
+  end_expr(&rule);
+  end_rule(&rule);
+}
+
+
+/* udp to anywhere but loopback, apart from what the proxy sends itself
+   with a ttl of 255 */
+static void match_tproxied(struct rule *rule) {
+  uint8_t ttl = 255;
+
+  match_loopback(rule, NFT_CMP_NEQ);
+  match_protocol(rule, IPPROTO_UDP);
+  expr_payload(rule, offsetof(struct iphdr, ttl), sizeof(ttl));
+  expr_cmp(rule, NFT_CMP_NEQ, &ttl, sizeof(ttl));
+}
+
+
+/* Marked udp is routed to lo by the policy rule, where the proxy's
+   transparent socket picks it up. nft's tproxy falls through when no
+   socket is there, unlike the xt TPROXY target, so what is left is
+   dropped, as before. */
+static void add_tproxy(uint32_t mark) {
+  uint16_t port = htons(opt_port);
+
+  struct rule rule = begin_rule("mangle_prerouting");
+  match_tproxied(&rule);
+  expr_immediate(&rule, &port, sizeof(port));
+  begin_expr(&rule, "tproxy");
+  add_be32(rule.msg, NFTA_TPROXY_FAMILY, NFPROTO_IPV4);
+  add_be32(rule.msg, NFTA_TPROXY_REG_PORT, NFT_REG_1);
+  end_expr(&rule);
+  expr_immediate(&rule, &mark, sizeof(mark));
+  expr_meta(&rule, NFT_META_MARK, 1);
+  expr_verdict(&rule, NF_ACCEPT);
+  end_rule(&rule);
+
+  rule = begin_rule("mangle_prerouting");
+  match_tproxied(&rule);
+  expr_verdict(&rule, NF_DROP);
+  end_rule(&rule);
+
+  rule = begin_rule("mangle_output");
+  match_protocol(&rule, IPPROTO_UDP);
+  expr_immediate(&rule, &mark, sizeof(mark));
+  expr_meta(&rule, NFT_META_MARK, 1);
+  end_rule(&rule);
+}
+
+
+/* The table is created, so that deleting it cannot fail, deleted and
+   created again with all its chains and rules. Nothing of it is seen
+   until the batch ends. */
+static int install_nft(uint32_t mark) {
+  nl_open(&batch, NETLINK_NETFILTER);
+  batch_marker(NFNL_MSG_BATCH_BEGIN);
+
+  add_table(NFT_MSG_NEWTABLE, NLM_F_CREATE, "add table " RULES_TABLE);
+  add_table(NFT_MSG_DELTABLE, 0, "flush table " RULES_TABLE);
+  add_table(NFT_MSG_NEWTABLE, NLM_F_CREATE, "add table " RULES_TABLE);
+
+  add_chain("nat_prerouting", "nat", NF_INET_PRE_ROUTING, NF_IP_PRI_NAT_DST);
+  add_chain("nat_output", "nat", NF_INET_LOCAL_OUT, NF_IP_PRI_NAT_DST);
+  add_chain("mangle_prerouting", "filter", NF_INET_PRE_ROUTING, NF_IP_PRI_MANGLE);
+  add_chain("mangle_output", "route", NF_INET_LOCAL_OUT, NF_IP_PRI_MANGLE);
+
+  add_redirect("nat_prerouting");
+  add_redirect("nat_output");
+  add_tproxy(mark);
+
+  batch_marker(NFNL_MSG_BATCH_END);
+  nl_flush(&batch);
+  close(batch.fd);
+  return batch.failed;
+}
+
+
+static int delete_nft() {
+  nl_open(&batch, NETLINK_NETFILTER);
+  batch_marker(NFNL_MSG_BATCH_BEGIN);
+  add_table(NFT_MSG_DELTABLE, 0, "delete table " RULES_TABLE);
+  batch_marker(NFNL_MSG_BATCH_END);
+  nl_flush(&batch);
+  close(batch.fd);
+  return batch.failed;
+}
+
+
+int cmd_rules(int argc, char *const argv[]) {
+  int opt, index;
+
+  while((opt = getopt_long(argc, argv, "+m:t:dh", options, &index)) != -1) {
+    switch(opt) {
+    case '?':
+      goto err;
+
+    case 'h':
+      show_usage();
+      break;
+
+    case 'm':
+      opt_mark = optarg;
+      break;
+
+    case 't':
+      opt_table = optarg;
+      break;
+
+    case 'd':
+      opt_delete = 1;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  BADOPT(!opt_delete && (optind >= argc), "missing port\n");
+  BADOPT(optind+(opt_delete?0:1) < argc, "Too many arguments\n");
+
+  char *end = NULL;
+  unsigned long mark = strtoul(opt_mark, &end, 0);
+  BADOPT(*end || (end == opt_mark) || !mark || (mark > UINT32_MAX), "bad mark '%s'\n", opt_mark);
+
+  if (!opt_delete) {
+    long port = strtol(argv[optind], &end, 10);
+    BADOPT(*end || (port <= 0) || (port > 65535), "bad port '%s'\n", argv[optind]);
+    opt_port = port;
+  }
+
+  char *routing[] = {
+    "up", "lo", ",",
+    "rule", "fwmark", opt_mark, "table", opt_table, ",",
+    "route", "local", "0.0.0.0/0", "dev", "lo", "table", opt_table,
+  };
+
+  int count = sizeof(routing)/sizeof(char *);
+
+  /* routing is in place before anything is marked, and stays until
+     nothing is */
+  if (opt_delete) {
+    int failed = delete_nft();
+    return (net_apply(count-3, routing+3, 1, 0) || failed)?EXIT_FAILURE:EXIT_SUCCESS;
+  }
+
+  /* what an earlier run left is replaced, a second rule would only
+     shadow the first */
+  net_apply(count-3, routing+3, 1, 1);
+
+  if (net_apply(count, routing, 0, 0)) {
+    return EXIT_FAILURE;
+  }
+
+  /* without the rules the routing is of no use, and would keep
+     marked traffic of someone else local */
+  if (install_nft(mark)) {
+    net_apply(count-3, routing+3, 1, 1);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+err:
+  fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
+  exit(EXIT_FAILURE);
+}
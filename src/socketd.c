@@ -23,24 +23,102 @@ static void show_usage() {
 }
 
 
-static int handle_connection(int fd) {
-  for(;;) {
-    char sock_type = 0;
-    ssize_t recv_len;
-    PERROR(==-1, recv_len = recv, fd, &sock_type, 1, 0);
+#define MAX_CLIENTS    1024
+#define MAX_EVENTS     64
+#define REQUEST_BUFFER 256
+
+
+/* Requests are read ahead into a small fixed buffer. While an answer
+   cannot be sent, nothing more is read from that client, so memory
+   stays bounded by MAX_CLIENTS no matter how much a client asks for. */
+struct client {
+  int fd;
+  int blocked;
+  int closing;
+  size_t start;
+  size_t end;
+  unsigned char requests[REQUEST_BUFFER];
+  struct client *next;
+};
 
-    if (recv_len == 0) {
-      break;
+
+static void epoll_set(int poll_fd, int op, int fd, uint32_t events, void *ptr) {
+  struct epoll_event event = {
+    .events = events,
+    .data = {
+      .ptr = ptr
+    }
+  };
+
+  PERROR(==-1, epoll_ctl, poll_fd, op, fd, &event);
+}
+
+
+/* Answers every complete request in the buffer. Returns -1 if the
+   client has to be dropped. */
+static int serve_requests(struct client *client) {
+  while (client->start < client->end) {
+    unsigned char sock_type = client->requests[client->start];
+    unsigned char count = 1;
+    size_t length = 1;
+
+    if (sock_type & SOCKETD_BATCH) {
+      if (client->end - client->start < 2) {
+        break;
+      }
+
+      sock_type &= ~SOCKETD_BATCH;
+      count = client->requests[client->start+1];
+      length = 2;
+
+      if ((count == 0) || (count > SOCKETD_MAX_FDS)) {
+        LOG("bad socket count %d\n", count);
+        return -1;
+      }
     }
 
-    ERROR((sock_type != SOCK_STREAM)&&(sock_type != SOCK_DGRAM), "bad socket type\n");
-    int sock_fd = -1;
-    PERROR(==-1, sock_fd = socket, AF_INET, sock_type, 0);
-    send_fd(fd, sock_fd);
-    close(sock_fd);
+    if ((sock_type != SOCK_STREAM) && (sock_type != SOCK_DGRAM)) {
+      LOG("bad socket type\n");
+      return -1;
+    }
+
+    int sock_fds[SOCKETD_MAX_FDS];
+    int created = 0;
+
+    for(; created<count; created++) {
+      if ((sock_fds[created] = socket(AF_INET, sock_type, 0)) == -1) {
+        break;
+      }
+    }
+
+    int sent = (created == count)?send_fds(client->fd, sock_fds, count, MSG_DONTWAIT):-1;
+    int error = errno;
+
+    for(int i=0; i<created; i++) {
+      close(sock_fds[i]);
+    }
+
+    if (created < count) {
+      LOG("socket: %s\n", strerror(error));
+      return -1;
+    }
+
+    if (sent == -1) {
+      if ((error == EAGAIN) || (error == EWOULDBLOCK)) {
+        /* the sockets are made again once the client reads */
+        client->blocked = 1;
+        break;
+      }
+
+      return -1;
+    }
+
+    client->start += length;
   }
 
-  close(fd);
+  memmove(client->requests, client->requests+client->start, client->end-client->start);
+  client->end -= client->start;
+  client->start = 0;
   return 0;
 }
 
@@ -48,22 +126,126 @@ static int handle_connection(int fd) {
 static int socketd(int listen_fd) {
   PERROR(==-1, listen, listen_fd, SOMAXCONN);
 
-  for(;;) {
-    int fd = -1;
+  int flags = -1;
+  PERROR(==-1, flags = fcntl, listen_fd, F_GETFL);
+  PERROR(==-1, fcntl, listen_fd, F_SETFL, flags|O_NONBLOCK);
+
+  int poll_fd = -1;
+  PERROR(==-1, poll_fd = epoll_create1, EPOLL_CLOEXEC);
+  epoll_set(poll_fd, EPOLL_CTL_ADD, listen_fd, EPOLLIN, NULL);
+
+  int client_count = 0;
+  int accepting = 1;
+
+  /* clients are freed only after the whole batch of events is handled,
+     so a stale event never refers to freed memory */
+  struct client *closed = NULL;
+
+  void close_client(struct client *client) {
+    if (client->closing) {
+      return;
+    }
+
+    client->closing = 1;
+    close(client->fd);
+    client->next = closed;
+    closed = client;
+    client_count -= 1;
 
-    struct sockaddr_un peer;
-    socklen_t size = sizeof(struct sockaddr_un);
-    pid_t pid;
+    if (!accepting) {
+      epoll_set(poll_fd, EPOLL_CTL_MOD, listen_fd, EPOLLIN, NULL);
+      accepting = 1;
+    }
+  }
 
-    PERROR(==-1, fd = accept, listen_fd, &peer, &size);
-    PERROR(==-1, pid = fork);
+  /* stops accepting while full or out of fds, instead of spinning on
+     a listening socket that stays readable */
+  void accept_clients() {
+    while (client_count < MAX_CLIENTS) {
+      int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+      if (fd == -1) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR) || (errno == ECONNABORTED)) {
+          return;
+        }
+
+        ERROR((errno != EMFILE) && (errno != ENFILE), "accept: %s\n", strerror(errno));
+        LOG("accept: %s\n", strerror(errno));
+        break;
+      }
+
+      struct client *client = calloc(1, sizeof(struct client));
+      if (!client) {
+        close(fd);
+        break;
+      }
+
+      client->fd = fd;
+      epoll_set(poll_fd, EPOLL_CTL_ADD, fd, EPOLLIN, client);
+      client_count += 1;
+    }
 
-    if (pid == 0) {
-      close(listen_fd);
-      return handle_connection(fd);
+    if (client_count) {
+      epoll_set(poll_fd, EPOLL_CTL_MOD, listen_fd, 0, NULL);
+      accepting = 0;
     }
+  }
 
-    close(fd);
+  void handle_event(struct client *client, uint32_t events) {
+    if (client->blocked) {
+      if (!(events & (EPOLLOUT|EPOLLERR|EPOLLHUP))) {
+        return;
+      }
+
+      client->blocked = 0;
+    } else {
+      ssize_t received = recv(client->fd, client->requests+client->end, REQUEST_BUFFER-client->end, 0);
+
+      if (received == 0) {
+        close_client(client);
+        return;
+      }
+
+      if (received == -1) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+          close_client(client);
+        }
+        return;
+      }
+
+      client->end += received;
+    }
+
+    if (serve_requests(client) == -1) {
+      close_client(client);
+      return;
+    }
+
+    epoll_set(poll_fd, EPOLL_CTL_MOD, client->fd, client->blocked?EPOLLOUT:EPOLLIN, client);
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+
+  for(;;) {
+    int nfds;
+    RETRY_ON_INTR(nfds = epoll_wait, poll_fd, events, MAX_EVENTS, -1);
+    ERROR(nfds == -1, "epoll_wait: %s\n", strerror(errno));
+
+    for(int i=0; i<nfds; i++) {
+      struct client *client = events[i].data.ptr;
+
+      if (!client) {
+        accept_clients();
+      } else if (!client->closing) {
+        handle_event(client, events[i].events);
+      }
+    }
+
+    while (closed) {
+      struct client *client = closed;
+      closed = client->next;
+      free(client);
+    }
   }
 
   return EXIT_FAILURE;
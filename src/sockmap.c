@@ -0,0 +1,149 @@
+#include "global.h"
+
+
+/* A BPF sockhash with an sk_skb verdict program, driven through the
+   raw bpf(2) syscall. Each socket is stored under the cookie of its
+   peer, so the program looks up its own cookie and sends the data
+   out of the socket found there. */
+
+
+#define INSN(op, dst, src, offset, value) \
+  ((struct bpf_insn){.code = (op), .dst_reg = (dst), .src_reg = (src), .off = (offset), .imm = (value)})
+
+
+static int bpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+static int load_verdict(int map_fd) {
+  struct bpf_insn insns[] = {
+    /* an empty skb carries a FIN, which is passed on by shutdown() */
+    INSN(BPF_LDX|BPF_MEM|BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct __sk_buff, len), 0),
+    INSN(BPF_JMP|BPF_JNE|BPF_K, BPF_REG_2, 0, 2, 0),
+    INSN(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_0, 0, 0, SK_DROP),
+    INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0),
+    /* r6 = skb */
+    INSN(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+    /* *(u64 *)(r10-8) = bpf_get_socket_cookie(skb) */
+    INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+    INSN(BPF_STX|BPF_MEM|BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+    /* return bpf_sk_redirect_hash(skb, map, r10-8, 0) */
+    INSN(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+    INSN(BPF_LD|BPF_DW|BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map_fd),
+    INSN(0, 0, 0, 0, 0),
+    INSN(BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+    INSN(BPF_ALU64|BPF_ADD|BPF_K, BPF_REG_3, 0, 0, -8),
+    INSN(BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_4, 0, 0, 0),
+    INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+    INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0),
+  };
+
+  static char log[4096];
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+  attr.insns = (uintptr_t)insns;
+  attr.insn_cnt = sizeof(insns)/sizeof(struct bpf_insn);
+  attr.license = (uintptr_t)"GPL";
+  attr.log_buf = (uintptr_t)log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+
+  int prog_fd = bpf(BPF_PROG_LOAD, &attr);
+  if ((prog_fd == -1) && log[0]) {
+    VERBOSE("bpf verifier:\n%s", log);
+  }
+
+  return prog_fd;
+}
+
+
+int sockmap_init(struct sockmap *map, int size) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+  attr.key_size = sizeof(uint64_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = size;
+
+  map->prog_fd = -1;
+  map->map_fd = bpf(BPF_MAP_CREATE, &attr);
+  if (map->map_fd == -1) {
+    return -1;
+  }
+
+  map->prog_fd = load_verdict(map->map_fd);
+  if (map->prog_fd == -1) {
+    close(map->map_fd);
+    return -1;
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.target_fd = map->map_fd;
+  attr.attach_bpf_fd = map->prog_fd;
+  attr.attach_type = BPF_SK_SKB_STREAM_VERDICT;
+
+  if (bpf(BPF_PROG_ATTACH, &attr) == -1) {
+    int error = errno;
+    close(map->prog_fd);
+    close(map->map_fd);
+    errno = error;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static int get_cookie(int fd, uint64_t *cookie) {
+  socklen_t optlen = sizeof(*cookie);
+  return getsockopt(fd, SOL_SOCKET, SO_COOKIE, cookie, &optlen);
+}
+
+
+static int map_update(struct sockmap *map, uint64_t *key, int fd) {
+  uint32_t value = fd;
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map->map_fd;
+  attr.key = (uintptr_t)key;
+  attr.value = (uintptr_t)&value;
+  attr.flags = BPF_NOEXIST;
+  return bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+
+static void map_delete(struct sockmap *map, uint64_t *key) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map->map_fd;
+  attr.key = (uintptr_t)key;
+  bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+
+/* From now on the kernel forwards what either socket receives to the
+   other. A socket leaves the map when it is closed. */
+int sockmap_pair(struct sockmap *map, int a_fd, int b_fd) {
+  uint64_t a_cookie, b_cookie;
+
+  if ((get_cookie(a_fd, &a_cookie) == -1) || (get_cookie(b_fd, &b_cookie) == -1) ||
+      (map_update(map, &b_cookie, a_fd) == -1)) {
+    return -1;
+  }
+
+  if (map_update(map, &a_cookie, b_fd) == -1) {
+    int error = errno;
+    map_delete(map, &b_cookie);
+    errno = error;
+    return -1;
+  }
+
+  /* the program only runs when data arrives, setting the low mark
+     wakes it up for what was queued before the sockets were added */
+  int lowat = 1;
+  setsockopt(a_fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+  setsockopt(b_fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+  return 0;
+}
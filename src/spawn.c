@@ -3,6 +3,8 @@
 
 #define OPT_USERNS 0
 #define OPT_NETNS 1
+#define OPT_INIT 2
+#define OPT_FROM_POOL 3
 
 
 static char* opt_name = NULL;
@@ -10,6 +12,8 @@ static char* opt_domain = NULL;
 static int opt_userns = 0;
 static int opt_netns = 0;
 static char *opt_netns_name = NULL;
+static int opt_init = 0;
+static char *opt_pool = NULL;
 static int netns_fd = -1;
 static FILE *pid_file = NULL;
 
@@ -19,6 +23,8 @@ static struct option options[] = {
   {"domain",       optional_argument, NULL, 'd'},
   {"user",         no_argument,       NULL, OPT_USERNS},
   {"net",          optional_argument, NULL, OPT_NETNS},
+  {"init",         no_argument,       NULL, OPT_INIT},
+  {"from-pool",    required_argument, NULL, OPT_FROM_POOL},
   {"help",         no_argument,       NULL, 'h'},
 
   {NULL,           no_argument,       NULL, 0}
@@ -32,6 +38,8 @@ static void show_usage() {
          "  -d, --domain=DOMAIN        domain of the namespace\n"
          "      --user                 new USER namespace\n"
          "      --net[=NETNS]          new NET namespace, or use NETNS\n"
+         "      --init                 set up mounts and environment inside\n"
+         "      --from-pool=POOL       take an idle namespace from POOL\n"
          "\n"
          "  -h, --help                 print help message and exit\n"
          );
@@ -62,7 +70,7 @@ static void deny_setgroups(pid_t pid) {
 }
 
 
-static void unshare_user() {
+void unshare_user() {
   char mapping[25] = {0};
 
   uid_t uid = geteuid();
@@ -83,7 +91,81 @@ static void unshare_user() {
 }
 
 
-static int ns_main(void *arg) {
+/* Signals sent with kill() are passed on to the child, those the
+   terminal sends already reach it through the process group. */
+static int const forwarded_signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2};
+
+
+static sigset_t saved_mask;
+
+
+/* Blocked for the whole life of the supervisors, the command gets
+   the mask from before. */
+static void block_signals() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+
+  for(size_t i=0; i<sizeof(forwarded_signals)/sizeof(int); i++) {
+    sigaddset(&mask, forwarded_signals[i]);
+  }
+
+  PERROR(==-1, sigprocmask, SIG_BLOCK, &mask, &saved_mask);
+}
+
+
+/* Waits for the child behind pidfd and returns its exit status.
+   Orphans are reaped on the way, as init of a PID namespace has to.
+   Signals must have been blocked with block_signals(). */
+static int supervise(pid_t pid, int pidfd) {
+  sigset_t mask;
+  PERROR(==-1, sigprocmask, SIG_BLOCK, NULL, &mask);
+
+  int signal_fd = -1;
+  PERROR(==-1, signal_fd = signalfd, -1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+
+  struct pollfd pfds[2] = {
+    {.fd = pidfd, .events = POLLIN},
+    {.fd = signal_fd, .events = POLLIN},
+  };
+
+  for(;;) {
+    int ready;
+    RETRY_ON_INTR(ready = poll, pfds, 2, -1);
+    ERROR(ready == -1, "poll: %s\n", strerror(errno));
+
+    if (pfds[0].revents) {
+      int status = wait_pidfd(pidfd);
+      close(pidfd);
+      close(signal_fd);
+      return status;
+    }
+
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+      if (info.ssi_signo == SIGCHLD) {
+        /* the child itself is left to the pidfd */
+        for(;;) {
+          siginfo_t child = {0};
+          if ((waitid(P_ALL, 0, &child, WEXITED|WNOHANG|WNOWAIT) == -1) ||
+              (child.si_pid == 0) || (child.si_pid == pid)) {
+            break;
+          }
+
+          waitpid(child.si_pid, NULL, 0);
+        }
+      } else if ((info.ssi_code == SI_USER) || (info.ssi_code == SI_QUEUE)) {
+        VERBOSE("passing signal %d on to %ld\n", info.ssi_signo, (long)pid);
+        signal_pidfd(pidfd, info.ssi_signo);
+      }
+    }
+  }
+
+  return EXIT_FAILURE;
+}
+
+
+static int ns_main(char *const argv[]) {
   fclose(pid_file);
 
   if (opt_netns_name) {
@@ -99,64 +181,48 @@ static int ns_main(void *arg) {
   VERBOSE("setting new domainname\n");
   PERROR(==-1, setdomainname, opt_domain, strlen(opt_domain));
 
+  if (opt_init) {
+    init_ns();
+  }
+
+  int pidfd = -1;
   pid_t pid = -1;
-  PERROR(==-1, pid = fork);
+  PERROR(==-1, pid = clone_pidfd, 0, &pidfd);
 
   if (pid == 0) {
-    char **argv = (char **)arg;
+    PERROR(==-1, sigprocmask, SIG_SETMASK, &saved_mask, NULL);
     VERBOSE("exec '%s'\n", argv[0]);
     PERROR(==-1, execvp, argv[0], argv);
     return EXIT_FAILURE;
   }
 
-  for(;;) {
-    pid_t child_pid = -1;
-    int status;
-
-    child_pid = waitpid(-1, &status, 0);
-
-    if (child_pid == pid) {
-      if (WIFSTOPPED(status)) {
-        continue;
-      }
-
-      if(WIFSIGNALED(status)) {
-        return WTERMSIG(status)+128;
-      } else {
-        return WEXITSTATUS(status);
-      }
-    }
+  return supervise(pid, pidfd);
+}
 
-    if (child_pid == -1) {
-      fprintf(stderr, "waitpid failed: %s\n", strerror(errno));
-      exit(EXIT_FAILURE);
-    }
-  }
 
-  return EXIT_FAILURE;
+/* The pid file holds the pid and its start time, attach checks both
+   so a reused pid is never mistaken for the namespace. */
+static void write_pid_file(pid_t pid) {
+  fprintf(pid_file, "%ld %llu", (long)pid, proc_start_time(pid));
+  fflush(pid_file);
 }
 
 
-static int spawn_process(char *const argv[]) {
+static pid_t spawn_process(char *const argv[], int *pidfd) {
   int flags = CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC | CLONE_NEWPID;
 
   if (opt_netns && (!opt_netns_name)) {
     flags |= CLONE_NEWNET;
   }
 
-  long pagesize = sysconf(_SC_PAGESIZE);
-  void *stack = alloca(pagesize);
-
   pid_t pid = -1;
-  PERROR(== -1,
-         pid = clone,
-         ns_main,
-         stack+pagesize, /* XXX: magic number do not know why */
-         flags|SIGCHLD|CLONE_CHILD_SETTID|CLONE_CHILD_CLEARTID,
-         (void*)argv);
-
-  fprintf(pid_file, "%ld", (long)pid);
-  fflush(pid_file);
+  PERROR(==-1, pid = clone_pidfd, flags, pidfd);
+
+  if (pid == 0) {
+    exit(ns_main(argv));
+  }
+
+  write_pid_file(pid);
 
   if (opt_netns_name) {
     close(netns_fd);
@@ -166,6 +232,38 @@ static int spawn_process(char *const argv[]) {
 }
 
 
+/* The namespace comes from 'userns pool', already set up. It runs
+   argv on our stdio, takes our signals as execd does, and sends back
+   the exit status. */
+static int claim_from_pool(char const *rundir, char *const argv[]) {
+  char socket_path[PATH_MAX] = {0};
+  snprintf(socket_path, PATH_MAX, "%s/userns/%s/pool", rundir, opt_pool);
+
+  int fd = -1;
+  PERROR(==-1, fd = socket, AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+  PERROR(==-1, connect, fd, &addr, sizeof(addr));
+
+  int32_t pid = -1;
+  ERROR(recv(fd, &pid, sizeof(pid), MSG_WAITALL) != sizeof(pid),
+        "pool '%s' did not hand out a namespace\n", opt_pool);
+
+  write_pid_file(pid);
+
+  int signal_fd = watch_forwarded_signals();
+  send_exec_request(fd, opt_name, argv);
+
+  close(STDIN_FILENO);
+  close(STDOUT_FILENO);
+
+  int32_t status = EXIT_FAILURE;
+  ERROR(wait_exec_status(fd, signal_fd, &status) == -1, "namespace %ld went away\n", (long)pid);
+  return status;
+}
+
+
 int cmd_spawn(int argc, char *const argv[]) {
   int opt, index;
 
@@ -195,12 +293,22 @@ int cmd_spawn(int argc, char *const argv[]) {
       opt_netns_name = optarg;
       break;
 
+    case OPT_INIT:
+      opt_init = 1;
+      break;
+
+    case OPT_FROM_POOL:
+      opt_pool = optarg;
+      break;
+
     default:
       break;
     }
   }
 
   BADOPT(!opt_name, "missing name\n");
+  BADOPT(opt_pool && (opt_userns || opt_netns || opt_init),
+         "--from-pool cannot be combined with --user, --net or --init\n");
 
   opt_domain = (opt_domain)?opt_domain:getenv("USERNS_DOMAIN");
   opt_domain = (opt_domain)?opt_domain:"localdomain";
@@ -225,9 +333,15 @@ int cmd_spawn(int argc, char *const argv[]) {
   PERROR(==-1, pid_fd = openat, dirfd, "pid", O_CREAT|O_WRONLY, 0700);
   close(dirfd);
 
+  /* truncated only once locked, not to clobber a running namespace's */
   PERROR(==-1, flock, pid_fd, LOCK_EX|LOCK_NB);
+  PERROR(==-1, ftruncate, pid_fd, 0);
   pid_file = fdopen(pid_fd, "w");
 
+  if (opt_pool) {
+    return claim_from_pool(rundir, make_argv(optind, argc, argv));
+  }
+
   if (opt_netns_name) {
     char netns_fd_path[PATH_MAX] = {0};
     snprintf(netns_fd_path, PATH_MAX, "/var/run/netns/%s", opt_netns_name);
@@ -239,27 +353,15 @@ int cmd_spawn(int argc, char *const argv[]) {
     unshare_user();
   }
 
-  pid_t pid = spawn_process(make_argv(optind, argc, argv));
+  block_signals();
+
+  int pidfd = -1;
+  pid_t pid = spawn_process(make_argv(optind, argc, argv), &pidfd);
 
   close(STDIN_FILENO);
   close(STDOUT_FILENO);
 
-  for(;;) {
-    int status;
-    PERROR(==-1, waitpid, pid, &status, 0);
-
-    if (WIFSTOPPED(status)) {
-      continue;
-    }
-
-    if (WIFSIGNALED(status)) {
-      return WTERMSIG(status) + 128;
-    } else {
-      return WEXITSTATUS(status);
-    }
-  }
-
-  return EXIT_FAILURE;
+  return supervise(pid, pidfd);
 err:
   fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
   exit(EXIT_FAILURE);
@@ -0,0 +1,260 @@
+#include "global.h"
+
+
+static int opt_slow = 0;
+
+
+static struct option options[] = {
+  {"slow",         no_argument,       NULL, 's'},
+  {"help",         no_argument,       NULL, 'h'},
+
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options] name\n", executable, cmd_name);
+  printf("\n"
+         "  -s, --slow                 list the latest slow or failed tcp setups\n"
+	 "  -h, --help                 print help message and exit\n"
+	 );
+  exit(0);
+}
+
+
+static int is_stats_file(struct dirent const *entry) {
+  size_t len = strlen(entry->d_name);
+  return ((strncmp(entry->d_name, "proxy-", 6) == 0) &&
+          (len > 6) &&
+          (strcmp(entry->d_name + len - 6, ".stats") == 0));
+}
+
+
+static uint64_t load(uint64_t const *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+
+static char const *stage_names[PROXY_STAGES] = {
+  [STAGE_ACCEPT] = "accept",
+  [STAGE_SOCKET] = "socket",
+  [STAGE_CONNECT] = "connect",
+  [STAGE_FIRST_BYTE] = "first_byte",
+  [STAGE_SETUP] = "setup",
+};
+
+
+static void format_us(char *str, size_t size, uint64_t us) {
+  if (us < 1000) {
+    snprintf(str, size, "%lluus", (unsigned long long)us);
+  } else if (us < 1000000) {
+    snprintf(str, size, "%.1fms", us / 1000.0);
+  } else {
+    snprintf(str, size, "%.2fs", us / 1000000.0);
+  }
+}
+
+
+/* the upper bound of the bucket holding the permille-th latency */
+static uint64_t percentile(uint64_t const *buckets, uint64_t count, int permille) {
+  uint64_t seen = 0;
+
+  for(int i=0; i<PROXY_HIST_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen * 1000 >= count * permille) {
+      return 1ULL << i;
+    }
+  }
+
+  return 1ULL << (PROXY_HIST_BUCKETS - 1);
+}
+
+
+static void show_histograms(uint64_t hist[PROXY_STAGES][PROXY_HIST_BUCKETS]) {
+  uint64_t count = 0;
+  for(int i=0; i<PROXY_HIST_BUCKETS; i++) {
+    count += hist[STAGE_SETUP][i];
+  }
+
+  if (!count) {
+    return;
+  }
+
+  printf("  %-24s %9s %9s %9s\n", "latency", "p50", "p99", "p999");
+
+  for(int stage=0; stage<PROXY_STAGES; stage++) {
+    char p50[16], p99[16], p999[16];
+    format_us(p50, sizeof(p50), percentile(hist[stage], count, 500));
+    format_us(p99, sizeof(p99), percentile(hist[stage], count, 990));
+    format_us(p999, sizeof(p999), percentile(hist[stage], count, 999));
+    printf("  %-24s %9s %9s %9s\n", stage_names[stage], p50, p99, p999);
+  }
+}
+
+
+static void show_slow(struct proxy_counters const *c) {
+  uint64_t head = __atomic_load_n(&(c->slow_head), __ATOMIC_ACQUIRE);
+  uint64_t first = (head > PROXY_SLOW_RING)?(head - PROXY_SLOW_RING):0;
+
+  for(uint64_t n=first; n<head; n++) {
+    struct proxy_slow_conn const *entry = &(c->slow[n % PROXY_SLOW_RING]);
+
+    char when[32];
+    time_t time = entry->time;
+    strftime(when, sizeof(when), "%F %T", localtime(&time));
+
+    struct in_addr addr = {.s_addr = entry->addr};
+    printf("  %s %s:%d", when, inet_ntoa(addr), ntohs(entry->port));
+
+    for(int stage=0; stage<PROXY_STAGES; stage++) {
+      char value[16];
+      format_us(value, sizeof(value), entry->stage_us[stage]);
+      printf(" %s=%s", stage_names[stage], value);
+    }
+
+    if (entry->error) {
+      printf(" error=%s", strerror(entry->error));
+    }
+
+    printf("\n");
+  }
+}
+
+
+/* Sums the slots of all workers. The segment is only read, and the
+   lock is only tested, so the proxy never notices. */
+static void show_stats(int dir_fd, char const *filename) {
+  int fd = openat(dir_fd, filename, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    LOG("cannot open '%s': %s\n", filename, strerror(errno));
+    return;
+  }
+
+  struct stat st;
+  struct proxy_stats *segment = MAP_FAILED;
+
+  if ((fstat(fd, &st) == -1) || ((size_t)st.st_size < sizeof(struct proxy_stats)) ||
+      ((segment = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) ||
+      (__atomic_load_n(&(segment->magic), __ATOMIC_ACQUIRE) != PROXY_STATS_MAGIC) ||
+      (sizeof(struct proxy_stats) + sizeof(struct proxy_counters) * segment->workers > (size_t)st.st_size)) {
+    LOG("'%s' is not a proxy stats file\n", filename);
+    if (segment != MAP_FAILED) {
+      munmap(segment, st.st_size);
+    }
+    close(fd);
+    return;
+  }
+
+  /* a read lock conflicts with the write lock a running proxy holds */
+  struct flock lock = {.l_type = F_RDLCK, .l_whence = SEEK_SET};
+  int running = (fcntl(fd, F_OFD_GETLK, &lock) == -1) || (lock.l_type != F_UNLCK);
+
+  static struct proxy_counters total;
+  memset(&total, 0, sizeof(total));
+
+  for(uint32_t i=0; i<segment->workers; i++) {
+    struct proxy_counters const *c = &(segment->counters[i]);
+    total.conns_total += load(&(c->conns_total));
+    total.conns_closed += load(&(c->conns_closed));
+    total.bytes_out += load(&(c->bytes_out));
+    total.bytes_in += load(&(c->bytes_in));
+    total.udp_flows_total += load(&(c->udp_flows_total));
+    total.udp_flows_evicted += load(&(c->udp_flows_evicted));
+    total.socketd_requests += load(&(c->socketd_requests));
+    total.socketd_sockets += load(&(c->socketd_sockets));
+    total.connect_errors += load(&(c->connect_errors));
+    total.errors += load(&(c->errors));
+
+    for(int stage=0; stage<PROXY_STAGES; stage++) {
+      for(int j=0; j<PROXY_HIST_BUCKETS; j++) {
+        total.hist[stage][j] += load(&(c->hist[stage][j]));
+      }
+    }
+  }
+
+  printf("%.*s %d %s, %u worker%s\n",
+         (int)sizeof(segment->proto), segment->proto, segment->port,
+         running?"running":"not running",
+         segment->workers, (segment->workers == 1)?"":"s");
+
+  void show(char const *what, uint64_t value) {
+    printf("  %-24s %llu\n", what, (unsigned long long)value);
+  }
+
+  if (strncmp(segment->proto, "udp", sizeof(segment->proto))) {
+    show("connections.active", total.conns_total - total.conns_closed);
+    show("connections.total", total.conns_total);
+    show("connections.errors", total.connect_errors);
+  } else {
+    show("udp_flows.active", total.udp_flows_total - total.udp_flows_evicted);
+    show("udp_flows.total", total.udp_flows_total);
+    show("udp_flows.evicted", total.udp_flows_evicted);
+  }
+
+  show("bytes.to_upstream", total.bytes_out);
+  show("bytes.from_upstream", total.bytes_in);
+  show("socketd.requests", total.socketd_requests);
+  show("socketd.sockets", total.socketd_sockets);
+  show("errors", total.errors);
+  show_histograms(total.hist);
+
+  if (opt_slow) {
+    for(uint32_t i=0; i<segment->workers; i++) {
+      show_slow(&(segment->counters[i]));
+    }
+  }
+
+  munmap(segment, st.st_size);
+  close(fd);
+}
+
+
+int cmd_stats(int argc, char *const argv[]) {
+  int opt, index;
+
+  while((opt = getopt_long(argc, argv, "+sh", options, &index)) != -1) {
+    switch(opt) {
+    case '?':
+      goto err;
+
+    case 'h':
+      show_usage();
+      break;
+
+    case 's':
+      opt_slow = 1;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  BADOPT(optind >= argc, "missing name\n");
+  BADOPT(argc-optind > 1, "Too many arguments\n");
+
+  char *rundir = getenv("XDG_RUNTIME_DIR");
+  ERROR(!rundir, "environment XDG_RUNTIME_DIR is not set\n");
+
+  char dirname[PATH_MAX] = {0};
+  snprintf(dirname, PATH_MAX, "%s/userns/%s", rundir, argv[optind]);
+
+  int dir_fd = -1;
+  PERROR(==-1, dir_fd = open, dirname, O_PATH|O_DIRECTORY|O_CLOEXEC);
+
+  struct dirent **entries = NULL;
+  int count;
+  PERROR(==-1, count = scandir, dirname, &entries, is_stats_file, alphasort);
+
+  for(int i=0; i<count; i++) {
+    show_stats(dir_fd, entries[i]->d_name);
+    free(entries[i]);
+  }
+
+  free(entries);
+  close(dir_fd);
+  return 0;
+err:
+  fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
+  exit(EXIT_FAILURE);
+}
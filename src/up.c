@@ -0,0 +1,686 @@
+#include "global.h"
+
+
+#define TASK_WAITING 0
+#define TASK_RUNNING 1
+#define TASK_DONE    2
+
+#define MAX_JOBS     1024
+
+/* how long a namespace has to exit on SIGTERM before it is killed */
+#define STOP_TIMEOUT_MS 5000
+
+
+static int opt_jobs = 16;
+
+
+static struct option options[] = {
+  {"jobs",         required_argument, NULL, 'j'},
+  {"help",         no_argument,       NULL, 'h'},
+
+  {NULL,           no_argument,       NULL, 0}
+};
+
+
+static void show_usage() {
+  printf("Usage: %s %s [options] manifest\n", executable, cmd_name);
+  printf("\n"
+         "  -j, --jobs=N               run up to N steps at once (default 16)\n"
+         "\n"
+         "  -h, --help                 print help message and exit\n"
+         "\n"
+         "Each line of the manifest is one of\n"
+         "\n"
+         "  ns NAME [spawn options] [-- command]\n"
+         "  link NAME:IFNAME NAME:IFNAME\n"
+         "  address NAME IFNAME ADDRESS/PREFIX\n"
+         "  route NAME ROUTE...\n"
+         "\n"
+         "Every namespace gets a netns of the same name, and runs execd\n"
+         "unless given a command. A link is a veth pair, ROUTE is as for\n"
+         "'net route'. Lines may come in any order, '#' starts a comment.\n"
+         );
+  exit(0);
+}
+
+
+/* A line of the manifest, split into words. */
+struct entry {
+  int line;
+  int count;
+  char **words;
+};
+
+
+/* The links of a namespace are created by link_task, in the netns of
+   the namespace and the netns of the other ends. Then config_task
+   sets up everything inside, each with one 'net' command. */
+struct ns {
+  char *name;
+  int netns_task;
+  int link_task;
+  int config_task;
+};
+
+
+/* A step of bringing the namespaces up or down. It either runs argv
+   to completion, or brings down the namespace called stop. */
+struct task {
+  char **argv;
+  char *stop;
+  int detach;
+  int ns;
+  int line;
+  int pending;
+  int state;
+  int pidfd;
+  long long deadline;
+};
+
+
+struct edge {
+  int from;
+  int to;
+};
+
+
+static char const *manifest = NULL;
+static char self_path[PATH_MAX] = {0};
+
+static struct entry *entries = NULL;
+static int entry_count = 0;
+static struct ns *namespaces = NULL;
+static int ns_count = 0;
+static struct task *tasks = NULL;
+static int task_count = 0;
+static struct edge *edges = NULL;
+static int edge_count = 0;
+
+
+/* Makes room for one more element, doubling the array each time count
+   reaches a power of two. */
+static void *grow(void *array, int count, size_t size) {
+  if (count & (count-1)) {
+    return array;
+  }
+
+  array = realloc(array, (count?count*2:1) * size);
+  ERROR(!array, "out of memory\n");
+  return array;
+}
+
+
+static void read_manifest() {
+  FILE *file = fopen(manifest, "re");
+  ERROR(!file, "cannot open '%s': %s\n", manifest, strerror(errno));
+
+  char *line = NULL;
+  size_t size = 0;
+
+  for(int number=1; getline(&line, &size, file) != -1; number++) {
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+
+    struct entry entry = {.line = number};
+    char *saveptr = NULL;
+
+    for(char *word = strtok_r(line, " \t\n", &saveptr); word; word = strtok_r(NULL, " \t\n", &saveptr)) {
+      entry.words = grow(entry.words, entry.count+1, sizeof(char *));
+      entry.words[entry.count++] = strdup(word);
+    }
+
+    if (!entry.count) {
+      continue;
+    }
+
+    entry.words[entry.count] = NULL;
+    entries = grow(entries, entry_count, sizeof(struct entry));
+    entries[entry_count++] = entry;
+  }
+
+  free(line);
+  fclose(file);
+}
+
+
+static int find_ns(struct entry *entry, char const *name) {
+  for(int i=0; i<ns_count; i++) {
+    if (!strcmp(namespaces[i].name, name)) {
+      return i;
+    }
+  }
+
+  ERROR(1, "%s:%d: no namespace called '%s'\n", manifest, entry->line, name);
+  return -1;
+}
+
+
+/* argv of a command, the words given, then count more from extra */
+static char **command(char **extra, int count, ...) {
+  va_list args;
+  char **argv = NULL;
+  int argc = 0;
+
+  va_start(args, count);
+  for(char *word = va_arg(args, char *); word; word = va_arg(args, char *)) {
+    argv = grow(argv, argc+1, sizeof(char *));
+    argv[argc++] = word;
+  }
+  va_end(args);
+
+  for(int i=0; i<count; i++) {
+    argv = grow(argv, argc+1, sizeof(char *));
+    argv[argc++] = extra[i];
+  }
+
+  argv = grow(argv, argc+1, sizeof(char *));
+  argv[argc] = NULL;
+  return argv;
+}
+
+
+static char **add_words(char **argv, char **words, int count) {
+  int argc = 0;
+  while (argv[argc]) {
+    argc += 1;
+  }
+
+  for(int i=0; i<count; i++) {
+    argv = grow(argv, argc+1, sizeof(char *));
+    argv[argc++] = words[i];
+  }
+
+  argv[argc] = NULL;
+  return argv;
+}
+
+
+/* Adds an operation to the 'net' command of task, its operations
+   follow a '--' and are separated by ','. */
+static void add_operation(int task, char **words, int count) {
+  char **argv = tasks[task].argv;
+  int argc = 0;
+
+  while (argv[argc]) {
+    argc += 1;
+  }
+
+  if (strcmp(argv[argc-1], "--")) {
+    argv = add_words(argv, (char *[]){","}, 1);
+  }
+
+  tasks[task].argv = add_words(argv, words, count);
+}
+
+
+static int add_task(struct entry *entry, int ns, char **argv) {
+  tasks = grow(tasks, task_count, sizeof(struct task));
+  tasks[task_count] = (struct task){.argv = argv, .ns = ns, .line = entry->line, .pidfd = -1};
+  return task_count++;
+}
+
+
+static void add_edge(int from, int to) {
+  edges = grow(edges, edge_count, sizeof(struct edge));
+  edges[edge_count++] = (struct edge){.from = from, .to = to};
+  tasks[to].pending += 1;
+}
+
+
+static int is_entry(struct entry *entry, char const *keyword, int min_count, int max_count) {
+  if (strcmp(entry->words[0], keyword)) {
+    return 0;
+  }
+
+  ERROR((entry->count < min_count) || (entry->count > max_count),
+        "%s:%d: wrong number of arguments to '%s'\n", manifest, entry->line, keyword);
+  return 1;
+}
+
+
+static void add_namespaces() {
+  for(int i=0; i<entry_count; i++) {
+    struct entry *entry = &(entries[i]);
+
+    if (!is_entry(entry, "ns", 2, INT_MAX)) {
+      continue;
+    }
+
+    char *name = entry->words[1];
+
+    for(int j=0; j<ns_count; j++) {
+      ERROR(!strcmp(namespaces[j].name, name),
+            "%s:%d: namespace '%s' given twice\n", manifest, entry->line, name);
+    }
+
+    namespaces = grow(namespaces, ns_count, sizeof(struct ns));
+    namespaces[ns_count].name = name;
+    namespaces[ns_count].netns_task = -1;
+    namespaces[ns_count].link_task = -1;
+    namespaces[ns_count].config_task = -1;
+    ns_count += 1;
+  }
+}
+
+
+/* Each namespace is spawned on a netns of its own, which is all the
+   other steps need, so spawning does not hold anything up. */
+static void plan_up() {
+  for(int i=0; i<entry_count; i++) {
+    struct entry *entry = &(entries[i]);
+
+    if (!is_entry(entry, "ns", 2, INT_MAX)) {
+      continue;
+    }
+
+    int ns = find_ns(entry, entry->words[1]);
+    char *name = namespaces[ns].name;
+
+    int netns = add_task(entry, ns, command(NULL, 0, "ip", "netns", "add", name, NULL));
+    namespaces[ns].netns_task = netns;
+
+    int options = 2;
+    while ((options < entry->count) && strcmp(entry->words[options], "--")) {
+      options += 1;
+    }
+
+    char *net_option = NULL;
+    ERROR(asprintf(&net_option, "--net=%s", name) == -1, "out of memory\n");
+
+    char *default_command[] = {self_path, "execd"};
+    char **args = (options < entry->count)?(entry->words+options+1):default_command;
+    int count = (options < entry->count)?(entry->count-options-1):2;
+    ERROR(!count, "%s:%d: missing command after '--'\n", manifest, entry->line);
+
+    char **argv = command(entry->words+2, options-2, self_path, "spawn", "-n", name, net_option, NULL);
+    argv = add_words(argv, (char *[]){"--"}, 1);
+    argv = add_words(argv, args, count);
+
+    int spawn = add_task(entry, ns, argv);
+    tasks[spawn].detach = 1;
+    add_edge(netns, spawn);
+
+    int config = add_task(entry, ns, command(NULL, 0, self_path, "net", "-n", name, "--", NULL));
+    namespaces[ns].config_task = config;
+    add_edge(netns, config);
+    add_operation(config, (char *[]){"up", "lo"}, 2);
+  }
+
+  for(int i=0; i<entry_count; i++) {
+    struct entry *entry = &(entries[i]);
+
+    if (!is_entry(entry, "link", 3, 3)) {
+      continue;
+    }
+
+    int ends[2];
+    char *names[2];
+
+    for(int j=0; j<2; j++) {
+      char *colon = strchr(entry->words[1+j], ':');
+      ERROR(!colon || !colon[1], "%s:%d: expected NAME:IFNAME, got '%s'\n",
+            manifest, entry->line, entry->words[1+j]);
+      *colon = '\0';
+      ends[j] = find_ns(entry, entry->words[1+j]);
+      names[j] = colon+1;
+    }
+
+    struct ns *owner = &(namespaces[ends[0]]);
+
+    if (owner->link_task == -1) {
+      owner->link_task = add_task(entry, ends[0], command(NULL, 0, self_path, "net", "-n", owner->name, "--", NULL));
+      add_edge(owner->netns_task, owner->link_task);
+    }
+
+    add_operation(owner->link_task, (char *[]){"veth", names[0], names[1], "netns", namespaces[ends[1]].name}, 5);
+    add_edge(namespaces[ends[1]].netns_task, owner->link_task);
+
+    for(int j=0; j<2; j++) {
+      add_operation(namespaces[ends[j]].config_task, (char *[]){"up", names[j]}, 2);
+      add_edge(owner->link_task, namespaces[ends[j]].config_task);
+    }
+  }
+
+  for(int i=0; i<entry_count; i++) {
+    struct entry *entry = &(entries[i]);
+
+    if (!is_entry(entry, "address", 4, 4)) {
+      continue;
+    }
+
+    int ns = find_ns(entry, entry->words[1]);
+    add_operation(namespaces[ns].config_task, (char *[]){"address", entry->words[2], entry->words[3]}, 3);
+  }
+
+  /* after the addresses, which gateways are reached through */
+  for(int i=0; i<entry_count; i++) {
+    struct entry *entry = &(entries[i]);
+
+    if (!is_entry(entry, "route", 3, INT_MAX)) {
+      ERROR(strcmp(entry->words[0], "ns") && strcmp(entry->words[0], "link") && strcmp(entry->words[0], "address"),
+            "%s:%d: unknown entry '%s'\n", manifest, entry->line, entry->words[0]);
+      continue;
+    }
+
+    int ns = find_ns(entry, entry->words[1]);
+    entry->words[1] = "route";
+    add_operation(namespaces[ns].config_task, entry->words+1, entry->count-1);
+  }
+}
+
+
+/* Links go away with their netns, which is deleted once nothing runs
+   in it any more. */
+static void plan_down() {
+  for(int i=0; i<entry_count; i++) {
+    struct entry *entry = &(entries[i]);
+
+    if (!is_entry(entry, "ns", 2, INT_MAX)) {
+      continue;
+    }
+
+    int ns = find_ns(entry, entry->words[1]);
+    char *name = namespaces[ns].name;
+
+    int stop = add_task(entry, ns, NULL);
+    tasks[stop].stop = name;
+
+    char netns_path[PATH_MAX] = {0};
+    snprintf(netns_path, PATH_MAX, "/var/run/netns/%s", name);
+
+    if (access(netns_path, F_OK) == 0) {
+      int netns = add_task(entry, ns, command(NULL, 0, "ip", "netns", "delete", name, NULL));
+      add_edge(stop, netns);
+    }
+  }
+}
+
+
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+/* Sends SIGTERM to the namespace spawned as name, spawn passes it on
+   to its command. Returns a pidfd polling readable once it has gone,
+   or -1 if it is not running. */
+static int stop_namespace(char const *name) {
+  char *rundir = getenv("XDG_RUNTIME_DIR");
+  char pid_filename[PATH_MAX] = {0};
+  snprintf(pid_filename, PATH_MAX, "%s/userns/%s/pid", rundir, name);
+
+  FILE *pid_file = fopen(pid_filename, "re");
+  if (!pid_file) {
+    return -1;
+  }
+
+  long pid = 0;
+  unsigned long long start_time = 0;
+  int fields = fscanf(pid_file, "%ld %llu", &pid, &start_time);
+  fclose(pid_file);
+
+  if ((fields < 1) || (pid <= 0)) {
+    return -1;
+  }
+
+  int pidfd = open_pidfd(pid);
+  if (pidfd == -1) {
+    return -1;
+  }
+
+  if ((fields == 2) && (proc_start_time(pid) != start_time)) {
+    close(pidfd);
+    return -1;
+  }
+
+  VERBOSE("stopping '%s'\n", name);
+  signal_pidfd(pidfd, SIGTERM);
+  return pidfd;
+}
+
+
+static void show_command(char **argv) {
+  char line[1024] = {0};
+  size_t length = 0;
+
+  for(char **arg = argv; *arg && (length < sizeof(line)); arg++) {
+    length += snprintf(line+length, sizeof(line)-length, "%s%s", (arg == argv)?"":" ", *arg);
+  }
+
+  LOG("%s\n", line);
+}
+
+
+/* A spawned namespace keeps running, in a session of its own with its
+   output going to a log file next to its pid file. */
+static void detach(int ns) {
+  char *rundir = getenv("XDG_RUNTIME_DIR");
+  char path[PATH_MAX] = {0};
+
+  snprintf(path, PATH_MAX, "%s/userns", rundir);
+  mkdir(path, 0700);
+  snprintf(path, PATH_MAX, "%s/userns/%s", rundir, namespaces[ns].name);
+  mkdir(path, 0700);
+  snprintf(path, PATH_MAX, "%s/userns/%s/log", rundir, namespaces[ns].name);
+
+  int fd = open(path, O_CREAT|O_WRONLY|O_APPEND|O_CLOEXEC, 0600);
+  if (fd == -1) {
+    fprintf(stderr, "%s: cannot open '%s': %s\n", executable, path, strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+  setsid();
+
+  pid_t pid = fork();
+  if (pid != 0) {
+    _exit((pid == -1)?EXIT_FAILURE:EXIT_SUCCESS);
+  }
+}
+
+
+/* Returns the pidfd the task is waited on with, or -1 if there was
+   nothing to wait for. */
+static int start_task(int i) {
+  struct task *task = &(tasks[i]);
+  task->state = TASK_RUNNING;
+
+  if (task->stop) {
+    task->pidfd = stop_namespace(task->stop);
+    task->deadline = now_ms() + STOP_TIMEOUT_MS;
+    return task->pidfd;
+  }
+
+  if (opt_verbose) {
+    show_command(task->argv);
+  }
+
+  pid_t pid = -1;
+  PERROR(==-1, pid = clone_pidfd, 0, &(task->pidfd));
+
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    if (null_fd != -1) {
+      dup2(null_fd, STDIN_FILENO);
+    }
+
+    if (task->detach) {
+      detach(task->ns);
+    }
+
+    execvp(task->argv[0], task->argv);
+    fprintf(stderr, "%s: cannot run '%s': %s\n", executable, task->argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  return task->pidfd;
+}
+
+
+/* Runs the tasks, at most opt_jobs at once, each as soon as the tasks
+   it waits for are done. After a failure no more tasks are started,
+   unless keep_going. */
+static int run_tasks(int keep_going) {
+  int *ready = calloc(task_count+1, sizeof(int));
+  int *slots = calloc(opt_jobs, sizeof(int));
+  struct pollfd *pfds = calloc(opt_jobs, sizeof(struct pollfd));
+  ERROR(!ready || !slots || !pfds, "out of memory\n");
+
+  int ready_head = 0, ready_tail = 0;
+  int running = 0, done = 0, failed = 0;
+
+  for(int i=0; i<task_count; i++) {
+    if (!tasks[i].pending) {
+      ready[ready_tail++] = i;
+    }
+  }
+
+  for(;;) {
+    int finished = -1;
+
+    while ((finished == -1) && (ready_head < ready_tail) && (running < opt_jobs) && (keep_going || !failed)) {
+      int i = ready[ready_head++];
+
+      if (start_task(i) == -1) {
+        finished = i;
+      } else {
+        slots[running++] = i;
+      }
+    }
+
+    if (finished == -1) {
+      if (!running) {
+        break;
+      }
+
+      long long timeout = -1;
+
+      for(int s=0; s<running; s++) {
+        pfds[s] = (struct pollfd){.fd = tasks[slots[s]].pidfd, .events = POLLIN};
+
+        if (tasks[slots[s]].stop && tasks[slots[s]].deadline) {
+          long long left = tasks[slots[s]].deadline - now_ms();
+          left = (left < 0)?0:left;
+          timeout = ((timeout == -1) || (left < timeout))?left:timeout;
+        }
+      }
+
+      int count;
+      RETRY_ON_INTR(count = poll, pfds, running, timeout);
+      ERROR(count == -1, "poll: %s\n", strerror(errno));
+
+      for(int s=0; s<running; s++) {
+        struct task *task = &(tasks[slots[s]]);
+
+        if (pfds[s].revents & POLLIN) {
+          finished = slots[s];
+          slots[s] = slots[--running];
+          break;
+        }
+
+        if (task->stop && task->deadline && (task->deadline <= now_ms())) {
+          LOG("'%s' did not stop, killing it\n", task->stop);
+          signal_pidfd(task->pidfd, SIGKILL);
+          task->deadline = 0;
+        }
+      }
+
+      if (finished == -1) {
+        continue;
+      }
+    }
+
+    struct task *task = &(tasks[finished]);
+    int status = 0;
+
+    if (task->pidfd != -1) {
+      status = task->stop?0:wait_pidfd(task->pidfd);
+      close(task->pidfd);
+      task->pidfd = -1;
+    }
+
+    task->state = TASK_DONE;
+    done += 1;
+
+    if (status) {
+      LOG("%s:%d: '%s' failed with status %d\n", manifest, task->line, task->argv[0], status);
+      failed = 1;
+      continue;
+    }
+
+    for(int e=0; e<edge_count; e++) {
+      if ((edges[e].from == finished) && !(--tasks[edges[e].to].pending)) {
+        ready[ready_tail++] = edges[e].to;
+      }
+    }
+  }
+
+  VERBOSE("%d of %d steps done\n", done, task_count);
+  free(ready);
+  free(slots);
+  free(pfds);
+  return (failed || (done < task_count))?EXIT_FAILURE:EXIT_SUCCESS;
+}
+
+
+static int up_or_down(int argc, char *const argv[], int up) {
+  int opt, index;
+
+  while((opt = getopt_long(argc, argv, "+j:h", options, &index)) != -1) {
+    switch(opt) {
+    case '?':
+      goto err;
+
+    case 'h':
+      show_usage();
+      break;
+
+    case 'j':
+      opt_jobs = atoi(optarg);
+      BADOPT((opt_jobs <= 0) || (opt_jobs > MAX_JOBS),
+             "jobs must be between 1 and %d\n", MAX_JOBS);
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  BADOPT(optind >= argc, "missing manifest\n");
+  BADOPT(optind+1 < argc, "Too many arguments\n");
+  manifest = argv[optind];
+
+  char *rundir = getenv("XDG_RUNTIME_DIR");
+  ERROR(!rundir, "environment XDG_RUNTIME_DIR is not set\n");
+
+  PERROR(==-1, readlink, "/proc/self/exe", self_path, sizeof(self_path)-1);
+
+  read_manifest();
+  add_namespaces();
+
+  if (up) {
+    plan_up();
+  } else {
+    plan_down();
+  }
+
+  return run_tasks(!up);
+err:
+  fprintf(stderr, "Try '%s %s --help'\n", executable, cmd_name);
+  exit(EXIT_FAILURE);
+}
+
+
+int cmd_up(int argc, char *const argv[]) {
+  return up_or_down(argc, argv, 1);
+}
+
+
+int cmd_down(int argc, char *const argv[]) {
+  return up_or_down(argc, argv, 0);
+}
@@ -0,0 +1,134 @@
+#include "global.h"
+
+
+/* A minimal io_uring, driven through the raw syscalls. */
+
+
+int uring_init(struct uring *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(struct uring));
+
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd == -1) {
+    return -1;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size = cq_size = (sq_size > cq_size)?sq_size:cq_size;
+  }
+
+  char *sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  char *cq = sq;
+
+  if ((sq != MAP_FAILED) && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+  if ((sq == MAP_FAILED) || (cq == MAP_FAILED) || (ring->sqes == MAP_FAILED)) {
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  ring->sqe_tail = *(ring->sq_tail);
+  return 0;
+}
+
+
+int uring_register(struct uring *ring, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr_args);
+}
+
+
+/* Returns -1 with errno set to EOPNOTSUPP if the kernel lacks any of
+   the count opcodes, or cannot tell. */
+int uring_probe(struct uring *ring, unsigned char const *opcodes, int count) {
+  static char buffer[sizeof(struct io_uring_probe) + sizeof(struct io_uring_probe_op) * 256];
+  struct io_uring_probe *probe = (struct io_uring_probe *)buffer;
+  memset(buffer, 0, sizeof(buffer));
+
+  if (uring_register(ring, IORING_REGISTER_PROBE, probe, 256) == -1) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  for(int i=0; i<count; i++) {
+    if ((opcodes[i] >= probe->ops_len) || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* Hands all queued entries to the kernel, and waits for at least
+   wait_nr completions. */
+int uring_submit(struct uring *ring, unsigned wait_nr) {
+  unsigned tail = *(ring->sq_tail);
+  unsigned to_submit = ring->sqe_tail - tail;
+
+  for(; tail != ring->sqe_tail; tail++) {
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+  }
+
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  int submitted;
+  do {
+    submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                        wait_nr?IORING_ENTER_GETEVENTS:0, NULL, 0);
+  } while ((submitted == -1) && (errno == EINTR));
+
+  return submitted;
+}
+
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    PERROR(==-1, uring_submit, ring, 0);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    ERROR(ring->sqe_tail - head >= ring->sq_entries, "io_uring: submission queue is full\n");
+  }
+
+  struct io_uring_sqe *sqe = &(ring->sqes[ring->sqe_tail & ring->sq_mask]);
+  ring->sqe_tail += 1;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+  unsigned head = *(ring->cq_head);
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  return &(ring->cqes[head & ring->cq_mask]);
+}
+
+
+void uring_cqe_seen(struct uring *ring) {
+  __atomic_store_n(ring->cq_head, *(ring->cq_head) + 1, __ATOMIC_RELEASE);
+}
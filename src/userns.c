@@ -31,11 +31,20 @@ struct command {
 
 static struct command commands[] = {
   {"spawn",    cmd_spawn},
+  {"init",     cmd_init},
+  {"pool",     cmd_pool},
   {"attach",   cmd_attach},
   {"listen",   cmd_listen},
   {"connect",  cmd_connect},
+  {"execd",    cmd_execd},
+  {"exec",     cmd_exec},
+  {"up",       cmd_up},
+  {"down",     cmd_down},
+  {"net",      cmd_net},
+  {"rules",    cmd_rules},
   {"socketd",  cmd_socketd},
   {"proxy",    cmd_proxy},
+  {"stats",    cmd_stats},
 };
 
 
@@ -1,11 +1,15 @@
 #include "global.h"
 
 
-void send_fd(int sock_fd, int fd) {
-  size_t controllen = sizeof(int);
-  char control[CMSG_SPACE(sizeof(int))];
+/* Sends count fds in one message. Returns -1 with errno set if it
+   could not be sent, e.g. EAGAIN when flags has MSG_DONTWAIT. */
+int send_fds(int sock_fd, int const *fds, int count, int flags) {
+  size_t controllen = sizeof(int) * count;
+  char control[CMSG_SPACE(sizeof(int) * SOCKETD_MAX_FDS)];
   char n = 0;
 
+  ERROR(count > SOCKETD_MAX_FDS, "cannot send %d fds in one message\n", count);
+
   struct iovec iov = {.iov_base = &n, .iov_len = 1};
   struct msghdr msg = {
     .msg_name = NULL,
@@ -22,16 +26,29 @@ void send_fd(int sock_fd, int fd) {
   cmsg->cmsg_type = SCM_RIGHTS;
   cmsg->cmsg_len = msg.msg_controllen;
 
-  int fds[1] = {fd};
   memcpy((int *) CMSG_DATA(cmsg), fds, controllen);
-  PERROR(==-1, sendmsg, sock_fd, &msg, 0);
+  ssize_t sent;
+  RETRY_ON_INTR(sent = sendmsg, sock_fd, &msg, flags|MSG_NOSIGNAL);
+  return (sent == -1)?-1:0;
 }
 
 
-int recv_fd(int sock_fd) {
-  char control[CMSG_SPACE(sizeof(int))];
+void send_fd(int sock_fd, int fd) {
+  PERROR(==-1, send_fds, sock_fd, &fd, 1, 0);
+}
+
+
+/* Receives one message carrying up to max fds. Returns the number of
+   fds, or -1 with errno set: EAGAIN if flags has MSG_DONTWAIT and
+   nothing is there yet, ECONNRESET if the peer has gone, EBADMSG if
+   the message has no fds or more than max. Nothing is left open on
+   failure. */
+int recv_fds(int sock_fd, int *fds, int max, int flags) {
+  char control[CMSG_SPACE(sizeof(int) * SOCKETD_MAX_FDS)];
   char n = 0;
 
+  ERROR(max > SOCKETD_MAX_FDS, "cannot receive %d fds in one message\n", max);
+
   struct iovec iov = {.iov_base = &n, .iov_len = 1};
   struct msghdr msg = {
     .msg_name = NULL,
@@ -39,23 +56,53 @@ int recv_fd(int sock_fd) {
     .msg_iov = &iov,
     .msg_iovlen = 1,
     .msg_control = control,
-    .msg_controllen = CMSG_LEN(sizeof(int)),
+    .msg_controllen = CMSG_SPACE(sizeof(int) * max),
     .msg_flags = 0,
   };
+
+  ssize_t received;
+  RETRY_ON_INTR(received = recvmsg, sock_fd, &msg, flags|MSG_CMSG_CLOEXEC);
+
+  if (received == -1) {
+    return -1;
+  }
+
+  if (received == 0) {
+    errno = ECONNRESET;
+    return -1;
+  }
+
   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  int *pfd = (int *)CMSG_DATA(cmsg);
-  *pfd = -1;
 
-  PERROR(==-1, recvmsg, sock_fd, &msg, 0);
+  if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+    errno = EBADMSG;
+    return -1;
+  }
 
-  cmsg = CMSG_FIRSTHDR(&msg);
+  int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
 
-  ERROR((cmsg==NULL) ||
-        (cmsg->cmsg_level != SOL_SOCKET) ||
-        (cmsg->cmsg_type != SCM_RIGHTS),
-        "cmsg: bad message!\n");
+  /* the kernel closed what did not fit, the rest is no use either */
+  if (msg.msg_flags & MSG_CTRUNC) {
+    for(int i=0; i<count; i++) {
+      close(fds[i]);
+      fds[i] = -1;
+    }
+    errno = EBADMSG;
+    return -1;
+  }
 
-  return *pfd;
+  return count;
+}
+
+
+/* Returns -1 if no fd came, see recv_fds. */
+int recv_fd(int sock_fd) {
+  int fd = -1;
+  if (recv_fds(sock_fd, &fd, 1, 0) == -1) {
+    return -1;
+  }
+  return fd;
 }
 
 
@@ -70,3 +117,268 @@ char *const *make_argv(int optind, int argc, char *const argv[]) {
     return argv + optind;
   }
 }
+
+
+/* Like fork, but the parent also gets a pidfd of the child, which
+   cannot end up pointing at another process once the pid is reused.
+   The child runs on a copy of the calling stack. */
+pid_t clone_pidfd(int flags, int *pidfd) {
+  struct clone_args args = {
+    .flags = flags|CLONE_PIDFD,
+    .pidfd = (uintptr_t)pidfd,
+    .exit_signal = SIGCHLD,
+  };
+
+  return syscall(SYS_clone3, &args, sizeof(args));
+}
+
+
+int open_pidfd(pid_t pid) {
+  return syscall(SYS_pidfd_open, pid, 0);
+}
+
+
+int signal_pidfd(int pidfd, int sig) {
+  return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+
+/* a pidfd polls readable once its process has exited */
+int pidfd_exited(int pidfd) {
+  struct pollfd pfd = {.fd = pidfd, .events = POLLIN};
+  return poll(&pfd, 1, 0) == 1;
+}
+
+
+/* Reaps the child behind pidfd, returns its exit status the way a
+   shell would. */
+int wait_pidfd(int pidfd) {
+  siginfo_t info = {0};
+  int result;
+  RETRY_ON_INTR(result = waitid, P_PIDFD, pidfd, &info, WEXITED);
+  ERROR(result == -1, "waitid: %s\n", strerror(errno));
+
+  if ((info.si_code == CLD_KILLED) || (info.si_code == CLD_DUMPED)) {
+    return info.si_status + 128;
+  }
+
+  return info.si_status;
+}
+
+
+/* The start time of pid in clock ticks since boot, field 22 of
+   /proc/PID/stat. With the pid it names a process for good. Returns 0
+   if there is no such process. */
+unsigned long long proc_start_time(pid_t pid) {
+  char path[PATH_MAX] = {0};
+  snprintf(path, PATH_MAX, "/proc/%ld/stat", (long)pid);
+
+  int fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    return 0;
+  }
+
+  char buf[1024];
+  ssize_t size = read(fd, buf, sizeof(buf)-1);
+  close(fd);
+
+  if (size <= 0) {
+    return 0;
+  }
+
+  buf[size] = '\0';
+
+  /* the command name may hold spaces and parens, skip past its end */
+  char *p = strrchr(buf, ')');
+  if (!p) {
+    return 0;
+  }
+
+  for(int field=2; field<22; field++) {
+    p = strchr(p+1, ' ');
+    if (!p) {
+      return 0;
+    }
+  }
+
+  return strtoull(p+1, NULL, 10);
+}
+
+
+static void append_string(char **data, size_t *size, size_t *capacity, char const *str) {
+  size_t len = strlen(str) + 1;
+
+  while (*size + len > *capacity) {
+    *capacity = (*capacity)?(*capacity * 2):4096;
+    *data = realloc(*data, *capacity);
+    ERROR(!*data, "cannot allocate exec request\n");
+  }
+
+  memcpy(*data + *size, str, len);
+  *size += len;
+}
+
+
+/* Sends our stdio, cwd and environment along with name and argv. */
+void send_exec_request(int sock_fd, char const *name, char *const argv[]) {
+  char cwd[PATH_MAX] = {0};
+  if (!getcwd(cwd, sizeof(cwd))) {
+    strcpy(cwd, "/");
+  }
+
+  char *data = NULL;
+  size_t size = 0, capacity = 0;
+  struct exec_request request = {0};
+
+  append_string(&data, &size, &capacity, name);
+  append_string(&data, &size, &capacity, cwd);
+
+  for(; argv[request.argc]; request.argc++) {
+    append_string(&data, &size, &capacity, argv[request.argc]);
+  }
+
+  for(; environ[request.envc]; request.envc++) {
+    append_string(&data, &size, &capacity, environ[request.envc]);
+  }
+
+  request.size = size;
+  ERROR(size > EXEC_REQUEST_MAX, "arguments and environment are too long\n");
+
+  int stdio_fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  PERROR(==-1, send_fds, sock_fd, stdio_fds, 3, 0);
+  PERROR(!=sizeof(request), send, sock_fd, &request, sizeof(request), MSG_NOSIGNAL);
+  PERROR(!=(ssize_t)size, send, sock_fd, data, size, MSG_NOSIGNAL);
+  free(data);
+}
+
+
+static char *next_string(char **p, char *end) {
+  char *s = *p;
+  char *nul = memchr(s, '\0', end-s);
+  if (!nul) {
+    return NULL;
+  }
+
+  *p = nul+1;
+  return s;
+}
+
+
+/* Reads a request sent by send_exec_request. Returns -1 if it is
+   broken, with nothing left open. */
+int recv_exec_request(int sock_fd, struct exec_command *command) {
+  struct exec_request request;
+  *command = (struct exec_command){.stdio = {-1, -1, -1}};
+
+  if (recv_fds(sock_fd, command->stdio, 3, 0) != 3) {
+    goto bad;
+  }
+
+  ssize_t received;
+  RETRY_ON_INTR(received = recv, sock_fd, &request, sizeof(request), MSG_WAITALL);
+
+  /* every string takes at least its nul */
+  if ((received != sizeof(request)) || !request.argc || (request.size > EXEC_REQUEST_MAX) ||
+      (request.argc > request.size) || (request.envc > request.size - request.argc)) {
+    goto bad;
+  }
+
+  command->data = malloc(request.size);
+  command->argv = calloc(request.argc + 1, sizeof(char *));
+  command->envp = calloc(request.envc + 1, sizeof(char *));
+  ERROR(!command->data || !command->argv || !command->envp, "cannot allocate exec request\n");
+
+  RETRY_ON_INTR(received = recv, sock_fd, command->data, request.size, MSG_WAITALL);
+  if (received != (ssize_t)request.size) {
+    goto bad;
+  }
+
+  char *p = command->data, *end = command->data + request.size;
+
+  if (!(command->name = next_string(&p, end)) || !(command->cwd = next_string(&p, end))) {
+    goto bad;
+  }
+
+  for(uint32_t i=0; i<request.argc; i++) {
+    if (!(command->argv[i] = next_string(&p, end))) {
+      goto bad;
+    }
+  }
+
+  for(uint32_t i=0; i<request.envc; i++) {
+    if (!(command->envp[i] = next_string(&p, end))) {
+      goto bad;
+    }
+  }
+
+  return 0;
+bad:
+  free_exec_command(command);
+  return -1;
+}
+
+
+void free_exec_command(struct exec_command *command) {
+  for(int i=0; i<3; i++) {
+    if (command->stdio[i] != -1) {
+      close(command->stdio[i]);
+      command->stdio[i] = -1;
+    }
+  }
+
+  free(command->data);
+  free(command->argv);
+  free(command->envp);
+  command->data = NULL;
+  command->argv = command->envp = NULL;
+}
+
+
+/* The command of an exec request does not run in our process group,
+   so signals, even those from the terminal, are passed on to it over
+   the connection. Returns a signalfd for them, to be made before the
+   request is sent. */
+int watch_forwarded_signals() {
+  static int const forwarded[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2};
+  sigset_t mask;
+  sigemptyset(&mask);
+
+  for(size_t i=0; i<sizeof(forwarded)/sizeof(int); i++) {
+    sigaddset(&mask, forwarded[i]);
+  }
+
+  PERROR(==-1, sigprocmask, SIG_BLOCK, &mask, NULL);
+
+  int signal_fd = -1;
+  PERROR(==-1, signal_fd = signalfd, -1, &mask, SFD_CLOEXEC);
+  return signal_fd;
+}
+
+
+/* Forwards signals from signal_fd until the exit status of the command
+   arrives on sock_fd. Returns -1 if the connection is lost first. */
+int wait_exec_status(int sock_fd, int signal_fd, int32_t *status) {
+  for(;;) {
+    struct pollfd pfds[2] = {
+      {.fd = sock_fd, .events = POLLIN},
+      {.fd = signal_fd, .events = POLLIN},
+    };
+
+    int ready;
+    RETRY_ON_INTR(ready = poll, pfds, 2, -1);
+    ERROR(ready == -1, "poll: %s\n", strerror(errno));
+
+    if (pfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      PERROR(!=sizeof(info), read, signal_fd, &info, sizeof(info));
+      int32_t sig = info.ssi_signo;
+      send(sock_fd, &sig, sizeof(sig), MSG_NOSIGNAL);
+    }
+
+    if (pfds[0].revents & (POLLIN|POLLHUP|POLLERR)) {
+      ssize_t received;
+      RETRY_ON_INTR(received = recv, sock_fd, status, sizeof(*status), MSG_WAITALL);
+      return (received == sizeof(*status))?0:-1;
+    }
+  }
+}